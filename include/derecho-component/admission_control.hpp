@@ -0,0 +1,76 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+namespace sospdemo {
+
+/**
+ * Bounds the requests a function tier node works on at a time, and the
+ * bytes of the photos they hold. A request that would exceed either budget
+ * is rejected before its photo is read, with a hint of when to retry.
+ */
+class AdmissionControl {
+    /**
+     * maximum number of requests at a time, 0 for unlimited
+     */
+    const uint32_t max_requests;
+    /**
+     * maximum bytes of the photos held at a time, 0 for unlimited
+     */
+    const uint64_t max_bytes;
+    uint32_t requests;
+    uint64_t bytes;
+    std::mutex admission_mutex;
+    /**
+     * moving average of the time a request is held, in microseconds
+     */
+    std::atomic<uint64_t> average_us;
+
+public:
+    /**
+     * An admitted request. The budgets are given back when it is destroyed.
+     */
+    class Ticket {
+        friend class AdmissionControl;
+        AdmissionControl* owner;
+        uint64_t bytes;
+        std::chrono::steady_clock::time_point admitted;
+
+    public:
+        Ticket() : owner(nullptr), bytes(0) {}
+        Ticket(const Ticket&) = delete;
+        Ticket(Ticket&& rhs);
+        Ticket& operator=(Ticket&& rhs);
+        ~Ticket();
+    };
+
+    /**
+     * constructor
+     * @param max_requests - maximum number of requests at a time, 0 for unlimited
+     * @param max_bytes - maximum bytes of the photos held at a time, 0 for unlimited
+     */
+    AdmissionControl(const uint32_t max_requests, const uint64_t max_bytes);
+
+    /**
+     * constructor with the budgets from the [SOSPDEMO] section of the configuration.
+     */
+    AdmissionControl();
+
+    /**
+     * Admit a request, if it fits in the budgets.
+     * @param request_bytes - the bytes the request will hold
+     * @param ticket - output: the ticket of the request, if admitted
+     * @return true if admitted
+     */
+    bool admit(const uint64_t request_bytes, Ticket& ticket);
+
+    /**
+     * @return how long a rejected client should wait before retrying, in
+     *         milliseconds: the time a request is usually held
+     */
+    uint32_t get_retry_after_ms() const;
+};
+
+}  // namespace sospdemo
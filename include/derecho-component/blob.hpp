@@ -1,7 +1,28 @@
 #pragma once
+#include <cstdint>
 #include <derecho/mutils-serialization/SerializationSupport.hpp>
+#include <memory>
+#include <string>
 
 namespace sospdemo {
+/**
+ * A fast, non-cryptographic 64-bit hash of a byte string.
+ * @param bytes - the data
+ * @param size - size of the data
+ * @return the hash
+ */
+uint64_t hash_bytes(const char* bytes, const std::size_t size);
+
+/**
+ * hash_bytes() with a seed. A secret seed keeps others from finding data
+ * with the same hash; hash_bytes() is the hash with seed 0.
+ * @param bytes - the data
+ * @param size - size of the data
+ * @param seed - the seed
+ * @return the hash
+ */
+uint64_t hash_bytes(const char* bytes, const std::size_t size, const uint64_t seed);
+
 /**
  * A serializable wrapper class for a Binary Large OBject (BLOB)
  * It does not take ownership of the data.
@@ -47,15 +68,21 @@ public:
 
 /**
  * Serialiazble Binary Large Object (BLOB)
- * It owns the data.
+ * It owns the data. The data is either on the heap or, after map_file(), a
+ * read-only mapping of a file that the kernel can page out. Copies share the
+ * data, which is freed with the last of them; only write to the data of a Blob
+ * that has not been copied.
  */
 class Blob : public mutils::ByteRepresentable {
 public:
     char* bytes;
     std::size_t size;
+    // true if bytes is a file mapping instead of a heap buffer
+    bool is_mapped;
 
-    // constructors
+    // constructors; b can be nullptr to allocate s bytes to be filled in later
     Blob(const char* const b, const decltype(size) s);
+    // shares the data of other
     Blob(const Blob& other);
     Blob(Blob&& other);
     Blob();
@@ -66,9 +93,33 @@ public:
     // move evaluator:
     Blob& operator=(Blob&& other);
 
-    // copy evaluator:
+    // copy evaluator, sharing the data of other:
     Blob& operator=(const Blob& other);
 
+    /**
+     * Share a part of the data, without copying it.
+     * @param offset - offset of the part
+     * @param length - size of the part
+     * @return a Blob of the part
+     */
+    Blob slice(const std::size_t offset, const std::size_t length) const;
+
+    /**
+     * Write the data to a file.
+     * @param file_path - the file, truncated if it exists
+     * @return 0 for success, a nonzero value for failure.
+     */
+    int write_file(const std::string& file_path) const;
+
+    /**
+     * Replace the data with a read-only mapping of a file written by write_file().
+     * The heap buffer is freed; the mapped pages are loaded on access and can be
+     * dropped by the kernel under memory pressure.
+     * @param file_path - the file
+     * @return 0 for success, a nonzero value for failure. The data is unchanged on failure.
+     */
+    int map_file(const std::string& file_path);
+
     // serialization/deserialization supports
     std::size_t to_bytes(char* buffer) const;
 
@@ -84,6 +135,10 @@ public:
             mutils::DeserializationManager* ctx,
             const char* const buffer,
             mutils::context_ptr<Blob> = mutils::context_ptr<Blob>{});
+
+private:
+    // the heap buffer or the file mapping bytes points into, shared by the copies
+    std::shared_ptr<char> storage;
 };
 
 }  // namespace sospdemo
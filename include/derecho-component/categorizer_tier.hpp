@@ -1,35 +1,319 @@
 #pragma once
 #include <derecho-component/blob.hpp>
+#include <derecho-component/result_cache.hpp>
+#include <derecho-component/segment_store.hpp>
 #include <derecho/core/derecho.hpp>
 #include <derecho/mutils-serialization/SerializationSupport.hpp>
+#include <mxnet-component/inference_batcher.hpp>
 #include <mxnet-component/inference_engine.hpp>
-#include <mxnet-cpp/MxNetCpp.h>
-#include <mxnet-cpp/initializer.h>
-#include <mxnet/c_api.h>
-#include <mxnet/tuple.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <shared_mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 namespace sospdemo {
+
+/**
+ * install_model() returns it when the model refers to a segment that neither
+ * the node has nor the install carries. The caller retries with all segments.
+ */
+#define INSTALL_MISSING_SEGMENTS (-2)
+
+/**
+ * The staged segments of an upload no chunk has arrived for in this long are
+ * dropped, see CategorizerTier::sweep_staged_segments().
+ */
+#define STAGED_UPLOAD_TIMEOUT_US (600000000ull)
+
+/**
+ * Counters of the inference engine cache of a categorizer node
+ */
+struct EngineCacheStats : public mutils::ByteRepresentable {
+    // requests that found their engine built
+    uint64_t hits;
+    // requests that had to wait for their engine to be built
+    uint64_t misses;
+    // engines evicted to stay within the budget
+    uint64_t evictions;
+    // footprint of the built engines
+    uint64_t resident_bytes;
+    // the memory budget, 0 for unlimited
+    uint64_t budget_bytes;
+
+    EngineCacheStats() : hits(0), misses(0), evictions(0), resident_bytes(0), budget_bytes(0) {}
+    EngineCacheStats(uint64_t& _hits, uint64_t& _misses, uint64_t& _evictions,
+                     uint64_t& _resident_bytes, uint64_t& _budget_bytes)
+            : hits(_hits), misses(_misses), evictions(_evictions), resident_bytes(_resident_bytes), budget_bytes(_budget_bytes) {}
+
+    DEFAULT_SERIALIZATION_SUPPORT(EngineCacheStats, hits, misses, evictions, resident_bytes, budget_bytes);
+};
+
 /**
  * The back end subgroup type
  */
 class CategorizerTier : public mutils::ByteRepresentable,
                         public derecho::GroupReference {
 protected:
-    // raw model data
+    // installed models, their data is in segments
     std::map<uint32_t, Model> raw_models;
-    // inference engines
-    std::map<uint32_t, std::unique_ptr<InferenceEngine>> inference_engines;
+    // model segments by content hash, stored once for all the models using them
+    SegmentStore segments;
+    // content hash -> number of references from raw_models; not serialized but
+    // recounted from raw_models
+    std::map<uint64_t, uint32_t> segment_refs;
+    // a built inference engine. Requests hold it by reference count, so an
+    // engine evicted or removed in the middle of a request is freed by the
+    // last request using it.
+    struct CachedEngine {
+        std::unique_ptr<InferenceEngine> engine;
+        std::size_t footprint;
+        // Model::version of the model it is built from
+        uint64_t model_version;
+        // steady clock ticks at the last request, for LRU eviction
+        std::atomic<uint64_t> last_used;
+    };
+    // the engine state of one tag. A slot is created the first time its tag
+    // is installed and lives as long as this object, so that a request can
+    // use it without holding inference_engines_mutex. Slots are aligned to
+    // cache lines, so requests for different tags never touch the same line.
+    struct alignas(64) EngineSlot {
+        // requests for this tag take only this mutex
+        std::mutex mutex;
+        // the tag is in raw_models
+        bool installed = false;
+        // the built engine, if any
+        std::shared_ptr<CachedEngine> engine;
+        // the load in progress, so that an engine is built once
+        std::shared_future<void> load;
+        // requests that found the engine built, or had to wait for it
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+    };
+    // tag -> slot. A directory is never modified once published: get_slot()
+    // publishes a copy with the new slot, and the old ones are kept until
+    // this object is destroyed, so that a reader never waits for a writer.
+    using SlotDirectory = std::map<uint32_t, EngineSlot*>;
+    std::atomic<const SlotDirectory*> slot_directory;
+    // all directories ever published, the current one last
+    std::vector<std::unique_ptr<const SlotDirectory>> slot_directories;
+    std::deque<std::unique_ptr<EngineSlot>> slots;
+    // protects raw_models, segments, and the slots. The installed and engine
+    // members of a slot change only under this mutex held exclusively and the
+    // slot mutex; inference() takes only the slot mutex.
     std::shared_mutex inference_engines_mutex;
+    // memory budget for the built engines, 0 for unlimited
+    const uint64_t engine_memory_budget;
+    // total footprint of the built engines
+    uint64_t engine_resident_bytes;
+    std::atomic<uint64_t> engine_evictions;
+    // runs the photos of a request in forward passes of batch_max_size
+    InferenceBatcher batcher;
+    // guesses of recent photos, keyed by the model version
+    ResultCache result_cache;
+    // page out the raw model data to model_page_path once its engine is built
+    const bool page_out_models;
+    const std::string model_page_path;
+    // keep the catalog of the paged out models in model_page_path, to restore
+    // them when the node restarts
+    const bool durable_models;
+    // serializes the writers of the catalog file
+    std::mutex catalog_mutex;
+    // when the catalog restored from disk was saved, 0 if none was; the
+    // loader announces the restored models to the shard, see
+    // ordered_reconcile_catalog(). They are set before the loader starts.
+    uint64_t restored_catalog_us;
+    std::map<uint32_t, Model> restored_models;
+    // content hash -> size, for the segments of restored_models
+    std::map<uint64_t, uint64_t> restored_segment_sizes;
+    // when the catalog the shard agreed on was saved, 0 before any. Only the
+    // ordered handlers use it, so it needs no lock.
+    uint64_t adopted_catalog_us;
+    // the tags installed or removed since this node started, which no
+    // restored catalog overrides. Only the ordered handlers use it.
+    std::set<uint32_t> ordered_tags;
+    // size of the chunks segments are installed and fetched in
+    const uint64_t install_chunk_size;
+    // a segment being assembled from the chunks of an install
+    struct StagedSegment {
+        Blob data;
+        // bytes received so far, the chunks arrive in order
+        uint64_t received;
+        // false after a chunk out of order, which fails the install
+        bool valid;
+    };
+    // (upload id, content hash) -> segment, until the install commits or is
+    // aborted. Only the ordered handlers use it, so it needs no lock.
+    std::map<std::pair<uint64_t, uint64_t>, StagedSegment> staged_segments;
+    // upload id -> stamp_us of its last chunk, for the uploads in staged_segments
+    std::map<uint64_t, uint64_t> staged_uploads;
+    // the background engine loader
+    std::deque<std::pair<uint32_t, std::promise<void>>> load_queue;
+    std::mutex load_queue_mutex;
+    std::condition_variable load_queue_cv;
+    bool loader_stopped;
+    // started at the end of the constructor
+    std::thread loader_thread;
+
+    /**
+     * Identify the objects in the photos of a tag, see inference_batch().
+     * @param tag - the tag of the photos
+     * @param photos - the photos of the request
+     * @param indices - the positions in photos of the photos of this tag
+     * @param guesses - the guesses of the request, set at the same positions
+     */
+    void run_inference(const uint32_t tag, const std::vector<Photo>& photos,
+                       const std::vector<std::size_t>& indices, std::vector<Guess>& guesses);
+
+    /**
+     * Drop the staged segments of an upload.
+     * @param upload_id - the upload
+     */
+    void drop_staged_upload(const uint64_t upload_id);
+
+    /**
+     * Drop the uploads that will never commit: those of a function tier node
+     * that has left the group, and those no chunk has arrived for in
+     * STAGED_UPLOAD_TIMEOUT_US. It runs in the ordered handlers with the
+     * stamp of the message, so all replicas drop the same uploads.
+     * @param stamp_us - the stamp of the chunk being staged
+     */
+    void sweep_staged_segments(const uint64_t stamp_us);
+
+    /**
+     * Find the slot of a tag without taking any lock.
+     * @param tag - model tag
+     * @return the slot, nullptr if the tag has never been installed
+     */
+    EngineSlot* find_slot(const uint32_t tag) const;
+
+    /**
+     * Find or create the slot of a tag. The caller must hold
+     * inference_engines_mutex exclusively.
+     * @param tag - model tag
+     * @return the slot
+     */
+    EngineSlot* get_slot(const uint32_t tag);
+
+    /**
+     * Build and warm up the engine of a model in the loader thread, unless it
+     * is built or being built already.
+     * @param tag - model tag
+     * @return a future that is ready when the engine is built or failed to build
+     */
+    std::shared_future<void> load_engine_async(const uint32_t tag);
+
+    /**
+     * The loader thread
+     */
+    void loader_loop();
+
+    /**
+     * Wait for the group to be attached, which happens after the state
+     * transfer has constructed this object. It is called by the loader thread.
+     * @return false if the loader is stopped first
+     */
+    bool wait_for_group();
+
+    /**
+     * Send the models restored from disk to the shard, so that the replicas
+     * agree on them, see ordered_reconcile_catalog(). It is called by the
+     * loader thread.
+     */
+    void announce_catalog();
+
+    /**
+     * Evict the least recently used engines until there is room for another
+     * one. The caller must hold inference_engines_mutex exclusively. Evicted
+     * engines are rebuilt from raw_models by the next request for them.
+     * @param needed_bytes - footprint of the engine to make room for
+     */
+    void evict_engines(const std::size_t needed_bytes);
+
+    /**
+     * @param segment_id - content hash of a segment
+     * @return the file the segment is paged out to
+     */
+    std::string get_segment_page_file(const uint64_t segment_id) const;
+
+    /**
+     * Move the segments of a tag to file mappings, so that only the engine's
+     * copy of the weights stays resident. The mappings are read back in for
+     * state transfer and engine rebuilds.
+     * @param tag - model tag
+     */
+    void page_out_model(const uint32_t tag);
+
+    /**
+     * @return the file listing the models on disk
+     */
+    std::string get_catalog_file() const;
+
+    /**
+     * Write the catalog of the models whose segments are all on disk, see
+     * durable_models. The caller must hold inference_engines_mutex.
+     */
+    void save_catalog();
+
+    /**
+     * Restore the models of the catalog on disk, dropping the models whose
+     * segments are missing or corrupted. A truncated or corrupted catalog,
+     * which does not match the size and hash in its header, is ignored. Only a node that starts a new group
+     * calls it; a node joining an existing shard gets the models by state
+     * transfer instead.
+     */
+    void load_catalog();
+
+    /**
+     * Find the segments a state transfer carried by reference on disk.
+     */
+    void find_referenced_segments();
+
+    /**
+     * Fetch the segments of a model that are neither here nor on disk from
+     * the other members of the shard. It is called by the loader thread.
+     * @param tag - model tag
+     */
+    void fetch_segments(const uint32_t tag);
+
+    /**
+     * Drop an installed model, its engine and its cached guesses. The caller
+     * must hold inference_engines_mutex exclusively.
+     * @param tag - model tag
+     */
+    void drop_model(const uint32_t tag);
+
+    /**
+     * Drop the references of a model to its segments, and the segments no
+     * other model uses. The caller must hold inference_engines_mutex exclusively.
+     * @param model - the model being removed
+     */
+    void release_segments(const Model& model);
+
+    /**
+     * The constructor the public ones delegate to.
+     * @param restore_catalog - true to restore the models on disk
+     */
+    CategorizerTier(const std::map<uint32_t, Model>& _raw_models,
+                    const SegmentStore& _segments,
+                    const bool restore_catalog);
 
 public:
     /**
      * Constructors
+     * The first one restores the models on disk if durable_models is set. The
+     * second one is used by state transfer when a node joins. Both start
+     * building the engines of all models right away.
      */
-    CategorizerTier() {}
-    CategorizerTier(std::map<uint32_t, Model>& _raw_models)
-            : raw_models(_raw_models) {}
+    CategorizerTier();
+    CategorizerTier(const std::map<uint32_t, Model>& _raw_models,
+                    const SegmentStore& _segments);
 
     /**
      * Destructor
@@ -37,22 +321,104 @@ public:
     ~CategorizerTier();
 
     /**
-     * Identify an object.
+     * Identify the objects in a batch of photos. The function tier sends the
+     * photos it has queued for this node together, and the photos of a tag
+     * run in one forward pass.
+     * @param photos - the photos
+     * @return one guess per photo in the same order
+     */
+    std::vector<Guess> inference_batch(const std::vector<Photo>& photos);
+
+    /**
+     * Get the counters of the inference engine cache, to size its budget.
+     * @return the counters
+     */
+    EngineCacheStats get_engine_cache_stats();
+
+    /**
+     * Find the segments this node does not have, so that an install only
+     * carries those.
+     * @param segment_ids - content hashes of the segments of a model
+     * @return the content hashes of the missing segments
+     */
+    std::vector<uint64_t> missing_segments(const std::vector<uint64_t>& segment_ids);
+
+    /**
+     * Get a chunk of a segment, for a member of the shard that lost it.
+     * @param segment_id - content hash
+     * @param offset - offset of the chunk in the segment
+     * @param size - size of the chunk
+     * @return the chunk, empty if this node does not have the segment
      */
-    Guess inference(const Photo& photo);
+    Blob get_segment(const uint64_t& segment_id, const uint64_t& offset, const uint64_t& size);
+
+    /**
+     * Pass a chunk of a segment to all replicas, for an install to come. It
+     * returns once the chunk is sent, so that the chunks of an install are
+     * pipelined and inference requests to this node are served in between.
+     * @param upload_id - identifies the install
+     * @param segment_id - content hash of the segment
+     * @param segment_size - size of the segment
+     * @param offset - offset of the chunk in the segment
+     * @param chunk - the chunk
+     * @return 0 for success, a nonzero value for failure.
+     */
+    int stage_chunk(const uint64_t& upload_id, const uint64_t& segment_id,
+                    const uint64_t& segment_size, const uint64_t& offset,
+                    const BlobWrapper& chunk);
+
+    /**
+     * Add a chunk to a staged segment in all replicas. A replica that joined
+     * after the first chunk drops the chunks of the install, and fetches the
+     * segment from the shard after the commit.
+     * @param upload_id - identifies the install
+     * @param segment_id - content hash of the segment
+     * @param segment_size - size of the segment
+     * @param offset - offset of the chunk in the segment
+     * @param chunk - the chunk
+     * @param stamp_us - wall clock time the member that received the chunk
+     *        passed it on at, in microseconds
+     * @return 0 for success, a nonzero value for failure.
+     */
+    int ordered_stage_chunk(const uint64_t& upload_id, const uint64_t& segment_id,
+                            const uint64_t& segment_size, const uint64_t& offset,
+                            const BlobWrapper& chunk, const uint64_t& stamp_us);
+
+    /**
+     * Drop the staged segments of an install that will not be committed, in
+     * all replicas.
+     * @param upload_id - identifies the install
+     * @return 0 for success, a nonzero value for failure.
+     */
+    int abort_upload(const uint64_t& upload_id);
+
+    /**
+     * Drop the staged segments of an upload in all replicas.
+     * @param upload_id - identifies the install
+     * @return 0
+     */
+    int ordered_abort_upload(const uint64_t& upload_id);
 
     /**
      * Install Model
      * @param tag - model tag
-     * @param synset_size - size of the synset data
-     * @param symbol_size - size of the symbol data
-     * @param params_size - size of the parameters
-     * @param model_data - model data (synset_size + symbol_size + params_size)
-     * @return 0 for success, a nonzero value for failure.
+     * @param params_format - format of the parameters, a ParamsFormat value
+     * @param backend - the inference backend, an InferenceBackend value
+     * @param segment_ids - content hashes of the model segments: synset, symbol
+     *        and parameters, see MODEL_SEGMENT_SYNSET
+     * @param carried_ids - content hashes of the segments the shard does not
+     *        have, staged by stage_chunk()
+     * @param carried_sizes - sizes of the carried segments
+     * @param upload_id - the upload id the carried segments are staged with
+     * @return 0 for success, INSTALL_MISSING_SEGMENTS if a segment is neither
+     *         on the shard nor carried, another nonzero value for failure.
      */
-    int install_model(const uint32_t& tag, const ssize_t& synset_size,
-                      const ssize_t& symbol_size, const ssize_t& params_size,
-                      const BlobWrapper& model_data);
+    int install_model(const uint32_t& tag, const uint32_t& params_format,
+                      const uint32_t& backend,
+                      const std::vector<uint64_t>& segment_ids,
+                      const std::vector<uint64_t>& carried_ids,
+                      const std::vector<uint64_t>& carried_sizes,
+                      const uint64_t& upload_id);
 
     /**
      * Remove Model
@@ -64,16 +430,21 @@ public:
     /**
      * Install Model in all replicas
      * @param tag - model tag
-     * @param synset_size - size of the synset data
-     * @param symbol_size - size of the symbol data
-     * @param params_size - size of the parameters
-     * @param model_data - model data (synset_size + symbol_size + params_size)
-     * @return 0 for success, a nonzero value for failure.
+     * @param params_format - format of the parameters, a ParamsFormat value
+     * @param backend - the inference backend, an InferenceBackend value
+     * @param segment_ids - content hashes of the model segments
+     * @param carried_ids - content hashes of the staged segments
+     * @param carried_sizes - sizes of the carried segments
+     * @param upload_id - the upload id the carried segments are staged with
+     * @return 0 for success, INSTALL_MISSING_SEGMENTS if a segment is neither
+     *         on the shard nor carried, another nonzero value for failure.
      */
-    int ordered_install_model(const uint32_t& tag, const ssize_t& synset_size,
-                              const ssize_t& symbol_size,
-                              const ssize_t& params_size,
-                              const BlobWrapper& model_data);
+    int ordered_install_model(const uint32_t& tag, const uint32_t& params_format,
+                              const uint32_t& backend,
+                              const std::vector<uint64_t>& segment_ids,
+                              const std::vector<uint64_t>& carried_ids,
+                              const std::vector<uint64_t>& carried_sizes,
+                              const uint64_t& upload_id);
 
     /**
      * Remove Model in all replicas
@@ -82,11 +453,31 @@ public:
      */
     int ordered_remove_model(const uint32_t& tag);
 
-    REGISTER_RPC_FUNCTIONS(CategorizerTier, inference, install_model,
+    /**
+     * Reconcile the models restored from disk across the shard. Each node
+     * restores the catalog it saved last, which may be older than the others'
+     * if it was down meanwhile, so the newest catalog announced wins: the
+     * restored models it does not have, or has in another version, are
+     * dropped, and the models it has that are missing here are installed and
+     * their segments fetched from the shard. The tags installed or removed
+     * since the node started are left alone.
+     * @param saved_us - when the catalog was saved
+     * @param models - the models of the catalog
+     * @param segment_sizes - content hash -> size, for the segments of the models
+     * @return 0
+     */
+    int ordered_reconcile_catalog(const uint64_t& saved_us,
+                                  const std::map<uint32_t, Model>& models,
+                                  const std::map<uint64_t, uint64_t>& segment_sizes);
+
+    REGISTER_RPC_FUNCTIONS(CategorizerTier, inference_batch, install_model,
                            remove_model, ordered_install_model,
-                           ordered_remove_model);
+                           ordered_remove_model, get_engine_cache_stats,
+                           missing_segments, get_segment, stage_chunk,
+                           ordered_stage_chunk, abort_upload,
+                           ordered_abort_upload, ordered_reconcile_catalog);
 
-    DEFAULT_SERIALIZATION_SUPPORT(CategorizerTier, raw_models);
+    DEFAULT_SERIALIZATION_SUPPORT(CategorizerTier, raw_models, segments);
 };
 
 }  // namespace sospdemo
@@ -0,0 +1,75 @@
+#pragma once
+#include <derecho/core/derecho.hpp>
+#include <string>
+
+/**
+ * sospdemo configuration keys, all in the [SOSPDEMO] section of derecho.cfg.
+ * They are optional: a missing key falls back to the default given at the
+ * place where it is read.
+ */
+// photos for the same tag sent to a categorizer node in one request
+#define CONF_SOSPDEMO_BATCH_MAX_SIZE "SOSPDEMO/batch_max_size"
+// inference engine executor pool
+#define CONF_SOSPDEMO_EXECUTOR_POOL_SIZE "SOSPDEMO/executor_pool_size"
+// paging out the raw model data once its engine is built
+#define CONF_SOSPDEMO_PAGE_OUT_MODELS "SOSPDEMO/page_out_models"
+#define CONF_SOSPDEMO_MODEL_PAGE_PATH "SOSPDEMO/model_page_path"
+// keeping the models of a categorizer node on its disk across restarts
+#define CONF_SOSPDEMO_DURABLE_MODELS "SOSPDEMO/durable_models"
+// size of the chunks model segments are installed and fetched in
+#define CONF_SOSPDEMO_INSTALL_CHUNK_SIZE "SOSPDEMO/install_chunk_size"
+// number of categorizer tier shards a model is installed on
+#define CONF_SOSPDEMO_MODEL_REPLICATION "SOSPDEMO/model_replication"
+// hedging inference requests to a second categorizer replica
+#define CONF_SOSPDEMO_HEDGE_REQUESTS "SOSPDEMO/hedge_requests"
+#define CONF_SOSPDEMO_HEDGE_MAX_PERCENT "SOSPDEMO/hedge_max_percent"
+// admission control: the requests and photo bytes a function tier node holds
+// at a time, and the requests it has outstanding at each categorizer node
+#define CONF_SOSPDEMO_MAX_INFLIGHT_REQUESTS "SOSPDEMO/max_inflight_requests"
+#define CONF_SOSPDEMO_MAX_INFLIGHT_PHOTO_MB "SOSPDEMO/max_inflight_photo_mb"
+#define CONF_SOSPDEMO_MAX_QUEUE_DEPTH "SOSPDEMO/max_queue_depth"
+// asynchronous gRPC server of the function tier: completion queue threads and their CPUs
+#define CONF_SOSPDEMO_GRPC_THREADS "SOSPDEMO/grpc_threads"
+#define CONF_SOSPDEMO_GRPC_CORES "SOSPDEMO/grpc_cores"
+// photos of at most this many KB are sent by the client in one WhatsthisUnary message
+#define CONF_SOSPDEMO_UNARY_PHOTO_MAX_KB "SOSPDEMO/unary_photo_max_kb"
+// memory budget of the built inference engines of a categorizer node
+#define CONF_SOSPDEMO_ENGINE_MEMORY_BUDGET_MB "SOSPDEMO/engine_memory_budget_mb"
+// number of inference results cached by each function tier and categorizer tier node
+#define CONF_SOSPDEMO_RESULT_CACHE_SIZE "SOSPDEMO/result_cache_size"
+// CPU partitioning, see cpu_plan.hpp
+#define CONF_SOSPDEMO_CPU_PLAN "SOSPDEMO/cpu_plan"
+#define CONF_SOSPDEMO_SERVICE_CORES "SOSPDEMO/service_cores"
+#define CONF_SOSPDEMO_INFERENCE_CORES "SOSPDEMO/inference_cores"
+#define CONF_SOSPDEMO_INTRA_OP_THREADS "SOSPDEMO/intra_op_threads"
+#define CONF_SOSPDEMO_CONCURRENT_ENGINES "SOSPDEMO/concurrent_engines"
+
+namespace sospdemo {
+
+/**
+ * Read an optional unsigned integer from the configuration.
+ * @param key - the configuration key
+ * @param default_value - the value to use if the key is not configured
+ * @return the configured value or default_value
+ */
+inline uint32_t get_conf_uint32(const std::string& key, const uint32_t default_value) {
+    if(derecho::hasCustomizedConfKey(key)) {
+        return derecho::getConfUInt32(key);
+    }
+    return default_value;
+}
+
+/**
+ * Read an optional string from the configuration.
+ * @param key - the configuration key
+ * @param default_value - the value to use if the key is not configured
+ * @return the configured value or default_value
+ */
+inline std::string get_conf_string(const std::string& key, const std::string& default_value) {
+    if(derecho::hasCustomizedConfKey(key)) {
+        return derecho::getConfString(key);
+    }
+    return default_value;
+}
+
+}  // namespace sospdemo
@@ -0,0 +1,70 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace sospdemo {
+
+/**
+ * How a server node splits its CPUs between the Derecho threads and inference.
+ * It is read from the [SOSPDEMO] section of the configuration:
+ * - cpu_plan: none (default), latency, throughput or custom
+ * - service_cores: CPU list for the Derecho SST/RPC threads, e.g. "0-1".
+ *   Defaults to the first CPU the process may run on.
+ * - inference_cores: CPU list for inference. Defaults to the other CPUs.
+ * - intra_op_threads: threads used by one forward pass
+ * - concurrent_engines: forward passes running at the same time
+ * The latency preset gives all inference cores to one forward pass at a time,
+ * the throughput preset runs one single-threaded forward pass per core. Either
+ * can be adjusted with intra_op_threads and concurrent_engines. An unknown
+ * preset or a malformed CPU list disables the plan, as for none.
+ */
+struct CpuPlan {
+    // false for "none": the process keeps the CPUs and the MXNet defaults it is started with
+    bool enabled;
+    std::string name;
+    std::vector<int> service_cores;
+    std::vector<int> inference_cores;
+    uint32_t intra_op_threads;
+    uint32_t concurrent_engines;
+};
+
+/**
+ * @return the CPU plan of this node, read once from the configuration
+ */
+const CpuPlan& get_cpu_plan();
+
+/**
+ * Parse a CPU list like "0-3,8,10-11".
+ * @param cpu_list - the CPU list
+ * @param cores - output: the CPUs
+ * @return 0 for success, a nonzero value if the list is malformed
+ */
+int parse_cpu_list(const std::string& cpu_list, std::vector<int>& cores);
+
+/**
+ * Restrict the calling thread, and the threads it creates from now on, to a set of CPUs.
+ * @param cores - the CPUs, nothing happens if it is empty
+ * @return 0 for success, a nonzero value for failure
+ */
+int pin_current_thread(const std::vector<int>& cores);
+
+/**
+ * Apply the process-wide part of the CPU plan. It must be called by the main
+ * thread before the Derecho group is created and before any MXNet call:
+ * - the MXNet thread counts are set from intra_op_threads and concurrent_engines
+ * - the main thread is pinned to the service cores, so the Derecho threads
+ *   inherit them
+ * Inference threads move to the inference cores with enter_inference_cores().
+ */
+void apply_cpu_plan();
+
+/**
+ * Move the calling thread to the inference cores, and give the OpenMP
+ * regions it runs intra_op_threads threads. Every thread that decodes photos
+ * or runs forward passes calls it first, see CategorizerTier::loader_loop()
+ * and InferenceBatcher. Nothing happens without a CPU plan.
+ */
+void enter_inference_cores();
+
+}  // namespace sospdemo
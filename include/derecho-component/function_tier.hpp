@@ -1,46 +1,462 @@
 #pragma once
+#include <derecho-component/admission_control.hpp>
+#include <derecho-component/blob.hpp>
+#include <derecho-component/config.hpp>
+#include <derecho-component/result_cache.hpp>
 #include <derecho/core/derecho.hpp>
 #include <derecho/mutils-serialization/SerializationSupport.hpp>
 #include <function_tier.grpc.pb.h>
 #include <grpcpp/grpcpp.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
 
 namespace sospdemo {
 
 #define FUNCTION_TIER_GRPC_PORT_BASE (28000)
+// chunks of a model install in flight to the categorizer tier at a time
+#define INSTALL_CHUNK_WINDOW (4)
+// a request is hedged when it takes longer than this percentile of its tag
+#define HEDGE_PERCENTILE (95)
+// latency samples of a tag needed before its requests are hedged
+#define HEDGE_MIN_SAMPLES (20)
+// the latency histogram of a tag is halved every this many samples, to follow changes
+#define HEDGE_WINDOW (1000)
+// a receiver waiting for a reply of a categorizer node checks this often
+// whether the function tier is shutting down
+#define REPLY_WAIT_SLICE_MS (100)
+// room left in a p2p request for everything but the photos of a batch
+#define BATCH_HEADER_BYTES (4096)
+// latency histogram buckets, four per power of two microseconds
+#define LATENCY_BUCKETS (128)
+
+/**
+ * Counters of the hedged requests of a function tier node
+ */
+struct HedgeStats : public mutils::ByteRepresentable {
+    // inference requests sent to the categorizer tier
+    uint64_t requests;
+    // requests also sent to a second replica
+    uint64_t hedged;
+    // hedged requests the second replica answered first
+    uint64_t wins;
+
+    HedgeStats() : requests(0), hedged(0), wins(0) {}
+    HedgeStats(uint64_t& _requests, uint64_t& _hedged, uint64_t& _wins)
+            : requests(_requests), hedged(_hedged), wins(_wins) {}
+
+    DEFAULT_SERIALIZATION_SUPPORT(HedgeStats, requests, hedged, wins);
+};
+
+class PhotoCall;
 
 /**
  * The front end subgroup type.
- * It appears to do nothing (has no registered RPC methods) since it provides
- * no services to other Derecho nodes.
+ * It serves the clients over gRPC and dispatches their requests to the
+ * categorizer tier. Whatsthis and WhatsthisUnary are served asynchronously,
+ * see PhotoCall; the model operations are rare and keep the synchronous
+ * handlers.
  */
 class FunctionTier : public mutils::ByteRepresentable,
                      public derecho::GroupReference,
-                     public FunctionTierService::Service {
+                     public FunctionTierService::WithAsyncMethod_WhatsthisUnary<
+                             FunctionTierService::WithAsyncMethod_Whatsthis<FunctionTierService::Service>> {
+    friend class PhotoCall;
+
 protected:
     /**
-     * photo tag -> shard number
-     * all photos with an unknown tag will be directed to shard 0.
+     * photo tag -> the categorizer tier shards hosting its model
+     * It is replicated: installs and removes update it on all function tier
+     * nodes, see ordered_set_placement(). All photos with an unknown tag will
+     * be directed to shard tag % number of shards.
+     */
+    std::map<uint32_t, std::vector<uint32_t>> tag_to_shard;
+    std::shared_mutex tag_to_shard_mutex;
+
+    /**
+     * the members of the categorizer tier shards, read once per view
+     */
+    struct ShardView {
+        // view_epoch when the members were read
+        uint64_t epoch;
+        std::vector<std::vector<node_id_t>> shards;
+    };
+    std::shared_ptr<const ShardView> shard_view;
+    std::mutex shard_view_mutex;
+    // bumped on every view change, see on_new_view()
+    static std::atomic<uint64_t> view_epoch;
+    // spreads the requests for a tag over the shards hosting it
+    std::atomic<uint64_t> next_shard;
+
+    /**
+     * what this node knows about the load of a categorizer node
+     */
+    struct ReplicaLoad {
+        // inference requests this node has queued or sent to the node, and
+        // not had answered yet: its queue there, as no other function tier
+        // node adds to it
+        std::atomic<uint32_t> outstanding{0};
+        // moving average of the time per photo in microseconds
+        std::atomic<uint64_t> service_time_us{0};
+    };
+    // categorizer node -> its load; entries are never removed
+    std::map<node_id_t, std::unique_ptr<ReplicaLoad>> replica_loads;
+    std::shared_mutex replica_loads_mutex;
+    // requests beyond this many outstanding at a categorizer node are
+    // rejected, 0 for unlimited
+    uint32_t max_queue_depth;
+
+    // send a request that is slow to answer to a second replica, see
+    // poll_inquiry(). At most hedge_max_percent of the requests are hedged.
+    bool hedge_requests;
+    uint32_t hedge_max_percent;
+    std::atomic<uint64_t> inference_requests;
+    std::atomic<uint64_t> hedged_requests;
+    std::atomic<uint64_t> hedge_wins;
+    /**
+     * the latency histogram of a tag
      */
-    std::map<uint64_t, ssize_t> tag_to_shard;
+    struct LatencyTracker {
+        std::mutex mutex;
+        std::vector<uint32_t> buckets = std::vector<uint32_t>(LATENCY_BUCKETS, 0);
+        uint32_t samples = 0;
+    };
+    // tag -> its latency histogram; entries are never removed
+    std::map<uint32_t, std::unique_ptr<LatencyTracker>> latency_trackers;
+    std::shared_mutex latency_trackers_mutex;
+
+    // bounds the requests and photo bytes this node holds, see
+    // PhotoCall::admit()
+    AdmissionControl admission;
 
     std::atomic<bool> started;
     std::mutex service_mutex;
     std::unique_ptr<grpc::Server> server;
+    // one completion queue per thread, see serve_completion_queue()
+    std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> completion_queues;
+    std::vector<std::thread> completion_threads;
+    /**
+     * the calls waiting for the categorizer tier, see poll_calls(). New calls
+     * are handed over in new_calls; wake_poller() sets poll_requested.
+     */
+    std::vector<PhotoCall*> new_calls;
+    bool poll_requested;
+    bool stop_poller;
+    std::mutex poller_mutex;
+    std::condition_variable poller_cv;
+    std::thread poller_thread;
+    // numbers the model installs of this node, see CategorizerTier::stage_chunk()
+    std::atomic<uint32_t> next_upload_id;
+
+    /**
+     * guesses of recent photos. The function tier does not know the model
+     * versions; installs and removes invalidate the tag on all function tier
+     * nodes instead, see invalidate_results().
+     */
+    ResultCache result_cache;
+
+    /**
+     * Drop the cached guesses of a model on all the function tier nodes.
+     * @param tag - model tag
+     */
+    void invalidate_results(const uint32_t tag);
+
+    /**
+     * @return the members of the categorizer tier shards in the current view
+     */
+    std::shared_ptr<const ShardView> get_shard_view();
+
+    /**
+     * Find the shards hosting a model.
+     * @param tag - model tag
+     * @param num_shards - number of categorizer tier shards
+     * @return the shards, at least one
+     */
+    std::vector<uint32_t> get_shards(const uint32_t tag, const uint32_t num_shards);
+
+    /**
+     * Choose the shards for a new model: shard tag % num_shards, like an
+     * unknown tag, and the shards hosting the fewest models up to
+     * model_replication shards. A placed tag keeps its shards.
+     * @param tag - model tag
+     * @param num_shards - number of categorizer tier shards
+     * @return the shards
+     */
+    std::vector<uint32_t> place_model(const uint32_t tag, const uint32_t num_shards);
+
+    /**
+     * Set the shards of a model on all the function tier nodes.
+     * @param tag - model tag
+     * @param shards - the shards, empty to drop the tag
+     */
+    void set_placement(const uint32_t tag, const std::vector<uint32_t>& shards);
+
+    /**
+     * @param node - a categorizer node
+     * @return the load of the node
+     */
+    ReplicaLoad& get_replica_load(const node_id_t node);
+
+    /**
+     * Pick a member of a shard with the power of two choices: of two random
+     * members, the one with the lower expected wait. The wait is estimated
+     * from the requests this node has outstanding there and the average
+     * time per photo of the member. A member that has never replied is
+     * tried first.
+     * @param members - the members of the shard
+     * @return the member. It throws std::runtime_error if the shard has no
+     *         members.
+     */
+    node_id_t pick_replica(const std::vector<node_id_t>& members);
+
+    /**
+     * @param tag - model tag
+     * @return the latency histogram of the tag
+     */
+    LatencyTracker& get_latency_tracker(const uint32_t tag);
+
+    /**
+     * @param tag - model tag
+     * @return the HEDGE_PERCENTILE latency of the tag in microseconds, 0 if
+     *         there are not enough samples yet
+     */
+    uint64_t get_hedge_delay_us(const uint32_t tag);
+
+    /**
+     * Add a latency sample to the histogram of a tag.
+     * @param tag - model tag
+     * @param latency_us - the latency in microseconds
+     */
+    void record_latency(const uint32_t tag, const uint64_t latency_us);
+
+    /**
+     * A photo asked to a shard, waiting for its guess. The call asking it,
+     * and the senders and receivers of the members it is sent to share it,
+     * see ReplicaChannel; its members below mutex are guarded by it. It ends
+     * its result cache flight with the first reply, or when the client gives
+     * up.
+     */
+    struct Inquiry {
+        const std::vector<node_id_t> members;
+        // owned by the call, which keeps it until unsent is 0
+        const Photo& photo;
+        const uint32_t tag;
+        std::mutex mutex;
+        // nullptr once the inquiry has ended
+        std::unique_ptr<ResultCache::Flight> flight;
+        node_id_t target;
+        // steady clock time the photo was asked at, in microseconds
+        uint64_t start_us;
+        // the second member of a hedged request
+        bool hedged;
+        node_id_t hedge_target;
+        // when to hedge the request, UINT64_MAX for never
+        uint64_t hedge_at_us;
+        // requests queued or sent, and not answered yet
+        uint32_t pending;
+        // requests queued, whose sender has not serialized the photo yet
+        uint32_t unsent;
+
+        Inquiry(const std::vector<node_id_t>& _members, const Photo& _photo,
+                std::unique_ptr<ResultCache::Flight> _flight)
+                : members(_members), photo(_photo), tag(_photo.tag), flight(std::move(_flight)), target(0),
+                  start_us(0), hedged(false), hedge_target(0), hedge_at_us(UINT64_MAX), pending(0), unsent(0) {}
+    };
+
+    /**
+     * The requests to a categorizer node. Its sender thread sends them in the
+     * order they are queued, so that neither the completion queue threads
+     * nor the reply poller ever wait for the p2p window of the node. The
+     * requests for the same tag queued while the previous batch was in
+     * flight go in one p2p request, up to batch_max_size of them, and run in
+     * one forward pass. Its receiver thread waits for the replies, which the
+     * node sends in the same order, and ends the inquiries with them.
+     */
+    struct ReplicaChannel {
+        struct Request {
+            std::shared_ptr<Inquiry> inquiry;
+            // the second request of a hedged inquiry
+            bool hedge;
+        };
+        // the requests sent in one p2p request, all for the same tag
+        struct SentBatch {
+            std::vector<Request> requests;
+            // steady clock time it was sent at, in microseconds
+            uint64_t send_us;
+            derecho::rpc::QueryResults<std::vector<Guess>> result;
+        };
+        std::mutex mutex;
+        std::condition_variable send_cv;
+        std::condition_variable reply_cv;
+        std::deque<Request> queued;
+        // only the receiver pops it, so the front stays in place while it waits
+        std::deque<SentBatch> sent;
+        bool stopped = false;
+        std::thread sender;
+        std::thread receiver;
+    };
+    // categorizer node -> its channel, started by the first request to it;
+    // entries are never removed
+    std::map<node_id_t, std::unique_ptr<ReplicaChannel>> replica_channels;
+    std::mutex replica_channels_mutex;
+    // set by shutdown(): the channels created from then on are stopped
+    bool channels_stopped;
+
+    /**
+     * @param node - a categorizer node
+     * @return its channel, started if it is new
+     */
+    ReplicaChannel& get_replica_channel(const node_id_t node);
+
+    /**
+     * Queue a request of an inquiry for a categorizer node. The caller holds
+     * inquiry->mutex.
+     * @param inquiry - the inquiry
+     * @param node - the categorizer node
+     * @param hedge - true for the second request of a hedged inquiry
+     * @return QUEUED, or why nothing is queued: the node has max_queue_depth
+     *         requests outstanding, or the channel is stopped
+     */
+    enum class QueueResult { QUEUED, FULL, STOPPED };
+    QueueResult queue_request(const std::shared_ptr<Inquiry>& inquiry, const node_id_t node, const bool hedge);
+
+    /**
+     * @param node - a categorizer node
+     * @return when a request rejected for the node should be retried, in
+     *         milliseconds: the time its outstanding requests take
+     */
+    uint32_t get_retry_after_ms(const node_id_t node);
+
+    /**
+     * Give up on a request that has not been sent. The inquiry fails with
+     * the error if it was its last pending request.
+     * @param inquiry - the inquiry
+     * @param node - the categorizer node it was queued for
+     * @param error - the error
+     */
+    void drop_request(Inquiry& inquiry, const node_id_t node, std::exception_ptr error);
+
+    /**
+     * The body of the sender thread of a channel.
+     * @param node - the categorizer node
+     * @param channel - its channel
+     */
+    void send_requests(const node_id_t node, ReplicaChannel* channel);
+
+    /**
+     * The body of the receiver thread of a channel.
+     * @param node - the categorizer node
+     * @param channel - its channel
+     */
+    void receive_replies(const node_id_t node, ReplicaChannel* channel);
+
+    /**
+     * End the inquiries of a batch with its reply, unless they have ended
+     * already, and keep track of the load of the node. An error ends an
+     * inquiry only if no other member may still answer.
+     * @param batch - the batch
+     * @param node - the categorizer node that replied
+     */
+    void deliver_reply(ReplicaChannel::SentBatch& batch, const node_id_t node);
+
+    /**
+     * Check an inquiry without waiting. With hedge_requests, a request that
+     * has not been answered within the HEDGE_PERCENTILE latency of its tag is
+     * queued for a second member as well; the first reply is used and the
+     * other one is ignored. The inquiry fails with RequestCancel once
+     * photo.deadline passes or the client cancels.
+     * @param inquiry - the inquiry
+     * @param cancelled - the client has cancelled the request
+     * @param wake_at - output: lowered to the next time the inquiry has to be
+     *        checked again
+     * @return true once the inquiry has ended and its photo is not read anymore
+     */
+    bool poll_inquiry(const std::shared_ptr<Inquiry>& inquiry, const bool cancelled,
+                      std::chrono::steady_clock::time_point& wake_at);
+
+    /**
+     * Ask the model of photo.tag, on a replica of one of the shards hosting
+     * it, without waiting for the guess.
+     * @param view - the categorizer tier shards
+     * @param photo - the photo, which must outlive the inquiry
+     * @param result - output: the guess, from the result cache if the photo
+     *        has been asked recently
+     * @param inquiry - output: the inquiry the caller has to poll, if the
+     *        photo is not cached or asked already
+     */
+    void ask_model(const ShardView& view, const Photo& photo,
+                   std::shared_future<Guess>& result, std::shared_ptr<Inquiry>& inquiry);
+
+    /**
+     * Move the calls waiting for the categorizer tier forward whenever a
+     * guess arrives, a client cancels, or a deadline or a hedge is due, until
+     * shutdown(). It is the body of poller_thread.
+     */
+    void poll_calls();
+
+    /**
+     * Tell the reply poller that a call may move forward.
+     */
+    void wake_poller();
+
+    /**
+     * Hand a call over to poller_thread.
+     * @param call - the call
+     */
+    void add_polled_call(PhotoCall* call);
+
+    /**
+     * Run the completion handlers of a queue until it is shut down.
+     * @param completion_queue - the queue
+     * @param core - the CPU to pin the thread to, -1 for any
+     */
+    void serve_completion_queue(grpc::ServerCompletionQueue* completion_queue, const int core);
+
+    /**
+     * Install the segments of a model on one shard, carrying only the
+     * segments it does not have.
+     * @param target - a member of the shard
+     * @param tag - model tag
+     * @param params_format - format of the parameters, a ParamsFormat value
+     * @param backend - the inference backend, an InferenceBackend value
+     * @param segments - the model segments
+     * @param segment_ids - their content hashes
+     * @return the return value of CategorizerTier::install_model()
+     */
+    int install_on_shard(const node_id_t target, const uint32_t tag,
+                         const uint32_t params_format, const uint32_t backend,
+                         const std::vector<BlobWrapper>& segments,
+                         const std::vector<uint64_t>& segment_ids);
+
+    /**
+     * Drop the staged segments of an install that failed before its commit.
+     * If the shard cannot be reached, it drops them itself once this node
+     * leaves or STAGED_UPLOAD_TIMEOUT_US passes.
+     * @param target - the member of the shard the chunks were sent to
+     * @param upload_id - the upload id of the install
+     */
+    void abort_upload(const node_id_t target, const uint64_t upload_id);
 
     /**
      * the workhorses
      */
-    virtual grpc::Status Whatsthis(grpc::ServerContext* context,
-                                   grpc::ServerReader<PhotoRequest>* reader,
-                                   PhotoReply* reply) override;
     virtual grpc::Status InstallModel(grpc::ServerContext* context,
                                       grpc::ServerReader<InstallModelRequest>* reader,
                                       ModelReply* reply) override;
     virtual grpc::Status RemoveModel(grpc::ServerContext* context,
                                      const RemoveModelRequest* request,
                                      ModelReply* reply) override;
+    virtual grpc::Status GetHedgeStats(grpc::ServerContext* context,
+                                       const HedgeStatsRequest* request,
+                                       HedgeStatsReply* reply) override;
 
     /**
      * Start the function tier web service
@@ -55,16 +471,22 @@ public:
     /**
      * Default constructor
      */
-    FunctionTier() {
-        started = false;
-        start();
-    }
+    FunctionTier() : FunctionTier(std::map<uint32_t, std::vector<uint32_t>>()) {}
     /**
      * Constructor that supplies an initial photo tag-to-shard mapping
      * @param rhs The tag-to-shard map to use
      */
-    FunctionTier(std::map<uint64_t, ssize_t>& rhs) {
+    FunctionTier(std::map<uint32_t, std::vector<uint32_t>> rhs) {
         this->tag_to_shard = std::move(rhs);
+        hedge_requests = get_conf_uint32(CONF_SOSPDEMO_HEDGE_REQUESTS, 0) != 0;
+        hedge_max_percent = get_conf_uint32(CONF_SOSPDEMO_HEDGE_MAX_PERCENT, 10);
+        max_queue_depth = get_conf_uint32(CONF_SOSPDEMO_MAX_QUEUE_DEPTH, 64);
+        inference_requests = hedged_requests = hedge_wins = 0;
+        poll_requested = false;
+        stop_poller = false;
+        channels_stopped = false;
+        next_shard = 0;
+        next_upload_id = 0;
         started = false;
         start();
     }
@@ -73,9 +495,41 @@ public:
      */
     virtual ~FunctionTier();
     /**
-     * We don't need to register any Derecho RPC functions for the function tier
+     * Drop the cached guesses of a model in all replicas
+     * @param tag - model tag
+     * @return 0
+     */
+    int ordered_invalidate_results(const uint32_t& tag);
+
+    /**
+     * Set the shards of a model in all replicas
+     * @param tag - model tag
+     * @param shards - the shards hosting it, empty when it is removed
+     * @return 0
+     */
+    int ordered_set_placement(const uint32_t& tag, const std::vector<uint32_t>& shards);
+
+    /**
+     * Get the counters of the hedged requests of this node, to size
+     * hedge_max_percent. GetHedgeStats() sums them over the function tier.
+     * @return the counters
+     */
+    HedgeStats get_hedge_stats();
+
+    /**
+     * Tell the function tier that the membership has changed. It is called
+     * by the view upcall of the group; the shard members are read again on
+     * the next request.
+     */
+    static void on_new_view();
+
+    /**
+     * The function tier provides no services to other Derecho nodes; its RPC
+     * functions keep the result caches and the routing tables of its members
+     * coherent, and report its counters.
      */
-    static auto register_functions() { return std::tuple<>(); };
+    REGISTER_RPC_FUNCTIONS(FunctionTier, ordered_invalidate_results, ordered_set_placement,
+                           get_hedge_stats);
 
     DEFAULT_SERIALIZATION_SUPPORT(FunctionTier, tag_to_shard);
 };
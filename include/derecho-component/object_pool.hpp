@@ -0,0 +1,67 @@
+#pragma once
+#include <cstddef>
+#include <new>
+
+namespace sospdemo {
+/**
+ * Class-specific operator new and delete backed by a per-thread free list.
+ * mutils allocates the arguments of every RPC call in from_bytes_noalloc() and
+ * frees them when the call returns; with this base class the objects are
+ * recycled on the RPC thread instead of going to the heap each time.
+ * T must be the most derived class.
+ */
+template <typename T>
+class PooledObject {
+public:
+    static void* operator new(const std::size_t size) {
+        static_assert(sizeof(T) >= sizeof(Node), "too small to be pooled");
+        FreeList& list = get_free_list();
+        if(size == sizeof(T) && list.head != nullptr) {
+            Node* node = list.head;
+            list.head = node->next;
+            list.count--;
+            return node;
+        }
+        return ::operator new(size);
+    }
+
+    static void operator delete(void* p, const std::size_t size) {
+        FreeList& list = get_free_list();
+        if(p != nullptr && size == sizeof(T) && list.count < max_free) {
+            Node* node = static_cast<Node*>(p);
+            node->next = list.head;
+            list.head = node;
+            list.count++;
+            return;
+        }
+        ::operator delete(p);
+    }
+
+private:
+    // objects kept for reuse by each thread
+    static constexpr std::size_t max_free = 1024;
+
+    struct Node {
+        Node* next;
+    };
+
+    struct FreeList {
+        Node* head = nullptr;
+        std::size_t count = 0;
+
+        ~FreeList() {
+            while(head != nullptr) {
+                Node* node = head;
+                head = node->next;
+                ::operator delete(node);
+            }
+        }
+    };
+
+    static FreeList& get_free_list() {
+        thread_local FreeList list;
+        return list;
+    }
+};
+
+}  // namespace sospdemo
@@ -0,0 +1,134 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <derecho-component/blob.hpp>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <mxnet-component/inference_engine.hpp>
+#include <tuple>
+
+namespace sospdemo {
+
+/**
+ * A bounded LRU cache of inference results, keyed by the model tag, the
+ * model version and the hash of the photo bytes. The hash is seeded with a
+ * random key per process, so that a client cannot make a photo collide with
+ * the photos of other clients. Identical requests in flight
+ * at the same time share one inference (single flight). Only guesses with
+ * candidates are cached, so errors are retried by the next request.
+ */
+class ResultCache {
+public:
+    /**
+     * the cache key
+     */
+    struct Key {
+        uint32_t tag;
+        // identifies the installed model, see Model::version
+        uint64_t model_version;
+        uint64_t photo_hash;
+        std::size_t photo_size;
+        uint32_t num_candidates;
+
+        bool operator<(const Key& rhs) const {
+            return std::tie(tag, model_version, photo_hash, photo_size, num_candidates)
+                   < std::tie(rhs.tag, rhs.model_version, rhs.photo_hash, rhs.photo_size, rhs.num_candidates);
+        }
+    };
+
+    /**
+     * An inference the caller of start() runs for everyone asking for its
+     * key. It is ended by finish() or fail().
+     */
+    class Flight {
+        friend class ResultCache;
+        Key key;
+        // see generations
+        uint64_t generation;
+        std::promise<Guess> promise;
+    };
+
+private:
+    /**
+     * maximum number of cached guesses, 0 to disable the cache
+     */
+    const std::size_t capacity;
+    /**
+     * cached guesses, most recently used first
+     */
+    std::list<std::pair<Key, Guess>> lru;
+    std::map<Key, std::list<std::pair<Key, Guess>>::iterator> entries;
+    /**
+     * inferences running right now
+     */
+    std::map<Key, std::shared_future<Guess>> in_flight;
+    /**
+     * tag -> number of invalidations, so that an inference started before an
+     * invalidation does not put its result into the cache.
+     */
+    std::map<uint32_t, uint64_t> generations;
+    std::mutex cache_mutex;
+    uint64_t hits;
+    uint64_t misses;
+    /**
+     * the secret seed of the photo hashes
+     */
+    const uint64_t hash_seed;
+
+    /**
+     * Make a key for a photo.
+     * @param photo - the photo
+     * @param model_version - the version of the model for photo.tag
+     * @return the key
+     */
+    Key make_key(const Photo& photo, const uint64_t model_version) const;
+
+public:
+    /**
+     * constructor
+     * @param capacity - maximum number of cached guesses, 0 to disable the cache
+     */
+    ResultCache(const std::size_t capacity);
+
+    /**
+     * constructor with the capacity from the [SOSPDEMO] section of the configuration.
+     */
+    ResultCache();
+
+    /**
+     * Return the cached guess or the inference in flight for a photo, or
+     * start a new inference. The photo is only hashed if the cache is enabled.
+     * @param photo - the photo
+     * @param model_version - the version of the model for photo.tag
+     * @param result - output: the guess, ready if it is cached
+     * @return the inference to run, if the caller has to run it; nullptr otherwise
+     */
+    std::unique_ptr<Flight> start(const Photo& photo, const uint64_t model_version,
+                                  std::shared_future<Guess>& result);
+
+    /**
+     * End an inference from start() with its guess, and cache it.
+     * @param flight - the inference
+     * @param guess - the guess
+     */
+    void finish(std::unique_ptr<Flight> flight, const Guess& guess);
+
+    /**
+     * End an inference from start() with an error, passed to all the callers
+     * waiting for it.
+     * @param flight - the inference
+     * @param error - the exception
+     */
+    void fail(std::unique_ptr<Flight> flight, std::exception_ptr error);
+
+    /**
+     * Drop the cached guesses of a model, when it is removed or reinstalled.
+     * @param tag - model tag
+     */
+    void invalidate(const uint32_t tag);
+};
+
+}  // namespace sospdemo
@@ -0,0 +1,58 @@
+#pragma once
+#include <cstdint>
+#include <derecho-component/blob.hpp>
+#include <derecho/mutils-serialization/SerializationSupport.hpp>
+#include <map>
+#include <memory>
+
+namespace sospdemo {
+/**
+ * The model segments of a categorizer node, by content hash.
+ * With a durable model store, a state transfer only carries the content
+ * hashes and sizes of the segments: the joining node maps the segments it
+ * still has on its disk and fetches the others from the shard.
+ */
+class SegmentStore : public mutils::ByteRepresentable {
+public:
+    // content hash -> segment
+    std::map<uint64_t, Blob> blobs;
+    // content hash -> size of the segments a state transfer carried by
+    // reference, until they are found on disk or fetched
+    std::map<uint64_t, uint64_t> references;
+    // serialize the content hashes and sizes instead of the data
+    bool by_reference;
+
+    SegmentStore() : by_reference(false) {}
+
+    /**
+     * @param segment_id - content hash
+     * @return true if the data of the segment is here
+     */
+    bool has(const uint64_t segment_id) const {
+        return blobs.find(segment_id) != blobs.end();
+    }
+
+    // serialization/deserialization supports
+    std::size_t to_bytes(char* buffer) const;
+
+    std::size_t bytes_size() const;
+
+    void post_object(const std::function<void(char const* const, std::size_t)>& f) const;
+
+    void ensure_registered(mutils::DeserializationManager&) {}
+
+    static std::unique_ptr<SegmentStore> from_bytes(mutils::DeserializationManager*, const char* const buffer);
+
+    static mutils::context_ptr<SegmentStore> from_bytes_noalloc(
+            mutils::DeserializationManager* ctx,
+            const char* const buffer,
+            mutils::context_ptr<SegmentStore> = mutils::context_ptr<SegmentStore>{});
+
+private:
+    /**
+     * @return content hash -> size of all the segments, carried or not
+     */
+    std::map<uint64_t, uint64_t> get_index() const;
+};
+
+}  // namespace sospdemo
@@ -0,0 +1,193 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <derecho-component/function_tier.hpp>
+#include <future>
+#include <grpc-component/function_tier-grpc.hpp>
+#include <grpcpp/grpcpp.h>
+#include <memory>
+#include <vector>
+
+namespace sospdemo {
+
+/**
+ * The tag of an operation on a completion queue of the asynchronous server.
+ * The thread serving the queue calls proceed() when the operation completes.
+ */
+class CompletionHandler {
+public:
+    virtual ~CompletionHandler() {}
+    /**
+     * @param ok - false if the operation failed, e.g. the stream has ended
+     *        or the server is shutting down
+     */
+    virtual void proceed(const bool ok) = 0;
+};
+
+/**
+ * An inference call on the asynchronous server. The request is read by the
+ * completion queue thread, without waiting for the client, and the guesses
+ * are collected by the reply poller of the function tier, see
+ * FunctionTier::poll_calls(). No thread is tied to a call; the poller is
+ * woken when a guess arrives or the client cancels.
+ *
+ * A call is deleted when its last reference is released. The operation it has
+ * on the completion queue, the done notification of gRPC and the reply poller
+ * each hold one.
+ */
+class PhotoCall : public CompletionHandler {
+protected:
+    enum class State {
+        REQUEST,
+        READ_METADATA,
+        READ_DATA,
+        INFERENCE,
+        FINISH
+    };
+
+    /**
+     * Tells the call that gRPC is done with it, or that the client has cancelled.
+     */
+    class DoneHandler : public CompletionHandler {
+        PhotoCall* call;
+
+    public:
+        DoneHandler(PhotoCall* _call) : call(_call) {}
+        void proceed(const bool ok) override;
+    };
+
+    FunctionTier* function_tier;
+    grpc::ServerCompletionQueue* completion_queue;
+    grpc::ServerContext context;
+    PhotoReply reply;
+    State state;
+    ParsedWhatsThisArguments args;
+    // the deadline of the client, see Photo::deadline
+    std::chrono::steady_clock::time_point deadline;
+    std::atomic<bool> cancelled;
+    std::atomic<uint32_t> references;
+    DoneHandler done_handler;
+    // one photo per tag, with its guess and, if this call asks the model, its inquiry
+    std::vector<Photo> photos;
+    std::vector<std::shared_future<Guess>> results;
+    std::vector<std::shared_ptr<FunctionTier::Inquiry>> inquiries;
+
+    /**
+     * Send the reply, or an error, with the responder of the call.
+     * @param status - the status
+     */
+    virtual void send_reply(const grpc::Status& status) = 0;
+
+    /**
+     * Send the reply, or an error. The call goes to State::FINISH.
+     * @param status - the status
+     */
+    void finish(const grpc::Status& status);
+
+    /**
+     * Reject the request under overload.
+     * @param retry_after_ms - when the client should retry, also passed in the
+     *        retry-after-ms trailing metadata
+     */
+    void finish_exhausted(const uint32_t retry_after_ms);
+
+    /**
+     * @return Status::CANCELLED if the client has cancelled, DEADLINE_EXCEEDED otherwise
+     */
+    grpc::Status given_up() const;
+
+    /**
+     * Admit the request into the budgets of the function tier, or reject it.
+     * @param photo_size - the size of the photo
+     * @return true if admitted; the call has replied otherwise
+     */
+    bool admit(const uint32_t photo_size);
+
+    /**
+     * Ask the models, and hand the call over to the reply poller.
+     * @param photo_data - the photo, which must outlive the call
+     * @param photo_size - its size
+     */
+    void start_inference(const char* photo_data, const std::size_t photo_size);
+
+    /**
+     * Merge the guesses into the reply, the most confident first.
+     * @param guesses - (tag, guess) of the models that answered
+     */
+    void merge_guesses(std::vector<std::pair<uint32_t, Guess>>& guesses);
+
+    /**
+     * @param function_tier - the function tier
+     * @param completion_queue - the queue the call is served on
+     */
+    PhotoCall(FunctionTier* function_tier, grpc::ServerCompletionQueue* completion_queue);
+
+public:
+    /**
+     * Move the call forward without waiting, from the reply poller. It replies
+     * once all the models have answered, one guess reaches min_confidence, or
+     * the client has given up. A photo whose inquiry was started by another
+     * call that has given up since is asked again.
+     * @param stopping - the server is shutting down: give up on the models
+     * @param wake_at - output: lowered to the next time the call has to be
+     *        polled again, if no guess arrives before
+     * @return true once the call has replied and its inquiries have ended
+     */
+    bool poll(const bool stopping, std::chrono::steady_clock::time_point& wake_at);
+
+    /**
+     * Release a reference, and delete the call if it was the last one.
+     */
+    void release();
+};
+
+/**
+ * A Whatsthis call: the metadata, then the photo chunk by chunk.
+ */
+class WhatsthisCall : public PhotoCall {
+    grpc::ServerAsyncReader<PhotoReply, PhotoRequest> reader;
+    PhotoRequest request;
+    // bytes of the photo read so far
+    uint32_t received;
+
+    /**
+     * Read a chunk of the photo.
+     * @return false if the chunk is malformed
+     */
+    bool read_chunk();
+
+    void send_reply(const grpc::Status& status) override;
+
+public:
+    /**
+     * Wait for the next Whatsthis call on a completion queue.
+     * @param function_tier - the function tier
+     * @param completion_queue - the queue
+     */
+    WhatsthisCall(FunctionTier* function_tier, grpc::ServerCompletionQueue* completion_queue);
+
+    void proceed(const bool ok) override;
+};
+
+/**
+ * A WhatsthisUnary call: a small photo in one message. The photos point into
+ * the request, which is not copied.
+ */
+class WhatsthisUnaryCall : public PhotoCall {
+    grpc::ServerAsyncResponseWriter<PhotoReply> responder;
+    PhotoBlob request;
+
+    void send_reply(const grpc::Status& status) override;
+
+public:
+    /**
+     * Wait for the next WhatsthisUnary call on a completion queue.
+     * @param function_tier - the function tier
+     * @param completion_queue - the queue
+     */
+    WhatsthisUnaryCall(FunctionTier* function_tier, grpc::ServerCompletionQueue* completion_queue);
+
+    void proceed(const bool ok) override;
+};
+
+}  // namespace sospdemo
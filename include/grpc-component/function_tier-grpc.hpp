@@ -2,6 +2,9 @@
 #include <derecho-component/function_tier.hpp>
 
 namespace sospdemo {
+// the most candidates a client may ask each model for
+#define MAX_NUM_CANDIDATES (100)
+
 class RequestCancel {
 };
 class StatusOK {};
@@ -13,10 +16,15 @@ struct ParsedInstallArguments {
     ssize_t params_size;
     ssize_t data_size;
     char* model_data;
+    // store the parameters as FP16
+    bool fp16_params;
+    // an InferenceBackend value
+    uint32_t backend;
     ParsedInstallArguments(const uint32_t tag, const ssize_t synset_size,
                            const ssize_t symbol_size, const ssize_t params_size,
-                           const ssize_t data_size, char* model_data)
-            : tag(tag), synset_size(synset_size), symbol_size(symbol_size), params_size(params_size), data_size(data_size), model_data(model_data) {
+                           const ssize_t data_size, char* model_data, const bool fp16_params,
+                           const uint32_t backend)
+            : tag(tag), synset_size(synset_size), symbol_size(symbol_size), params_size(params_size), data_size(data_size), model_data(model_data), fp16_params(fp16_params), backend(backend) {
     }
     ParsedInstallArguments();
     ParsedInstallArguments(const ParsedInstallArguments&) = delete;
@@ -30,11 +38,19 @@ ParsedInstallArguments parse_grpc_install_args(grpc::ServerContext* context,
 
 struct ParsedWhatsThisArguments {
     std::vector<uint32_t> tags;
+    uint32_t num_candidates;
+    // reply with the first guess this probable, 0 to wait for all the models
+    float min_confidence;
     uint32_t photo_size;
     char* photo_data;
+    // the budgets the request holds until it is destroyed
+    AdmissionControl::Ticket ticket;
     ParsedWhatsThisArguments(std::vector<uint32_t> tags,
+                             const uint32_t num_candidates,
+                             const float min_confidence,
                              const uint32_t photo_size,
-                             char* photo_data);
+                             char* photo_data,
+                             AdmissionControl::Ticket&& ticket);
     ParsedWhatsThisArguments();
     ParsedWhatsThisArguments(const ParsedWhatsThisArguments&) = delete;
     ParsedWhatsThisArguments(ParsedWhatsThisArguments&&);
@@ -42,7 +58,4 @@ struct ParsedWhatsThisArguments {
     ~ParsedWhatsThisArguments();
 };
 
-ParsedWhatsThisArguments parse_grpc_whatsthis_args(grpc::ServerContext* context,
-                                                   grpc::ServerReader<PhotoRequest>* reader,
-                                                   PhotoReply* reply);
 }  // namespace sospdemo
@@ -0,0 +1,79 @@
+#pragma once
+#include <mxnet-component/inference_engine.hpp>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sospdemo {
+/**
+ * Batched inference.
+ * The function tier coalesces the photos it has queued for a categorizer
+ * node and the same tag into one request, see FunctionTier::send_requests(),
+ * so a batch arrives whole and is never waited for. The batcher splits the
+ * photos of a request in chunks of up to max_batch_size photos, and runs the
+ * chunks on its worker threads, which decode, preprocess and forward them on
+ * the inference cores; the RPC thread only waits for the guesses.
+ */
+class InferenceBatcher {
+    /**
+     * maximum number of photos in a forward pass
+     */
+    const uint32_t max_batch_size;
+    /**
+     * the chunks waiting for a worker
+     */
+    std::deque<std::packaged_task<std::vector<Guess>()>> chunks;
+    std::mutex chunks_mutex;
+    std::condition_variable chunks_cv;
+    bool stopped;
+    /**
+     * the worker threads
+     */
+    std::vector<std::thread> workers;
+
+    /**
+     * The body of a worker thread.
+     */
+    void work();
+
+public:
+    /**
+     * constructor
+     * @param max_batch_size - maximum number of photos in a forward pass
+     * @param num_workers - number of chunks run at the same time
+     */
+    InferenceBatcher(const uint32_t max_batch_size, const uint32_t num_workers);
+
+    /**
+     * constructor with the batching parameters from the [SOSPDEMO] section of
+     * the configuration: batch_max_size, and as many workers as an engine has
+     * executors.
+     */
+    InferenceBatcher();
+
+    /**
+     * Destructor
+     */
+    ~InferenceBatcher();
+
+    /**
+     * Run the photos of an engine in forward passes of up to max_batch_size
+     * photos. The photos are split in as many chunks as the engine runs at the
+     * same time, if there are enough of them, so that the chunks run in
+     * parallel.
+     * @param engine - the engine for the tag of the photos
+     * @param photos - the photos
+     * @return one guess per photo, in the same order
+     */
+    std::vector<Guess> inference(InferenceEngine& engine, const std::vector<const Photo*>& photos);
+
+    /**
+     * @return the maximum number of photos in a forward pass
+     */
+    uint32_t get_max_batch_size() const { return max_batch_size; }
+};
+
+}  // namespace sospdemo
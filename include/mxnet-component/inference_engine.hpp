@@ -1,44 +1,114 @@
 #pragma once
 
 #include <derecho-component/blob.hpp>
+#include <derecho-component/object_pool.hpp>
 #include <derecho/core/derecho.hpp>
 #include <derecho/mutils-serialization/SerializationSupport.hpp>
+#include <mxnet-component/params_format.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+#ifdef WITH_MXNET
 #include <mxnet-cpp/MxNetCpp.h>
 #include <mxnet-cpp/initializer.h>
 #include <mxnet/c_api.h>
 #include <mxnet/tuple.h>
-#include <shared_mutex>
-#include <string>
+#endif
 
 namespace sospdemo {
 /**
  * The back end subgroup type
  */
 
-class Photo : public mutils::ByteRepresentable {
+/**
+ * A photo to identify. The photo data is not copied when the photo is
+ * deserialized: it points into the receive buffer, which outlives the call.
+ */
+class Photo : public mutils::ByteRepresentable,
+              public PooledObject<Photo> {
 public:
     uint32_t tag;
     BlobWrapper photo_data;
+    // number of candidates wanted in the guess
+    uint32_t num_candidates;
+    // when the client stops waiting for the guess, on the local clock;
+    // time_point::max() for no deadline. It goes over the wire as the time
+    // left, because the clocks of the nodes do not agree.
+    std::chrono::steady_clock::time_point deadline;
+
+    Photo() : num_candidates(1), deadline(std::chrono::steady_clock::time_point::max()) {}
+    Photo(uint32_t& _tag, const BlobWrapper& _photo_data, uint32_t& _num_candidates)
+            : tag(_tag), photo_data(_photo_data), num_candidates(_num_candidates),
+              deadline(std::chrono::steady_clock::time_point::max()) {}
+
+    Photo(uint32_t _tag, const char* const b, const std::size_t s, uint32_t _num_candidates = 1)
+            : Photo(_tag, BlobWrapper{b, s}, _num_candidates) {}
 
-    Photo() {}
-    Photo(uint32_t& _tag, const BlobWrapper& _photo_data)
-            : tag(_tag), photo_data(_photo_data) {}
+    /**
+     * @return true if the client has stopped waiting for the guess
+     */
+    bool expired() const {
+        return deadline != std::chrono::steady_clock::time_point::max()
+               && std::chrono::steady_clock::now() >= deadline;
+    }
 
-    Photo(uint32_t _tag, const char* const b, const std::size_t s)
-            : Photo(_tag, BlobWrapper{b, s}) {}
+    /**
+     * @return the microseconds left before the deadline, at least 1; 0 for no deadline
+     */
+    uint64_t get_remaining_us() const;
 
-    DEFAULT_SERIALIZATION_SUPPORT(Photo, tag, photo_data);
+    // serialization/deserialization supports, in the layout of
+    // DEFAULT_SERIALIZATION_SUPPORT(Photo, tag, photo_data, num_candidates, remaining_us)
+    std::size_t to_bytes(char* buffer) const;
+
+    std::size_t bytes_size() const;
+
+    void post_object(const std::function<void(char const* const, std::size_t)>& f) const;
+
+    void ensure_registered(mutils::DeserializationManager&) {}
+
+    static std::unique_ptr<Photo> from_bytes(mutils::DeserializationManager*, const char* const buffer);
+
+    /**
+     * The photo is built in place from the buffer: the photo data is not
+     * copied, and the Photo object itself comes from a per-thread pool.
+     */
+    static mutils::context_ptr<Photo> from_bytes_noalloc(
+            mutils::DeserializationManager* ctx,
+            const char* const buffer,
+            mutils::context_ptr<Photo> = mutils::context_ptr<Photo>{});
+
+    static mutils::context_ptr<const Photo> from_bytes_noalloc_const(
+            mutils::DeserializationManager* ctx,
+            const char* const buffer,
+            mutils::context_ptr<const Photo> = mutils::context_ptr<const Photo>{});
 };
 
 class Guess : public mutils::ByteRepresentable {
 public:
+    // the best guess
     std::string guess;
-    float p;
+    float p = 0.0f;
+    // synset indices and probabilities of the best candidates, best first
+    std::vector<uint32_t> candidates;
+    std::vector<float> probabilities;
+    // nonzero if the categorizer node was overloaded and the inference did
+    // not run, see FunctionTier::queue_request(): when to retry, in milliseconds
+    uint32_t retry_after_ms = 0;
 
     Guess() {}
     Guess(std::string& _guess, float& _p) : guess(_guess), p(_p) {}
+    Guess(std::string& _guess, float& _p, std::vector<uint32_t>& _candidates, std::vector<float>& _probabilities)
+            : guess(_guess), p(_p), candidates(_candidates), probabilities(_probabilities) {}
+    Guess(std::string& _guess, float& _p, std::vector<uint32_t>& _candidates, std::vector<float>& _probabilities,
+          uint32_t& _retry_after_ms)
+            : guess(_guess), p(_p), candidates(_candidates), probabilities(_probabilities), retry_after_ms(_retry_after_ms) {}
 
-    DEFAULT_SERIALIZATION_SUPPORT(Guess, guess, p);
+    DEFAULT_SERIALIZATION_SUPPORT(Guess, guess, p, candidates, probabilities, retry_after_ms);
 };
 
 /**
@@ -47,17 +117,72 @@ public:
 
 struct ModelLoadException {};
 
+/**
+ * Inference backends, selected per model at install time
+ */
+enum InferenceBackend {
+    // MXNet with the model's symbol and parameters
+    kBackendMXNet = 0,
+    // a synthetic workload for benchmarking, see SyntheticInferenceEngine
+    kBackendSynthetic = 1,
+};
+
+/**
+ * The segments of a model, in this order. The parameters take one segment, or
+ * one segment per tensor, depending on the ParamsFormat.
+ */
+#define MODEL_SEGMENT_SYNSET (0)
+#define MODEL_SEGMENT_SYMBOL (1)
+#define MODEL_SEGMENT_PARAMS (2)
+
 struct Model : public mutils::ByteRepresentable {
-    ssize_t synset_size;
-    ssize_t symbol_size;
-    ssize_t params_size;
-    Blob model_data;
+    // a ParamsFormat value
+    uint32_t params_format;
+    // an InferenceBackend value
+    uint32_t backend;
+    // content hashes of the segments, see hash_bytes(). Models sharing a
+    // segment refer to the same copy in the segment store of a node.
+    std::vector<uint64_t> segments;
+    // derived from the segments, it tells different installs of a tag apart
+    uint64_t version;
+    // the data of the segments, in the same order. It is not serialized but
+    // bound to the segment store of a node, see bind_segments().
+    std::vector<const Blob*> segment_data;
+
+    Model() : params_format(kParamsMXNet), backend(kBackendMXNet), version(0) {}
+
+    /**
+     * Point segment_data to the segments in a segment store.
+     * @param segment_store - content hash -> segment
+     * @return true if the store has all the segments of the model
+     */
+    bool bind_segments(const std::map<uint64_t, Blob>& segment_store) {
+        segment_data.clear();
+        for(const uint64_t id : segments) {
+            auto search = segment_store.find(id);
+            if(search == segment_store.end()) {
+                segment_data.clear();
+                return false;
+            }
+            segment_data.push_back(&search->second);
+        }
+        return segments.size() > MODEL_SEGMENT_PARAMS;
+    }
 
-    Model() : synset_size(0), symbol_size(0), params_size(0) {}
+    /**
+     * @return the version of the model: a hash of its format, backend and segments
+     */
+    uint64_t get_content_version() const {
+        std::string content(reinterpret_cast<const char*>(&params_format), sizeof(params_format));
+        content.append(reinterpret_cast<const char*>(&backend), sizeof(backend));
+        content.append(reinterpret_cast<const char*>(segments.data()), segments.size() * sizeof(uint64_t));
+        return hash_bytes(content.data(), content.size());
+    }
 
     std::vector<std::string>&
     get_synset_vector(std::vector<std::string>& synset_vector) const {
-        std::string synset_string(model_data.bytes, synset_size);
+        const Blob* synset = segment_data.at(MODEL_SEGMENT_SYNSET);
+        std::string synset_string(synset->bytes, synset->size);
         std::istringstream iss(synset_string);
         char buf[256];
         synset_vector.clear();
@@ -68,32 +193,110 @@ struct Model : public mutils::ByteRepresentable {
     }
 
     std::string get_symbol_json() const {
-        return std::string(model_data.bytes + synset_size, symbol_size);
+        const Blob* symbol = segment_data.at(MODEL_SEGMENT_SYMBOL);
+        return std::string(symbol->bytes, symbol->size);
     }
 
+#ifdef WITH_MXNET
+    /**
+     * Load the parameters as FP32 arrays, widening them if they are stored as FP16.
+     * It throws ModelLoadException if the parameters are malformed.
+     */
     void get_parameters_map(
             std::map<std::string, mxnet::cpp::NDArray>* parameters_map) const {
-        mxnet::cpp::NDArray::LoadFromBuffer(
-                static_cast<const void*>(model_data.bytes + synset_size + symbol_size),
-                params_size, 0, parameters_map);
+        if(params_format == kParamsMXNet) {
+            const Blob* params = segment_data.at(MODEL_SEGMENT_PARAMS);
+            mxnet::cpp::NDArray::LoadFromBuffer(static_cast<const void*>(params->bytes),
+                                                params->size, 0, parameters_map);
+            return;
+        }
+        for(std::size_t i = MODEL_SEGMENT_PARAMS; i < segment_data.size(); i++) {
+            if(load_params_tensor(segment_data[i]->bytes, segment_data[i]->size,
+                                  params_format == kParamsFP16, parameters_map)
+               != 0) {
+                throw ModelLoadException{};
+            }
+        }
     }
+#endif  // WITH_MXNET
 
-    Model(ssize_t& _synset_size, ssize_t& _symbol_size, ssize_t& _params_size,
-          Blob& _model_data)
-            : synset_size(_synset_size), symbol_size(_symbol_size), params_size(_params_size), model_data(_model_data) {}
+    Model(uint32_t& _params_format, uint32_t& _backend, std::vector<uint64_t>& _segments, uint64_t& _version)
+            : params_format(_params_format), backend(_backend), segments(_segments), version(_version) {}
 
 #ifndef NDEBUG
     void dump_to_file() const;
 #endif
 
-    DEFAULT_SERIALIZATION_SUPPORT(Model, synset_size, symbol_size, params_size,
-                                  model_data);
+    DEFAULT_SERIALIZATION_SUPPORT(Model, params_format, backend, segments, version);
 };
 
 /**
- * The MXNet inference Engine
+ * The interface of the inference backends. An engine serves one model and is
+ * thread-safe: up to get_pool_size() inferences run in parallel.
  */
 class InferenceEngine {
+protected:
+    /**
+   * the maximum number of inferences running in parallel
+   */
+    const uint32_t pool_size;
+
+    /**
+   * constructor with the pool size from the configuration
+   */
+    InferenceEngine();
+
+public:
+    /**
+   * Build the engine of a model with the backend it was installed with.
+   * @param model - the raw model data
+   * @return the engine. It throws ModelLoadException if the model cannot be loaded.
+   */
+    static std::unique_ptr<InferenceEngine> create(Model& model);
+
+    /**
+   * destructor
+   */
+    virtual ~InferenceEngine();
+
+    /**
+   * inference a single photo.
+   */
+    virtual Guess inference(const Photo& photo);
+
+    /**
+   * inference a batch of photos at once.
+   * @param photos - the photos, all for this engine's model
+   * @return one guess per photo, in the same order
+   */
+    virtual std::vector<Guess> inference(const std::vector<const Photo*>& photos) = 0;
+
+    /**
+   * Prepare the engine for the batch sizes, so that the first requests do not
+   * pay for it.
+   * @param batch_sizes - the batch sizes to warm up
+   */
+    virtual void warm_up(const std::vector<uint32_t>& batch_sizes) = 0;
+
+    /**
+   * @return the maximum number of inferences running in parallel
+   */
+    uint32_t get_pool_size() const { return pool_size; }
+
+    /**
+   * The approximate memory footprint of the engine, used to budget the
+   * engines of a categorizer node. It is taken after warm_up(), so that it
+   * covers the executors bound for the warmed up batch sizes.
+   * @return footprint in bytes
+   */
+    virtual std::size_t get_footprint() const = 0;
+};
+
+#ifdef WITH_MXNET
+/**
+ * The MXNet inference Engine
+ */
+class MXNetInferenceEngine : public InferenceEngine {
     /**
    * the synset explains inference result.
    */
@@ -115,33 +318,46 @@ class InferenceEngine {
    */
     mxnet::cpp::Context global_ctx;
     /**
-   * the input shape
+   * the input shape of a single photo (batch size 1)
    */
     mxnet::cpp::Shape input_shape;
     /**
-   * argument arrays
+   * An executor bound for one batch size. All bound executors share the
+   * read-only weight arrays in args_map. Each one has its own input, output
+   * and auxiliary arrays, so that checked-out executors run in parallel.
    */
-    std::vector<mxnet::cpp::NDArray> arg_arrays;
+    struct BoundExecutor {
+        /**
+       * the input layer: batch_size x 3 x 224 x 224
+       */
+        mxnet::cpp::NDArray data;
+        /**
+       * the work horse: mxnet executor
+       */
+        std::unique_ptr<mxnet::cpp::Executor> executor;
+        /**
+       * bytes of the arrays of its own: input, label, auxiliary and output
+       */
+        std::size_t size;
+    };
     /**
-   * gradient arrays
+   * bytes of the loaded weight and auxiliary arrays
    */
-    std::vector<mxnet::cpp::NDArray> grad_arrays;
+    std::size_t parameters_size;
     /**
-   * ??
+   * batch size -> bytes of an executor bound for it
    */
-    std::vector<mxnet::cpp::OpReqType> grad_reqs;
+    std::map<uint32_t, std::size_t> executor_sizes;
     /**
-   * auxliary array
+   * the number of executors checked out right now
    */
-    std::vector<mxnet::cpp::NDArray> aux_arrays;
+    uint32_t executors_in_use;
     /**
-   * client data
+   * batch size -> idle bound executors
    */
-    mxnet::cpp::NDArray client_data;
-    /**
-   * the work horse: mxnet executor
-   */
-    std::unique_ptr<mxnet::cpp::Executor> executor_pointer;
+    std::map<uint32_t, std::vector<std::unique_ptr<BoundExecutor>>> idle_executors;
+    mutable std::mutex executors_mutex;
+    std::condition_variable executors_cv;
 
 private:
     /**
@@ -151,21 +367,64 @@ private:
    */
     int load_model(const Model& model);
 
+    /**
+   * bind a new executor for a batch size.
+   * @param batch_size - number of photos in the batch
+   * @return the bound executor
+   */
+    std::unique_ptr<BoundExecutor> bind_executor(const uint32_t batch_size);
+
+    /**
+   * check out an executor for a batch size from the pool. It blocks while
+   * pool_size executors are in use.
+   * @param batch_size - number of photos in the batch
+   * @return the executor, owned by the caller until check_in_executor()
+   */
+    std::unique_ptr<BoundExecutor> check_out_executor(const uint32_t batch_size);
+
+    /**
+   * return an executor to the pool.
+   * @param batch_size - the batch size the executor is bound for
+   * @param bound - the executor, nullptr if binding it failed
+   */
+    void check_in_executor(const uint32_t batch_size, std::unique_ptr<BoundExecutor> bound);
+
 public:
     /**
    * constructor
    */
-    InferenceEngine(Model& model);
+    MXNetInferenceEngine(Model& model);
 
     /**
    * destructor
    */
-    virtual ~InferenceEngine();
+    virtual ~MXNetInferenceEngine();
+
+    using InferenceEngine::inference;
+
+    /**
+   * inference a batch of photos with a single forward pass.
+   * @param photos - the photos, all for this engine's model
+   * @return one guess per photo, in the same order
+   */
+    virtual std::vector<Guess> inference(const std::vector<const Photo*>& photos) override;
+
+    /**
+   * Run a forward pass on a blank input for each batch size, so that the
+   * executors are bound and the first requests do not pay for it.
+   * @param batch_sizes - the batch sizes to warm up
+   */
+    virtual void warm_up(const std::vector<uint32_t>& batch_sizes) override;
 
     /**
-   * inference
+   * The approximate memory footprint of the engine: its weights plus, for
+   * each batch size bound so far, pool_size executors with their input,
+   * label, auxiliary and output arrays. The intermediate activations that
+   * MXNet plans inside an executor are not visible here and not counted.
+   * @return footprint in bytes
    */
-    Guess inference(const Photo& photo);
+    virtual std::size_t get_footprint() const override;
 };
+#endif  // WITH_MXNET
 
 }  // namespace sospdemo
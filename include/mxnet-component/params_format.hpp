@@ -0,0 +1,71 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#ifdef WITH_MXNET
+#include <mxnet-cpp/MxNetCpp.h>
+#endif
+
+namespace sospdemo {
+
+/**
+ * Formats of the model parameters
+ */
+enum ParamsFormat {
+    // a single segment with the .params file as uploaded
+    kParamsMXNet = 0,
+    // one segment per tensor, see split_params(), with the values in FP16
+    kParamsFP16 = 1,
+    // one segment per tensor, see split_params(), with the values in FP32
+    kParamsFP32 = 2,
+};
+
+/**
+ * Convert IEEE single-precision floats to half precision, rounding to nearest even.
+ * F16C is used when the compiler targets it.
+ * @param src - count floats
+ * @param dst - count halfs
+ * @param count - number of values
+ */
+void float_to_half(const float* src, uint16_t* dst, const std::size_t count);
+
+/**
+ * Widen half-precision floats to single precision. F16C is used when the
+ * compiler targets it.
+ * @param src - count halfs
+ * @param dst - count floats
+ * @param count - number of values
+ */
+void half_to_float(const uint16_t* src, float* dst, const std::size_t count);
+
+#ifdef WITH_MXNET
+/**
+ * Split a .params file into one segment per tensor, so that models sharing a
+ * tensor store it once. A tensor segment holds the name length (uint32_t),
+ * the name, the number of dimensions (uint32_t), the dimensions (uint32_t
+ * each) and the values, all in host byte order.
+ * @param params - the .params data
+ * @param params_size - size of the .params data
+ * @param fp16 - store the values as FP16 instead of FP32
+ * @param tensors - output: the tensor segments, ordered by name
+ * @return 0 for success, a nonzero value if the parameters cannot be split,
+ *         e.g. they are not all FP32.
+ */
+int split_params(const char* params, const std::size_t params_size, const bool fp16,
+                 std::vector<std::string>& tensors);
+
+/**
+ * Load a tensor segment made by split_params() as an FP32 CPU array.
+ * @param tensor - the tensor segment
+ * @param size - size of the tensor segment
+ * @param fp16 - the values are FP16
+ * @param parameters_map - output: name -> array
+ * @return 0 for success, a nonzero value if the segment is malformed.
+ */
+int load_params_tensor(const char* tensor, const std::size_t size, const bool fp16,
+                       std::map<std::string, mxnet::cpp::NDArray>* parameters_map);
+#endif  // WITH_MXNET
+
+}  // namespace sospdemo
@@ -0,0 +1,23 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace sospdemo {
+
+/**
+ * Find the k highest scores of a model output.
+ * Blocks of scores are compared against the current k-th best score with
+ * SSE or AVX2 when the compiler targets them, so only the few scores that can
+ * enter the top k are looked at one by one. Equal scores keep their output
+ * order, so the first candidate is the same as a plain argmax.
+ * @param scores - the output of one photo
+ * @param size - number of scores (the synset size)
+ * @param k - number of candidates wanted, capped at size
+ * @param indices - output: indices of the best scores, best first
+ * @param values - output: the best scores, in the same order
+ */
+void top_k(const float* scores, const std::size_t size, const std::size_t k,
+           std::vector<uint32_t>& indices, std::vector<float>& values);
+
+}  // namespace sospdemo
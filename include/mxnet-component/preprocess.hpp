@@ -0,0 +1,51 @@
+#pragma once
+#include <cstddef>
+#include <opencv2/opencv.hpp>
+
+namespace sospdemo {
+
+/**
+ * decoded photos are resized to PREPROCESS_RESIZED_SIZE x PREPROCESS_RESIZED_SIZE
+ */
+#define PREPROCESS_RESIZED_SIZE (256)
+/**
+ * and center-cropped to the PREPROCESS_INPUT_SIZE x PREPROCESS_INPUT_SIZE input layer
+ */
+#define PREPROCESS_INPUT_SIZE (224)
+
+/**
+ * Read the dimensions of a JPEG image from its frame header, without decoding it.
+ * @param bytes - the encoded image
+ * @param size - size of the encoded image
+ * @param width - output: image width
+ * @param height - output: image height
+ * @return true if bytes is a JPEG image with a frame header, otherwise false
+ */
+bool get_jpeg_dimensions(const unsigned char* bytes, const std::size_t size, int& width, int& height);
+
+/**
+ * Decode a photo and resize it to PREPROCESS_RESIZED_SIZE x PREPROCESS_RESIZED_SIZE
+ * BGR pixels. Large JPEG photos are decoded at 1/2, 1/4 or 1/8 of their size in the
+ * DCT domain, as long as the result is not smaller than PREPROCESS_RESIZED_SIZE.
+ * The photo is decoded in place and the result lives in a per-thread scratch buffer
+ * reused across calls.
+ * @param bytes - the encoded photo
+ * @param size - size of the encoded photo
+ * @return the resized photo, valid until the next call on the same thread. It is
+ *         empty if the photo cannot be decoded.
+ */
+const cv::Mat& decode_photo(const char* bytes, const std::size_t size);
+
+/**
+ * The fused preprocessing kernel. It center-crops a resized BGR photo, swaps
+ * BGR to RGB, transposes HWC to CHW and scales each pixel to [0,1) in one pass.
+ * The result is bit-for-bit identical to static_cast<float>(pixel) / 256.
+ * An SSSE3/SSE4.1 or AVX2 version is used when the compiler targets it,
+ * otherwise a scalar loop.
+ * @param bgr - the resized photo, PREPROCESS_RESIZED_SIZE^2 pixels of 3 bytes
+ * @param row_stride - bytes between two rows of bgr
+ * @param output - 3 x PREPROCESS_INPUT_SIZE x PREPROCESS_INPUT_SIZE floats
+ */
+void preprocess_photo(const unsigned char* bgr, const std::size_t row_stride, float* output);
+
+}  // namespace sospdemo
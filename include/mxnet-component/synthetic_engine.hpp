@@ -0,0 +1,86 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <mxnet-component/inference_engine.hpp>
+#include <string>
+#include <vector>
+
+namespace sospdemo {
+
+/**
+ * A synthetic inference backend to benchmark the serving path (gRPC, Derecho
+ * routing, batching, caching) without a real model. It is installed like any
+ * model, with the synthetic backend. The synset file names the classes as
+ * usual; the symbol file holds "key = value" lines describing the work:
+ * - batch_us: microseconds of work per forward pass, 1000 by default
+ * - photo_us: microseconds of work per photo in the batch, 0 by default
+ * - mode: spin (burn CPU, the default) or sleep
+ * - decode: 1 to decode and preprocess the photos like the MXNet backend, 0 by default
+ * The parameters file is ignored. Every photo gets the same guesses: the
+ * first classes of the synset with probabilities 1/2, 1/4, ...
+ */
+class SyntheticInferenceEngine : public InferenceEngine {
+    /**
+   * class names
+   */
+    std::vector<std::string> synset_vector;
+    /**
+   * work per forward pass
+   */
+    std::chrono::microseconds batch_work;
+    /**
+   * work per photo
+   */
+    std::chrono::microseconds photo_work;
+    /**
+   * burn CPU if true, otherwise sleep
+   */
+    bool spin;
+    /**
+   * decode and preprocess the photos
+   */
+    bool decode;
+    /**
+   * forward passes running right now, at most pool_size
+   */
+    uint32_t running;
+    std::mutex running_mutex;
+    std::condition_variable running_cv;
+
+    /**
+   * Parse the workload description.
+   * @param spec - the "key = value" lines
+   * @return 0 for success, a nonzero value for an invalid description
+   */
+    int parse_spec(const std::string& spec);
+
+    /**
+   * Do the work of a forward pass.
+   * @param duration - how long it takes
+   */
+    void work(const std::chrono::microseconds duration) const;
+
+public:
+    /**
+   * constructor
+   * @param model - the raw model data
+   */
+    SyntheticInferenceEngine(Model& model);
+
+    using InferenceEngine::inference;
+
+    virtual std::vector<Guess> inference(const std::vector<const Photo*>& photos) override;
+
+    /**
+   * Nothing to warm up.
+   */
+    virtual void warm_up(const std::vector<uint32_t>& batch_sizes) override {}
+
+    /**
+   * @return the size of the synset
+   */
+    virtual std::size_t get_footprint() const override;
+};
+
+}  // namespace sospdemo
@@ -15,3 +15,22 @@ enum TypeFlag {
     kInt8 = 5,
     kInt64 = 6,
 };
+
+/**
+ * @param type_flag - NDArray data type
+ * @return size of one element in bytes
+ */
+inline std::size_t type_flag_size(const int type_flag) {
+    switch(type_flag) {
+        case kFloat64:
+        case kInt64:
+            return 8;
+        case kFloat16:
+            return 2;
+        case kUint8:
+        case kInt8:
+            return 1;
+        default:
+            return 4;
+    }
+}
@@ -0,0 +1,63 @@
+#include <derecho-component/admission_control.hpp>
+#include <derecho-component/config.hpp>
+
+namespace sospdemo {
+
+AdmissionControl::Ticket::Ticket(Ticket&& rhs)
+        : owner(rhs.owner), bytes(rhs.bytes), admitted(rhs.admitted) {
+    rhs.owner = nullptr;
+}
+
+AdmissionControl::Ticket& AdmissionControl::Ticket::operator=(Ticket&& rhs) {
+    std::swap(owner, rhs.owner);
+    std::swap(bytes, rhs.bytes);
+    std::swap(admitted, rhs.admitted);
+    return *this;
+}
+
+AdmissionControl::Ticket::~Ticket() {
+    if(owner == nullptr) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lck(owner->admission_mutex);
+        owner->requests--;
+        owner->bytes -= bytes;
+    }
+    // the average moves an eighth of the way to each sample.
+    const uint64_t held_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                                     std::chrono::steady_clock::now() - admitted)
+                                     .count();
+    const uint64_t average_us = owner->average_us;
+    owner->average_us = (average_us == 0) ? held_us : average_us - average_us / 8 + held_us / 8;
+}
+
+AdmissionControl::AdmissionControl(const uint32_t max_requests, const uint64_t max_bytes)
+        : max_requests(max_requests), max_bytes(max_bytes), requests(0), bytes(0), average_us(0) {}
+
+AdmissionControl::AdmissionControl()
+        : AdmissionControl(get_conf_uint32(CONF_SOSPDEMO_MAX_INFLIGHT_REQUESTS, 256),
+                           static_cast<uint64_t>(get_conf_uint32(CONF_SOSPDEMO_MAX_INFLIGHT_PHOTO_MB, 256)) << 20) {}
+
+bool AdmissionControl::admit(const uint64_t request_bytes, Ticket& ticket) {
+    {
+        std::lock_guard<std::mutex> lck(admission_mutex);
+        if((max_requests != 0 && requests + 1 > max_requests)
+           || (max_bytes != 0 && bytes + request_bytes > max_bytes)) {
+            return false;
+        }
+        requests++;
+        bytes += request_bytes;
+    }
+    ticket = Ticket();
+    ticket.owner = this;
+    ticket.bytes = request_bytes;
+    ticket.admitted = std::chrono::steady_clock::now();
+    return true;
+}
+
+uint32_t AdmissionControl::get_retry_after_ms() const {
+    return static_cast<uint32_t>(average_us / 1000 + 1);
+}
+
+}  // namespace sospdemo
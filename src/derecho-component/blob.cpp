@@ -1,6 +1,56 @@
 #include <derecho-component/blob.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace sospdemo {
+static constexpr uint64_t HASH_PRIME_1 = 0x9E3779B185EBCA87ULL;
+static constexpr uint64_t HASH_PRIME_2 = 0xC2B2AE3D27D4EB4FULL;
+
+static inline uint64_t rotl64(const uint64_t x, const int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_round(uint64_t lane, const uint64_t word) {
+    lane += word * HASH_PRIME_2;
+    return rotl64(lane, 31) * HASH_PRIME_1;
+}
+
+uint64_t hash_bytes(const char* bytes, const std::size_t size) {
+    return hash_bytes(bytes, size, 0);
+}
+
+uint64_t hash_bytes(const char* bytes, const std::size_t size, const uint64_t seed) {
+    // four independent lanes of 8-byte words keep the multipliers busy.
+    uint64_t lanes[4] = {seed + HASH_PRIME_1 + HASH_PRIME_2, seed + HASH_PRIME_2, seed, seed - HASH_PRIME_1};
+    std::size_t pos = 0;
+    for(; pos + 32 <= size; pos += 32) {
+        for(int i = 0; i < 4; i++) {
+            uint64_t word;
+            std::memcpy(&word, bytes + pos + i * 8, sizeof(word));
+            lanes[i] = hash_round(lanes[i], word);
+        }
+    }
+    uint64_t h = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+    for(; pos + 8 <= size; pos += 8) {
+        uint64_t word;
+        std::memcpy(&word, bytes + pos, sizeof(word));
+        h = hash_round(h, word);
+    }
+    for(; pos < size; pos++) {
+        h = hash_round(h, static_cast<unsigned char>(bytes[pos]));
+    }
+    // final avalanche
+    h ^= size;
+    h ^= h >> 33;
+    h *= HASH_PRIME_2;
+    h ^= h >> 29;
+    h *= HASH_PRIME_1;
+    h ^= h >> 32;
+    return h;
+}
+
 // BlobWrapper implementation
 BlobWrapper::BlobWrapper(const char* const b, const decltype(size) s) : bytes(b), size(s) {}
 
@@ -33,57 +83,120 @@ std::unique_ptr<BlobWrapper> BlobWrapper::from_bytes(mutils::DeserializationMana
 }
 
 // Blob implementation
-Blob::Blob(const char* const b, const decltype(size) s) : bytes(nullptr), size(0) {
+Blob::Blob(const char* const b, const decltype(size) s) : bytes(nullptr), size(0), is_mapped(false) {
     if(s > 0) {
-        bytes = new char[s];
-        memcpy(bytes, b, s);
+        storage = std::shared_ptr<char>(new char[s], std::default_delete<char[]>());
+        bytes = storage.get();
+        if(b != nullptr) {
+            memcpy(bytes, b, s);
+        }
         size = s;
     }
 }
 
-Blob::Blob(const Blob& other) : bytes(nullptr), size(0) {
-    if(other.size > 0) {
-        bytes = new char[other.size];
-        memcpy(bytes, other.bytes, other.size);
-        size = other.size;
-    }
-}
+Blob::Blob(const Blob& other)
+        : bytes(other.bytes), size(other.size), is_mapped(other.is_mapped), storage(other.storage) {}
 
-Blob::Blob(Blob&& other) : bytes(other.bytes), size(other.size) {
+Blob::Blob(Blob&& other)
+        : bytes(other.bytes), size(other.size), is_mapped(other.is_mapped), storage(std::move(other.storage)) {
     other.bytes = nullptr;
     other.size = 0;
+    other.is_mapped = false;
 }
 
-Blob::Blob() : bytes(nullptr), size(0) {}
+Blob::Blob() : bytes(nullptr), size(0), is_mapped(false) {}
 
-Blob::~Blob() {
-    if(bytes) delete bytes;
-}
+Blob::~Blob() {}
 
 Blob& Blob::operator=(Blob&& other) {
-    char* swp_bytes = other.bytes;
-    std::size_t swp_size = other.size;
-    other.bytes = bytes;
-    other.size = size;
-    bytes = swp_bytes;
-    size = swp_size;
+    std::swap(bytes, other.bytes);
+    std::swap(size, other.size);
+    std::swap(is_mapped, other.is_mapped);
+    std::swap(storage, other.storage);
     return *this;
 }
 
 Blob& Blob::operator=(const Blob& other) {
-    if(bytes != nullptr) {
-        delete bytes;
-    }
+    bytes = other.bytes;
     size = other.size;
-    if(size > 0) {
-        bytes = new char[size];
-        memcpy(bytes, other.bytes, size);
-    } else {
-        bytes = nullptr;
-    }
+    is_mapped = other.is_mapped;
+    storage = other.storage;
     return *this;
 }
 
+Blob Blob::slice(const std::size_t offset, const std::size_t length) const {
+    Blob part(*this);
+    part.bytes = (length > 0) ? bytes + offset : nullptr;
+    part.size = length;
+    return part;
+}
+
+int Blob::write_file(const std::string& file_path) const {
+    int fd = open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        std::cerr << "Failed to open file(" << file_path << ") for write with "
+                  << "error:" << strerror(errno) << "." << std::endl;
+        return -1;
+    }
+    std::size_t offset = 0;
+    while(offset < size) {
+        ssize_t written = write(fd, bytes + offset, size - offset);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Failed to write file(" << file_path << ") with "
+                      << "error:" << strerror(errno) << "." << std::endl;
+            close(fd);
+            return -2;
+        }
+        offset += written;
+    }
+    // the data reaches the disk before the file is renamed over an older one.
+    if(fsync(fd)) {
+        std::cerr << "Failed to sync file(" << file_path << ") with "
+                  << "error:" << strerror(errno) << "." << std::endl;
+        close(fd);
+        return -4;
+    }
+    if(close(fd)) {
+        return -3;
+    }
+    return 0;
+}
+
+int Blob::map_file(const std::string& file_path) {
+    if(size == 0) {
+        return 0;
+    }
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        std::cerr << "Failed to open file(" << file_path << ") in readonly mode with "
+                  << "error:" << strerror(errno) << "." << std::endl;
+        return -1;
+    }
+    struct stat st;
+    if(fstat(fd, &st) || static_cast<std::size_t>(st.st_size) != size) {
+        std::cerr << "File(" << file_path << ") does not match the blob size "
+                  << size << "." << std::endl;
+        close(fd);
+        return -2;
+    }
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mapped == MAP_FAILED) {
+        std::cerr << "Failed to map file(" << file_path << ") with "
+                  << "error:" << strerror(errno) << "." << std::endl;
+        return -3;
+    }
+    // the copies sharing the heap buffer keep it.
+    const std::size_t mapped_size = size;
+    storage = std::shared_ptr<char>(static_cast<char*>(mapped), [mapped_size](char* p) { munmap(p, mapped_size); });
+    bytes = storage.get();
+    is_mapped = true;
+    return 0;
+}
+
 std::size_t Blob::to_bytes(char* buffer) const {
     ((std::size_t*)(buffer))[0] = size;
     if(size > 0) {
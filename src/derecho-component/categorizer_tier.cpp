@@ -1,7 +1,18 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <derecho-component/categorizer_tier.hpp>
+#include <derecho-component/config.hpp>
+#include <derecho-component/cpu_plan.hpp>
+#include <derecho-component/function_tier.hpp>
 #include <mxnet-component/utils.hpp>
-#include <mxnet-cpp/MxNetCpp.h>
+#include <iomanip>
+#include <limits>
 #include <opencv2/opencv.hpp>
+#include <set>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <vector>
 
 #ifndef NDEBUG
@@ -10,49 +21,716 @@
 
 namespace sospdemo {
 
+/**
+ * Map a whole file into a blob.
+ * @param file_path - the file
+ * @param blob - output: the mapping
+ * @return 0 for success, a nonzero value for failure
+ */
+static int map_whole_file(const std::string& file_path, Blob& blob) {
+    struct stat st;
+    if(stat(file_path.c_str(), &st)) {
+        return -1;
+    }
+    blob = Blob();
+    blob.size = st.st_size;
+    if(blob.map_file(file_path) != 0) {
+        blob.size = 0;
+        return -1;
+    }
+    return 0;
+}
+
+CategorizerTier::CategorizerTier() : CategorizerTier(std::map<uint32_t, Model>{}, SegmentStore{}, true) {}
+
+CategorizerTier::CategorizerTier(const std::map<uint32_t, Model>& _raw_models,
+                                 const SegmentStore& _segments)
+        : CategorizerTier(_raw_models, _segments, false) {}
+
+CategorizerTier::CategorizerTier(const std::map<uint32_t, Model>& _raw_models,
+                                 const SegmentStore& _segments,
+                                 const bool restore_catalog)
+        : raw_models(_raw_models),
+          segments(_segments),
+          slot_directory(nullptr),
+          engine_memory_budget(static_cast<uint64_t>(get_conf_uint32(CONF_SOSPDEMO_ENGINE_MEMORY_BUDGET_MB, 0)) << 20),
+          engine_resident_bytes(0),
+          engine_evictions(0),
+          // the durable models are the paged out ones.
+          page_out_models(get_conf_uint32(CONF_SOSPDEMO_PAGE_OUT_MODELS, 0) != 0
+                          || get_conf_uint32(CONF_SOSPDEMO_DURABLE_MODELS, 0) != 0),
+          model_page_path(get_conf_string(CONF_SOSPDEMO_MODEL_PAGE_PATH, derecho::getConfString(CONF_PERS_FILE_PATH))),
+          durable_models(get_conf_uint32(CONF_SOSPDEMO_DURABLE_MODELS, 0) != 0),
+          restored_catalog_us(0),
+          adopted_catalog_us(0),
+          install_chunk_size(std::max(get_conf_uint32(CONF_SOSPDEMO_INSTALL_CHUNK_SIZE, 1048576), 1u)),
+          loader_stopped(false) {
+    slot_directories.emplace_back(std::make_unique<const SlotDirectory>());
+    slot_directory = slot_directories.back().get();
+    // 1 - a node starting a new group restores its models from disk; a joining
+    // node looks there for the segments the state transfer carried by reference.
+    segments.by_reference = durable_models;
+    if(restore_catalog && durable_models) {
+        load_catalog();
+    }
+    find_referenced_segments();
+    // 2 - the models that still miss segments fetch them before their engine is built.
+    std::unique_lock write_lock(inference_engines_mutex);
+    for(auto& model : raw_models) {
+        for(const uint64_t segment_id : model.second.segments) {
+            segment_refs[segment_id]++;
+        }
+        model.second.bind_segments(segments.blobs);
+        EngineSlot* slot = get_slot(model.first);
+        std::lock_guard<std::mutex> slot_lock(slot->mutex);
+        slot->installed = true;
+    }
+    write_lock.unlock();
+    // 3 - the loader starts last: it announces the restored catalog first.
+    loader_thread = std::thread(&CategorizerTier::loader_loop, this);
+    for(const auto& model : raw_models) {
+        load_engine_async(model.first);
+    }
+}
+
 CategorizerTier::~CategorizerTier() {
     // clean up.
+    {
+        std::lock_guard<std::mutex> lck(load_queue_mutex);
+        loader_stopped = true;
+    }
+    load_queue_cv.notify_all();
+    loader_thread.join();
 }
 
-Guess CategorizerTier::inference(const Photo& photo) {
+CategorizerTier::EngineSlot* CategorizerTier::find_slot(const uint32_t tag) const {
+    const SlotDirectory* directory = slot_directory.load(std::memory_order_acquire);
+    auto slot_search = directory->find(tag);
+    return slot_search == directory->end() ? nullptr : slot_search->second;
+}
+
+CategorizerTier::EngineSlot* CategorizerTier::get_slot(const uint32_t tag) {
+    EngineSlot* slot = find_slot(tag);
+    if(slot != nullptr) {
+        return slot;
+    }
+    slots.emplace_back(std::make_unique<EngineSlot>());
+    slot = slots.back().get();
+    // publish a new directory; readers of the old one do not miss a slot they look for.
+    auto directory = std::make_unique<SlotDirectory>(*slot_directory.load(std::memory_order_relaxed));
+    directory->emplace(tag, slot);
+    slot_directory.store(directory.get(), std::memory_order_release);
+    slot_directories.emplace_back(std::move(directory));
+    return slot;
+}
+
+std::shared_future<void> CategorizerTier::load_engine_async(const uint32_t tag) {
+    std::promise<void> loaded;
+    std::shared_future<void> load = loaded.get_future().share();
+    EngineSlot* slot = find_slot(tag);
+    if(slot == nullptr) {
+        loaded.set_value();
+        return load;
+    }
+    std::unique_lock<std::mutex> slot_lock(slot->mutex);
+    if(slot->load.valid()) {
+        return slot->load;
+    }
+    if(slot->engine || !slot->installed) {
+        loaded.set_value();
+        return load;
+    }
+    slot->load = load;
+    slot_lock.unlock();
+
+    std::lock_guard<std::mutex> lck(load_queue_mutex);
+    load_queue.emplace_back(tag, std::move(loaded));
+    load_queue_cv.notify_one();
+    return load;
+}
+
+void CategorizerTier::loader_loop() {
+    // the loader runs the first MXNet operations of this node, so the MXNet
+    // worker and OpenMP threads it starts inherit the inference cores.
+    enter_inference_cores();
+    announce_catalog();
+    while(true) {
+        std::unique_lock<std::mutex> lck(load_queue_mutex);
+        load_queue_cv.wait(lck, [this]() { return loader_stopped || !load_queue.empty(); });
+        if(loader_stopped) {
+            // release the waiting requests; they will find no engine.
+            for(auto& load : load_queue) {
+                load.second.set_value();
+            }
+            load_queue.clear();
+            return;
+        }
+        const uint32_t tag = load_queue.front().first;
+        std::promise<void> loaded = std::move(load_queue.front().second);
+        load_queue.pop_front();
+        lck.unlock();
+
+        EngineSlot* slot = find_slot(tag);
+        bool published = false;
+        while(true) {
+            // 1 - build the engine from a copy of the model, without holding the
+            // read lock, so that installs and removes do not wait for it. The
+            // copies of the segments share their data, which stays valid if the
+            // model is removed or paged out meanwhile.
+            fetch_segments(tag);
+            std::unique_ptr<InferenceEngine> engine;
+            uint64_t model_version = 0;
+            bool model_found = false;
+            Model model;
+            std::map<uint64_t, Blob> model_segments;
+            {
+                std::shared_lock read_lock(inference_engines_mutex);
+                auto model_search = raw_models.find(tag);
+                if(model_search != raw_models.end()) {
+                    model_found = true;
+                    model = model_search->second;
+                    model_version = model.version;
+                    for(const uint64_t segment_id : model.segments) {
+                        auto segment_search = segments.blobs.find(segment_id);
+                        if(segment_search != segments.blobs.end()) {
+                            model_segments.emplace(segment_id, segment_search->second);
+                        }
+                    }
+                }
+            }
+            if(model_found) {
+                model.bind_segments(model_segments);
+                try {
+                    engine = InferenceEngine::create(model);
+                } catch(...) {
+                    std::cerr << "Fatal error loading model for tag " << tag << "." << std::endl;
+                }
+            }
+            // 2 - warm it up, so that the first photo does not bind the executors.
+            if(engine) {
+                try {
+                    engine->warm_up({1, batcher.get_max_batch_size()});
+                } catch(...) {
+                    std::cerr << "Failed to warm up the engine for tag " << tag << "." << std::endl;
+                    engine.reset();
+                }
+            }
+            // 3 - publish it, unless the model has been removed meanwhile. A
+            // model reinstalled meanwhile joined this load, so it is rebuilt.
+            std::unique_lock write_lock(inference_engines_mutex);
+            auto model_search = raw_models.find(tag);
+            if(engine && model_search != raw_models.end() && model_search->second.version != model_version) {
+                continue;
+            }
+            if(engine && model_search != raw_models.end()) {
+                auto cached = std::make_shared<CachedEngine>();
+                cached->footprint = engine->get_footprint();
+                cached->engine = std::move(engine);
+                cached->model_version = model_version;
+                cached->last_used = std::chrono::steady_clock::now().time_since_epoch().count();
+                evict_engines(cached->footprint);
+                engine_resident_bytes += cached->footprint;
+                std::lock_guard<std::mutex> slot_lock(slot->mutex);
+                slot->engine = std::move(cached);
+                published = true;
+            }
+            std::lock_guard<std::mutex> slot_lock(slot->mutex);
+            slot->load = std::shared_future<void>();
+            break;
+        }
+        loaded.set_value();
+        // 4 - the raw model is only needed again for state transfer or a rebuild.
+        if(published && page_out_models) {
+            page_out_model(tag);
+        }
+        if(published && durable_models) {
+            std::shared_lock read_lock(inference_engines_mutex);
+            save_catalog();
+        }
+#ifndef NDEBUG
+        std::cout << "Engine loader finished with tag = " << tag << "." << std::endl;
+        std::cout.flush();
+#endif
+    }
+}
+
+void CategorizerTier::evict_engines(const std::size_t needed_bytes) {
+    if(engine_memory_budget == 0) {
+        return;
+    }
+    // the engines change only under the exclusive lock the caller holds.
+    const SlotDirectory& directory = *slot_directory.load(std::memory_order_relaxed);
+    while(engine_resident_bytes + needed_bytes > engine_memory_budget) {
+        auto victim = directory.end();
+        for(auto it = directory.begin(); it != directory.end(); it++) {
+            if(it->second->engine
+               && (victim == directory.end() || it->second->engine->last_used < victim->second->engine->last_used)) {
+                victim = it;
+            }
+        }
+        if(victim == directory.end()) {
+            return;
+        }
+        EngineSlot* slot = victim->second;
+        std::lock_guard<std::mutex> slot_lock(slot->mutex);
+        engine_resident_bytes -= slot->engine->footprint;
+        engine_evictions++;
 #ifndef NDEBUG
-    std::cout << "CategorizerTier::inference() called with photo tag = "
-              << photo.tag << std::endl;
+        std::cout << "Evicted the inference engine of tag " << victim->first
+                  << " (" << slot->engine->footprint << " bytes). hits = " << slot->hits
+                  << ", misses = " << slot->misses << ", evictions = " << engine_evictions
+                  << "." << std::endl;
+        std::cout.flush();
+#endif
+        // the requests using it keep it until they finish.
+        slot->engine.reset();
+    }
+}
+
+EngineCacheStats CategorizerTier::get_engine_cache_stats() {
+    EngineCacheStats stats;
+    std::shared_lock read_lock(inference_engines_mutex);
+    for(const auto& slot : slots) {
+        std::lock_guard<std::mutex> slot_lock(slot->mutex);
+        stats.hits += slot->hits;
+        stats.misses += slot->misses;
+    }
+    stats.evictions = engine_evictions;
+    stats.resident_bytes = engine_resident_bytes;
+    stats.budget_bytes = engine_memory_budget;
+    return stats;
+}
+
+std::string CategorizerTier::get_segment_page_file(const uint64_t segment_id) const {
+    std::ostringstream oss;
+    oss << model_page_path << "/segment-" << std::hex << std::setw(16) << std::setfill('0') << segment_id << ".raw";
+    return oss.str();
+}
+
+void CategorizerTier::page_out_model(const uint32_t tag) {
+    if(mkdir(model_page_path.c_str(), 0755) && errno != EEXIST) {
+        std::cerr << "Failed to create model page directory(" << model_page_path << ") with "
+                  << "error:" << strerror(errno) << "." << std::endl;
+        return;
+    }
+    std::vector<uint64_t> segment_ids;
+    {
+        std::shared_lock read_lock(inference_engines_mutex);
+        auto model_search = raw_models.find(tag);
+        if(model_search == raw_models.end()) {
+            return;
+        }
+        segment_ids = model_search->second.segments;
+    }
+    for(const uint64_t segment_id : segment_ids) {
+        const std::string file_path = get_segment_page_file(segment_id);
+        // 1 - write the file without blocking inference. A segment shared with
+        // a model paged out before is mapped already.
+        {
+            std::shared_lock read_lock(inference_engines_mutex);
+            auto segment_search = segments.blobs.find(segment_id);
+            if(segment_search == segments.blobs.end() || segment_search->second.is_mapped) {
+                continue;
+            }
+            if(segment_search->second.write_file(file_path) != 0) {
+                return;
+            }
+        }
+        // 2 - swap the heap buffer for the mapping, if the segment is still there.
+        // Segments never change, and the models point to the Blob, not its bytes.
+        std::unique_lock write_lock(inference_engines_mutex);
+        auto segment_search = segments.blobs.find(segment_id);
+        if(segment_search != segments.blobs.end() && !segment_search->second.is_mapped) {
+            segment_search->second.map_file(file_path);
+        }
+    }
+}
+
+void CategorizerTier::release_segments(const Model& model) {
+    for(const uint64_t segment_id : model.segments) {
+        auto ref_search = segment_refs.find(segment_id);
+        if(ref_search == segment_refs.end() || --ref_search->second > 0) {
+            continue;
+        }
+        segment_refs.erase(ref_search);
+        segments.blobs.erase(segment_id);
+        segments.references.erase(segment_id);
+        if(page_out_models) {
+            unlink(get_segment_page_file(segment_id).c_str());
+        }
+    }
+}
+
+std::vector<uint64_t> CategorizerTier::missing_segments(const std::vector<uint64_t>& segment_ids) {
+    std::vector<uint64_t> missing;
+    std::shared_lock read_lock(inference_engines_mutex);
+    for(const uint64_t segment_id : segment_ids) {
+        if(!segments.has(segment_id)
+           && std::find(missing.begin(), missing.end(), segment_id) == missing.end()) {
+            missing.push_back(segment_id);
+        }
+    }
+    return missing;
+}
+
+Blob CategorizerTier::get_segment(const uint64_t& segment_id, const uint64_t& offset, const uint64_t& size) {
+    std::shared_lock read_lock(inference_engines_mutex);
+    auto segment_search = segments.blobs.find(segment_id);
+    if(segment_search == segments.blobs.end() || offset + size > segment_search->second.size) {
+        return Blob();
+    }
+    // the chunk shares the segment, which stays valid while the reply is sent.
+    return segment_search->second.slice(offset, size);
+}
+
+/**
+ * The catalog file starts with this header, which tells a complete catalog
+ * from one truncated or corrupted on disk.
+ */
+struct CatalogHeader {
+    // size of the serialized models that follow the header
+    uint64_t size;
+    // hash_bytes() of the serialized models
+    uint64_t hash;
+    // wall clock time the catalog was saved at, in microseconds
+    uint64_t saved_us;
+};
+
+std::string CategorizerTier::get_catalog_file() const {
+    return model_page_path + "/models.catalog";
+}
+
+void CategorizerTier::save_catalog() {
+    std::map<uint32_t, Model> catalog;
+    for(const auto& model : raw_models) {
+        bool on_disk = true;
+        for(const uint64_t segment_id : model.second.segments) {
+            auto segment_search = segments.blobs.find(segment_id);
+            if(segment_search == segments.blobs.end()
+               || !(segment_search->second.is_mapped || segment_search->second.size == 0)) {
+                on_disk = false;
+                break;
+            }
+        }
+        if(on_disk) {
+            catalog.emplace(model);
+        }
+    }
+    std::vector<char> buffer(sizeof(CatalogHeader) + mutils::bytes_size(catalog));
+    char* const payload = buffer.data() + sizeof(CatalogHeader);
+    mutils::to_bytes(catalog, payload);
+    CatalogHeader header;
+    header.size = buffer.size() - sizeof(CatalogHeader);
+    header.hash = hash_bytes(payload, header.size);
+    header.saved_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                              std::chrono::system_clock::now().time_since_epoch())
+                              .count();
+    memcpy(buffer.data(), &header, sizeof(header));
+    // replace the catalog in one step, so that a crash leaves either the old or the new one.
+    const std::string catalog_file = get_catalog_file();
+    std::lock_guard<std::mutex> lck(catalog_mutex);
+    if(Blob(buffer.data(), buffer.size()).write_file(catalog_file + ".tmp") != 0
+       || rename((catalog_file + ".tmp").c_str(), catalog_file.c_str())) {
+        std::cerr << "Failed to save the model catalog(" << catalog_file << ")." << std::endl;
+    }
+}
+
+void CategorizerTier::load_catalog() {
+    Blob catalog;
+    if(map_whole_file(get_catalog_file(), catalog) != 0 || catalog.size == 0) {
+        return;
+    }
+    // 1 - deserialize only a catalog that was written whole.
+    CatalogHeader header;
+    if(catalog.size < sizeof(header)) {
+        std::cerr << "The model catalog(" << get_catalog_file() << ") is truncated, ignoring it." << std::endl;
+        return;
+    }
+    memcpy(&header, catalog.bytes, sizeof(header));
+    const char* const payload = catalog.bytes + sizeof(header);
+    if(header.size != catalog.size - sizeof(header) || hash_bytes(payload, header.size) != header.hash) {
+        std::cerr << "The model catalog(" << get_catalog_file() << ") is truncated or corrupted, ignoring it." << std::endl;
+        return;
+    }
+    std::unique_ptr<std::map<uint32_t, Model>> models
+            = mutils::from_bytes<std::map<uint32_t, Model>>(nullptr, payload);
+    for(const auto& model : *models) {
+        // the segments are checked against their content hash, which the
+        // versions of the models are computed from.
+        bool complete = true;
+        for(const uint64_t segment_id : model.second.segments) {
+            if(segments.has(segment_id)) {
+                continue;
+            }
+            Blob segment;
+            if(map_whole_file(get_segment_page_file(segment_id), segment) != 0
+               || hash_bytes(segment.bytes, segment.size) != segment_id) {
+                std::cerr << "Segment " << std::hex << segment_id << std::dec << " of the model for tag "
+                          << model.first << " is missing or corrupted on disk." << std::endl;
+                complete = false;
+                break;
+            }
+            segments.blobs.emplace(segment_id, std::move(segment));
+        }
+        if(complete && model.second.get_content_version() != model.second.version) {
+            std::cerr << "The model for tag " << model.first << " does not match its version on disk." << std::endl;
+        } else if(complete) {
+            raw_models.emplace(model.first, model.second);
+        }
+    }
+    // the segments of the models that could not be restored
+    for(auto it = segments.blobs.begin(); it != segments.blobs.end();) {
+        bool used = false;
+        for(const auto& model : raw_models) {
+            used = used || std::find(model.second.segments.begin(), model.second.segments.end(), it->first) != model.second.segments.end();
+        }
+        it = used ? std::next(it) : segments.blobs.erase(it);
+    }
+    std::cout << "Restored " << raw_models.size() << " of " << models->size() << " models from "
+              << get_catalog_file() << "." << std::endl;
+    // 2 - the shard agrees on the newest catalog, see ordered_reconcile_catalog().
+    // A partial one is not announced, lest the other replicas drop the models
+    // missing here; this node fetches them when a replica announces them.
+    if(raw_models.size() == models->size()) {
+        restored_catalog_us = header.saved_us;
+        restored_models = raw_models;
+        for(const auto& segment : segments.blobs) {
+            restored_segment_sizes.emplace(segment.first, segment.second.size);
+        }
+    }
+}
+
+void CategorizerTier::find_referenced_segments() {
+    for(auto it = segments.references.begin(); it != segments.references.end();) {
+        Blob segment;
+        if(!segments.has(it->first) && map_whole_file(get_segment_page_file(it->first), segment) == 0
+           && segment.size == it->second && hash_bytes(segment.bytes, segment.size) == it->first) {
+            segments.blobs.emplace(it->first, std::move(segment));
+        }
+        it = segments.has(it->first) ? segments.references.erase(it) : std::next(it);
+    }
+#ifndef NDEBUG
+    std::cout << "Holding " << segments.blobs.size() << " segments, "
+              << segments.references.size() << " segments to fetch." << std::endl;
+    std::cout.flush();
+#endif
+}
+
+bool CategorizerTier::wait_for_group() {
+    while(group == nullptr) {
+        {
+            std::lock_guard<std::mutex> lck(load_queue_mutex);
+            if(loader_stopped) {
+                return false;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return true;
+}
+
+void CategorizerTier::announce_catalog() {
+    if(restored_catalog_us == 0 || !wait_for_group()) {
+        return;
+    }
+    auto& subgroup_handler = group->template get_subgroup<CategorizerTier>();
+    try {
+        subgroup_handler.ordered_send<RPC_NAME(ordered_reconcile_catalog)>(
+                restored_catalog_us, restored_models, restored_segment_sizes);
+    } catch(const std::exception& ex) {
+        std::cerr << "Failed to announce the model catalog to the shard: " << ex.what() << std::endl;
+    }
+    restored_models.clear();
+    restored_segment_sizes.clear();
+}
+
+void CategorizerTier::fetch_segments(const uint32_t tag) {
+    // content hash -> size
+    std::map<uint64_t, uint64_t> missing;
+    {
+        std::shared_lock read_lock(inference_engines_mutex);
+        auto model_search = raw_models.find(tag);
+        if(model_search == raw_models.end() || !model_search->second.segment_data.empty()) {
+            return;
+        }
+        for(const uint64_t segment_id : model_search->second.segments) {
+            auto reference_search = segments.references.find(segment_id);
+            if(reference_search != segments.references.end()) {
+                missing.emplace(segment_id, reference_search->second);
+            }
+        }
+    }
+    // 1 - the group is attached after the state transfer has constructed this object.
+    if(!wait_for_group()) {
+        return;
+    }
+    auto& subgroup_handler = group->template get_subgroup<CategorizerTier>();
+    const node_id_t my_id = derecho::getConfUInt32(CONF_DERECHO_LOCAL_ID);
+    std::vector<node_id_t> peers;
+    for(const auto& shard : group->template get_subgroup_members<CategorizerTier>()) {
+        if(std::find(shard.begin(), shard.end(), my_id) == shard.end()) {
+            continue;
+        }
+        for(const node_id_t node : shard) {
+            if(node != my_id) {
+                peers.push_back(node);
+            }
+        }
+    }
+    // 2 - fetch the segments chunk by chunk, from any peer that has them.
+    for(const auto& segment_to_fetch : missing) {
+        const uint64_t segment_id = segment_to_fetch.first;
+        const uint64_t segment_size = segment_to_fetch.second;
+        bool fetched = false;
+        Blob segment(nullptr, segment_size);
+        for(const node_id_t peer : peers) {
+            uint64_t offset = 0;
+            while(offset < segment_size) {
+                const uint64_t chunk_size = std::min(install_chunk_size, segment_size - offset);
+                derecho::rpc::QueryResults<Blob> result = subgroup_handler.template p2p_send<RPC_NAME(get_segment)>(
+                        peer, segment_id, offset, chunk_size);
+                const Blob chunk = result.get().get(peer);
+                if(chunk.size != chunk_size) {
+                    break;
+                }
+                memcpy(segment.bytes + offset, chunk.bytes, chunk_size);
+                offset += chunk_size;
+            }
+            if(offset == segment_size && hash_bytes(segment.bytes, segment.size) == segment_id) {
+                fetched = true;
+                break;
+            }
+        }
+        if(!fetched) {
+            std::cerr << "Cannot fetch segment " << std::hex << segment_id << std::dec
+                      << " of the model for tag " << tag << " from the shard." << std::endl;
+            return;
+        }
+        std::unique_lock write_lock(inference_engines_mutex);
+        // unless the last model using it has been removed meanwhile
+        if(segment_refs.find(segment_id) != segment_refs.end() && !segments.has(segment_id)) {
+            segments.blobs.emplace(segment_id, std::move(segment));
+            segments.references.erase(segment_id);
+        }
+    }
+    // 3 - bind the models that are complete now.
+    std::unique_lock write_lock(inference_engines_mutex);
+    for(auto& model : raw_models) {
+        if(model.second.segment_data.empty()) {
+            model.second.bind_segments(segments.blobs);
+        }
+    }
+}
+
+std::vector<Guess> CategorizerTier::inference_batch(const std::vector<Photo>& photos) {
+    std::vector<Guess> guesses(photos.size());
+    // 1 - the clients that have given up already: do not spend any work on
+    // them. The function tier bounds the requests queued here.
+    std::map<uint32_t, std::vector<std::size_t>> live_photos;
+    for(std::size_t i = 0; i < photos.size(); i++) {
+        if(photos[i].expired()) {
+            guesses[i].guess = "The deadline has passed.";
+        } else {
+            live_photos[photos[i].tag].push_back(i);
+        }
+    }
+    // 2 - serve the others, one forward pass for all the photos of a tag.
+    for(const auto& tag_photos : live_photos) {
+        run_inference(tag_photos.first, photos, tag_photos.second, guesses);
+    }
+    return guesses;
+}
+
+void CategorizerTier::run_inference(const uint32_t tag, const std::vector<Photo>& photos,
+                                    const std::vector<std::size_t>& indices, std::vector<Guess>& guesses) {
+#ifndef NDEBUG
+    std::cout << "CategorizerTier::inference_batch() called with " << indices.size()
+              << " photos of tag = " << tag << std::endl;
     std::cout.flush();
 #endif  // NDEBUG
-    // 1 - load model if required
-    std::shared_lock read_lock(inference_engines_mutex);
-    if(inference_engines.find(photo.tag) == inference_engines.end()) {
-        if(raw_models.find(photo.tag) == raw_models.end()) {
-            Guess guess;
-            std::cerr << "Cannot find model for photo tag:" << photo.tag << "."
-                      << std::endl;
-            guess.guess = "Cannot find model for photo tag.";
-            return guess;
+    // 1 - find the engine, waiting for it to load if required. Only the slot
+    // of the tag is locked, so requests for different tags never contend.
+    EngineSlot* slot = find_slot(tag);
+    std::shared_ptr<CachedEngine> cached;
+    bool installed = false;
+    if(slot != nullptr) {
+        std::unique_lock<std::mutex> slot_lock(slot->mutex);
+        installed = slot->installed;
+        if(slot->engine) {
+            slot->hits += indices.size();
+        } else if(installed) {
+            slot->misses += indices.size();
+            slot_lock.unlock();
+            // joins the load started at install time, if there is one.
+            load_engine_async(tag).wait();
+            slot_lock.lock();
         }
-        read_lock.unlock();
-        try {
-            std::unique_ptr<InferenceEngine> engine = std::make_unique<InferenceEngine>(raw_models[photo.tag]);
-            std::unique_lock write_lock(inference_engines_mutex);
-            inference_engines[photo.tag] = std::move(engine);
-            return inference_engines[photo.tag]->inference(photo);
-        } catch(...) {
-            std::cerr << "Fatal error loading model" << std::endl;
-            Guess guess;
-            guess.guess = "Cannot load model for photo tag.  Something is wrong.";
-            return guess;
+        cached = slot->engine;
+    }
+    if(!installed) {
+        std::cerr << "Cannot find model for photo tag:" << tag << "."
+                  << std::endl;
+        for(const std::size_t i : indices) {
+            guesses[i].guess = "Cannot find model for photo tag.";
         }
+        return;
     }
 
     // 2 - inference
-    return inference_engines[photo.tag]->inference(photo);
+    if(!cached) {
+        std::cerr << "Fatal error loading model" << std::endl;
+        for(const std::size_t i : indices) {
+            guesses[i].guess = "Cannot load model for photo tag.  Something is wrong.";
+        }
+        return;
+    }
+    cached->last_used = std::chrono::steady_clock::now().time_since_epoch().count();
+    // 3 - a repeated photo is answered from the cache, before it is decoded;
+    // the other photos run together.
+    std::vector<std::unique_ptr<ResultCache::Flight>> flights;
+    std::vector<const Photo*> batch;
+    std::vector<std::size_t> batch_indices;
+    std::vector<std::pair<std::size_t, std::shared_future<Guess>>> joined;
+    for(const std::size_t i : indices) {
+        std::shared_future<Guess> result;
+        std::unique_ptr<ResultCache::Flight> flight
+                = result_cache.start(photos[i], cached->model_version, result);
+        if(flight) {
+            flights.emplace_back(std::move(flight));
+            batch.push_back(&photos[i]);
+            batch_indices.push_back(i);
+        } else {
+            joined.emplace_back(i, std::move(result));
+        }
+    }
+    if(!batch.empty()) {
+        std::vector<Guess> batch_guesses;
+        try {
+            batch_guesses = batcher.inference(*cached->engine, batch);
+        } catch(...) {
+            for(auto& flight : flights) {
+                result_cache.fail(std::move(flight), std::current_exception());
+            }
+            throw;
+        }
+        for(std::size_t k = 0; k < batch.size(); k++) {
+            result_cache.finish(std::move(flights[k]), batch_guesses[k]);
+            guesses[batch_indices[k]] = std::move(batch_guesses[k]);
+        }
+    }
+    // the inferences joined were started by earlier requests, or by this one.
+    for(auto& join : joined) {
+        guesses[join.first] = join.second.get();
+    }
 }
 
 int CategorizerTier::install_model(const uint32_t& tag,
-                                   const ssize_t& synset_size,
-                                   const ssize_t& symbol_size,
-                                   const ssize_t& params_size,
-                                   const BlobWrapper& model_data) {
+                                   const uint32_t& params_format,
+                                   const uint32_t& backend,
+                                   const std::vector<uint64_t>& segment_ids,
+                                   const std::vector<uint64_t>& carried_ids,
+                                   const std::vector<uint64_t>& carried_sizes,
+                                   const uint64_t& upload_id) {
 #ifndef DEBUG
     std::cout << "CategorizerTier::install_model() is called with tag=" << tag
               << std::endl;
@@ -62,7 +740,7 @@ int CategorizerTier::install_model(const uint32_t& tag,
     auto& subgroup_handler = group->template get_subgroup<CategorizerTier>();
     // pass it to all replicas
     derecho::rpc::QueryResults<int> results = subgroup_handler.ordered_send<RPC_NAME(ordered_install_model)>(
-            tag, synset_size, symbol_size, params_size, model_data);
+            tag, params_format, backend, segment_ids, carried_ids, carried_sizes, upload_id);
     // check results
     decltype(results)::ReplyMap& replies = results.get();
     for(auto& reply_pair : replies) {
@@ -81,24 +759,180 @@ int CategorizerTier::install_model(const uint32_t& tag,
     return ret;
 }
 
+int CategorizerTier::stage_chunk(const uint64_t& upload_id,
+                                 const uint64_t& segment_id,
+                                 const uint64_t& segment_size,
+                                 const uint64_t& offset,
+                                 const BlobWrapper& chunk) {
+    auto& subgroup_handler = group->template get_subgroup<CategorizerTier>();
+    // the replies are not waited for: the commit checks that the segments are complete.
+    const uint64_t stamp_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                                      std::chrono::system_clock::now().time_since_epoch())
+                                      .count();
+    subgroup_handler.ordered_send<RPC_NAME(ordered_stage_chunk)>(upload_id, segment_id, segment_size, offset, chunk, stamp_us);
+    return 0;
+}
+
+int CategorizerTier::ordered_stage_chunk(const uint64_t& upload_id,
+                                         const uint64_t& segment_id,
+                                         const uint64_t& segment_size,
+                                         const uint64_t& offset,
+                                         const BlobWrapper& chunk,
+                                         const uint64_t& stamp_us) {
+    sweep_staged_segments(stamp_us);
+    const auto key = std::make_pair(upload_id, segment_id);
+    auto staged_search = staged_segments.find(key);
+    if(staged_search == staged_segments.end()) {
+        if(offset != 0) {
+            // this node joined the shard in the middle of the segment.
+            return 0;
+        }
+        staged_search = staged_segments.emplace(key, StagedSegment{Blob(nullptr, segment_size), 0, true}).first;
+    }
+    staged_uploads[upload_id] = stamp_us;
+    StagedSegment& staged = staged_search->second;
+    if(!staged.valid || offset != staged.received || offset + chunk.size > segment_size) {
+        std::cerr << "Chunk at offset " << offset << " of segment " << std::hex << segment_id << std::dec
+                  << " is out of order." << std::endl;
+        staged.valid = false;
+        return -1;
+    }
+    if(chunk.size > 0) {
+        memcpy(staged.data.bytes + offset, chunk.bytes, chunk.size);
+    }
+    staged.received += chunk.size;
+    return 0;
+}
+
+int CategorizerTier::abort_upload(const uint64_t& upload_id) {
+    auto& subgroup_handler = group->template get_subgroup<CategorizerTier>();
+    derecho::rpc::QueryResults<int> results = subgroup_handler.ordered_send<RPC_NAME(ordered_abort_upload)>(upload_id);
+    decltype(results)::ReplyMap& replies = results.get();
+    for(auto& reply_pair : replies) {
+        reply_pair.second.get();
+    }
+    return 0;
+}
+
+int CategorizerTier::ordered_abort_upload(const uint64_t& upload_id) {
+    drop_staged_upload(upload_id);
+    return 0;
+}
+
+void CategorizerTier::drop_staged_upload(const uint64_t upload_id) {
+    staged_segments.erase(staged_segments.lower_bound(std::make_pair(upload_id, uint64_t{0})),
+                          staged_segments.upper_bound(std::make_pair(upload_id, std::numeric_limits<uint64_t>::max())));
+    staged_uploads.erase(upload_id);
+}
+
+void CategorizerTier::sweep_staged_segments(const uint64_t stamp_us) {
+    if(staged_uploads.empty()) {
+        return;
+    }
+    // an upload id starts with the id of the function tier node uploading it.
+    std::set<node_id_t> function_tier_nodes;
+    for(const auto& shard : group->template get_subgroup_members<FunctionTier>()) {
+        function_tier_nodes.insert(shard.begin(), shard.end());
+    }
+    std::vector<uint64_t> stale_uploads;
+    for(const auto& upload : staged_uploads) {
+        if(function_tier_nodes.find(static_cast<node_id_t>(upload.first >> 32)) == function_tier_nodes.end()
+           || upload.second + STAGED_UPLOAD_TIMEOUT_US < stamp_us) {
+            stale_uploads.push_back(upload.first);
+        }
+    }
+    for(const uint64_t upload_id : stale_uploads) {
+        std::cerr << "Dropping the staged segments of stale upload " << upload_id << "." << std::endl;
+        drop_staged_upload(upload_id);
+    }
+}
+
 int CategorizerTier::ordered_install_model(const uint32_t& tag,
-                                           const ssize_t& synset_size,
-                                           const ssize_t& symbol_size,
-                                           const ssize_t& params_size,
-                                           const BlobWrapper& model_data) {
-    // validation
-    if(raw_models.find(tag) != raw_models.end()) {
-        std::cerr << "install_model failed because tag (" << tag << ") has been taken."
-                  << std::endl;
+                                           const uint32_t& params_format,
+                                           const uint32_t& backend,
+                                           const std::vector<uint64_t>& segment_ids,
+                                           const std::vector<uint64_t>& carried_ids,
+                                           const std::vector<uint64_t>& carried_sizes,
+                                           const uint64_t& upload_id) {
+    // 1 - take the staged segments of the install, and check them before
+    // blocking inference.
+    std::map<uint64_t, StagedSegment> staged;
+    auto staged_begin = staged_segments.lower_bound(std::make_pair(upload_id, uint64_t{0}));
+    auto staged_end = staged_segments.upper_bound(std::make_pair(upload_id, std::numeric_limits<uint64_t>::max()));
+    for(auto it = staged_begin; it != staged_end; it++) {
+        staged.emplace(it->first.second, std::move(it->second));
+    }
+    drop_staged_upload(upload_id);
+    if(segment_ids.size() <= MODEL_SEGMENT_PARAMS || carried_ids.size() != carried_sizes.size()) {
+        std::cerr << "install_model failed because the segment list of tag (" << tag
+                  << ") is malformed." << std::endl;
         return -1;
     }
+    for(std::size_t i = 0; i < carried_ids.size(); i++) {
+        auto staged_search = staged.find(carried_ids[i]);
+        // a node that joined the shard during the upload fetches it later.
+        if(staged_search == staged.end()) {
+            continue;
+        }
+        if(!staged_search->second.valid || staged_search->second.received != carried_sizes[i]
+           || hash_bytes(staged_search->second.data.bytes, carried_sizes[i]) != carried_ids[i]) {
+            std::cerr << "install_model failed because a carried segment of tag (" << tag
+                      << ") is incomplete or does not match its content hash." << std::endl;
+            return -1;
+        }
+    }
+    {
+        std::unique_lock write_lock(inference_engines_mutex);
+        // 2 - validation. All replicas hold the same segments, so they all
+        // agree on the outcome.
+        if(raw_models.find(tag) != raw_models.end()) {
+            std::cerr << "install_model failed because tag (" << tag << ") has been taken."
+                      << std::endl;
+            return -1;
+        }
+        for(const uint64_t segment_id : segment_ids) {
+            // a segment this node still has to fetch counts as stored, like on the other replicas.
+            if(!segments.has(segment_id) && segments.references.find(segment_id) == segments.references.end()
+               && std::find(carried_ids.begin(), carried_ids.end(), segment_id) == carried_ids.end()) {
+                // removed after the caller checked for missing segments.
+                std::cerr << "install_model failed because segment " << std::hex << segment_id << std::dec
+                          << " of tag (" << tag << ") is neither stored nor carried." << std::endl;
+                return INSTALL_MISSING_SEGMENTS;
+            }
+        }
 
-    Model model;
-    model.synset_size = synset_size;
-    model.symbol_size = symbol_size;
-    model.params_size = params_size;
-    model.model_data = Blob(model_data.bytes, model_data.size);
-    raw_models.emplace(tag, model);
+        // 3 - store the new segments and reference them.
+        for(std::size_t i = 0; i < carried_ids.size(); i++) {
+            if(segments.has(carried_ids[i])) {
+                continue;
+            }
+            auto staged_search = staged.find(carried_ids[i]);
+            if(staged_search != staged.end()) {
+                segments.blobs.emplace(carried_ids[i], std::move(staged_search->second.data));
+                segments.references.erase(carried_ids[i]);
+            } else {
+                segments.references.emplace(carried_ids[i], carried_sizes[i]);
+            }
+        }
+        Model model;
+        model.params_format = params_format;
+        model.backend = backend;
+        model.segments = segment_ids;
+        model.version = model.get_content_version();
+        model.bind_segments(segments.blobs);
+        for(const uint64_t segment_id : segment_ids) {
+            segment_refs[segment_id]++;
+        }
+        raw_models.emplace(tag, model);
+        ordered_tags.insert(tag);
+        EngineSlot* slot = get_slot(tag);
+        std::lock_guard<std::mutex> slot_lock(slot->mutex);
+        slot->installed = true;
+    }
+    // a reinstalled tag must not answer with the guesses of the old model.
+    result_cache.invalidate(tag);
+    // build the engine in the background, so that the first photo does not wait for it.
+    load_engine_async(tag);
 #ifndef NDEBUG
     std::cout << "Returning from CategorizerTier::ordered_install_model() successfully."
               << std::endl;
@@ -126,6 +960,7 @@ int CategorizerTier::remove_model(const uint32_t& tag) {
 }
 
 int CategorizerTier::ordered_remove_model(const uint32_t& tag) {
+    std::unique_lock write_lock(inference_engines_mutex);
     // remove from raw_model.
     auto model_search = raw_models.find(tag);
     if(model_search == raw_models.end()) {
@@ -133,16 +968,100 @@ int CategorizerTier::ordered_remove_model(const uint32_t& tag) {
                   << std::endl;
         return -1;
     }
+    drop_model(tag);
+    ordered_tags.insert(tag);
+    return 0;
+}
 
+void CategorizerTier::drop_model(const uint32_t tag) {
+    // the catalog on disk must not refer to the segment files released below.
+    auto model_search = raw_models.find(tag);
+    const Model model = model_search->second;
     raw_models.erase(model_search);
+    if(durable_models) {
+        save_catalog();
+    }
+    release_segments(model);
+    result_cache.invalidate(tag);
 
-    // remove from inference_engines
-    std::unique_lock write_lock(inference_engines_mutex);
-    auto engine_search = inference_engines.find(tag);
-    if(engine_search != inference_engines.end()) {
-        inference_engines.erase(engine_search);
+    // drop the engine; the requests using it keep it until they finish.
+    EngineSlot* slot = find_slot(tag);
+    std::lock_guard<std::mutex> slot_lock(slot->mutex);
+    slot->installed = false;
+    if(slot->engine) {
+        engine_resident_bytes -= slot->engine->footprint;
+        slot->engine.reset();
     }
+}
 
+int CategorizerTier::ordered_reconcile_catalog(const uint64_t& saved_us,
+                                               const std::map<uint32_t, Model>& models,
+                                               const std::map<uint64_t, uint64_t>& segment_sizes) {
+    // 1 - the newest catalog wins. The replicas see the announcements in the
+    // same order, so they all adopt the same one.
+    if(saved_us <= adopted_catalog_us) {
+        return 0;
+    }
+    adopted_catalog_us = saved_us;
+    std::vector<uint32_t> adopted_tags;
+    {
+        std::unique_lock write_lock(inference_engines_mutex);
+        // 2 - the models to take from the catalog: those missing here, or
+        // here in another version. A model whose segment sizes are not all
+        // announced cannot be fetched, so it is left out on every replica.
+        std::vector<uint32_t> stale_tags;
+        for(const auto& model : raw_models) {
+            auto catalog_search = models.find(model.first);
+            if(ordered_tags.find(model.first) == ordered_tags.end()
+               && (catalog_search == models.end() || catalog_search->second.version != model.second.version)) {
+                stale_tags.push_back(model.first);
+            }
+        }
+        for(const auto& model : models) {
+            auto model_search = raw_models.find(model.first);
+            const bool sized = std::all_of(model.second.segments.begin(), model.second.segments.end(),
+                                           [&segment_sizes](const uint64_t segment_id) {
+                                               return segment_sizes.find(segment_id) != segment_sizes.end();
+                                           });
+            if(ordered_tags.find(model.first) == ordered_tags.end() && sized
+               && model.second.get_content_version() == model.second.version
+               && (model_search == raw_models.end() || model_search->second.version != model.second.version)) {
+                adopted_tags.push_back(model.first);
+            }
+        }
+        // 3 - reference the segments of the adopted models before the stale
+        // ones release theirs, so that the shared segments are kept.
+        for(const uint32_t tag : adopted_tags) {
+            for(const uint64_t segment_id : models.at(tag).segments) {
+                segment_refs[segment_id]++;
+                if(!segments.has(segment_id)) {
+                    segments.references.emplace(segment_id, segment_sizes.at(segment_id));
+                }
+            }
+        }
+        for(const uint32_t tag : stale_tags) {
+            drop_model(tag);
+        }
+        // the segments on disk are found there, the others fetched by the loader.
+        find_referenced_segments();
+        for(const uint32_t tag : adopted_tags) {
+            Model model = models.at(tag);
+            model.bind_segments(segments.blobs);
+            raw_models.emplace(tag, model);
+            EngineSlot* slot = get_slot(tag);
+            std::lock_guard<std::mutex> slot_lock(slot->mutex);
+            slot->installed = true;
+        }
+        if(durable_models && !adopted_tags.empty()) {
+            save_catalog();
+        }
+        std::cout << "Adopted the model catalog saved at " << saved_us << ": dropped " << stale_tags.size()
+                  << " models, took " << adopted_tags.size() << " models." << std::endl;
+    }
+    for(const uint32_t tag : adopted_tags) {
+        result_cache.invalidate(tag);
+        load_engine_async(tag);
+    }
     return 0;
 }
 }  // namespace sospdemo
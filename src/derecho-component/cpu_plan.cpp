@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <derecho-component/config.hpp>
+#include <derecho-component/cpu_plan.hpp>
+#include <iostream>
+#include <omp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+
+namespace sospdemo {
+
+/**
+ * @return the CPUs the process may run on
+ */
+static std::vector<int> get_allowed_cores() {
+    std::vector<int> cores;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if(sched_getaffinity(0, sizeof(mask), &mask) != 0) {
+        std::cerr << "sched_getaffinity failed with error:" << strerror(errno) << "." << std::endl;
+        return cores;
+    }
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if(CPU_ISSET(cpu, &mask)) {
+            cores.push_back(cpu);
+        }
+    }
+    return cores;
+}
+
+static std::string format_cpu_list(const std::vector<int>& cores) {
+    std::ostringstream oss;
+    for(std::size_t i = 0; i < cores.size(); i++) {
+        oss << (i ? "," : "") << cores[i];
+    }
+    return oss.str();
+}
+
+int parse_cpu_list(const std::string& cpu_list, std::vector<int>& cores) {
+    cores.clear();
+    std::istringstream iss(cpu_list);
+    std::string range;
+    while(std::getline(iss, range, ',')) {
+        range.erase(std::remove_if(range.begin(), range.end(), ::isspace), range.end());
+        if(range.empty()) {
+            continue;
+        }
+        char* end;
+        const long first = std::strtol(range.c_str(), &end, 10);
+        long last = first;
+        if(*end == '-') {
+            last = std::strtol(end + 1, &end, 10);
+        }
+        if(*end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE) {
+            std::cerr << "Invalid CPU list: " << cpu_list << std::endl;
+            return -1;
+        }
+        for(long cpu = first; cpu <= last; cpu++) {
+            cores.push_back(static_cast<int>(cpu));
+        }
+    }
+    return 0;
+}
+
+/**
+ * Read the CPU plan from the configuration.
+ */
+static CpuPlan load_cpu_plan() {
+    CpuPlan plan{false, get_conf_string(CONF_SOSPDEMO_CPU_PLAN, "none"), {}, {}, 1, 1};
+    if(plan.name == "none") {
+        return plan;
+    }
+    if(plan.name != "latency" && plan.name != "throughput" && plan.name != "custom") {
+        std::cerr << "Unknown cpu_plan: " << plan.name << ". CPU partitioning is disabled." << std::endl;
+        plan.name = "none";
+        return plan;
+    }
+
+    // 1 - partition the cores.
+    const std::vector<int> allowed_cores = get_allowed_cores();
+    const std::string service_cores = get_conf_string(CONF_SOSPDEMO_SERVICE_CORES, "");
+    const std::string inference_cores = get_conf_string(CONF_SOSPDEMO_INFERENCE_CORES, "");
+    // a partition the operator did not mean is worse than none.
+    if(parse_cpu_list(service_cores, plan.service_cores) != 0
+       || parse_cpu_list(inference_cores, plan.inference_cores) != 0) {
+        std::cerr << "Cannot parse " << CONF_SOSPDEMO_SERVICE_CORES << " or " << CONF_SOSPDEMO_INFERENCE_CORES
+                  << ". CPU partitioning is disabled." << std::endl;
+        return CpuPlan{false, "none", {}, {}, 1, 1};
+    }
+    if(plan.service_cores.empty() && !allowed_cores.empty()) {
+        plan.service_cores.push_back(allowed_cores.front());
+    }
+    if(plan.inference_cores.empty()) {
+        for(const int cpu : allowed_cores) {
+            if(std::find(plan.service_cores.begin(), plan.service_cores.end(), cpu) == plan.service_cores.end()) {
+                plan.inference_cores.push_back(cpu);
+            }
+        }
+    }
+    // a single-core box shares its core.
+    if(plan.inference_cores.empty()) {
+        plan.inference_cores = plan.service_cores;
+    }
+
+    // 2 - split the inference cores between intra-op threads and concurrent engines.
+    const uint32_t num_cores = static_cast<uint32_t>(std::max<std::size_t>(plan.inference_cores.size(), 1));
+    plan.intra_op_threads = (plan.name == "latency") ? num_cores : 1;
+    plan.intra_op_threads = std::clamp(get_conf_uint32(CONF_SOSPDEMO_INTRA_OP_THREADS, plan.intra_op_threads), 1u, num_cores);
+    plan.concurrent_engines = std::max(get_conf_uint32(CONF_SOSPDEMO_CONCURRENT_ENGINES, num_cores / plan.intra_op_threads), 1u);
+    plan.enabled = true;
+    return plan;
+}
+
+const CpuPlan& get_cpu_plan() {
+    static const CpuPlan plan = load_cpu_plan();
+    return plan;
+}
+
+int pin_current_thread(const std::vector<int>& cores) {
+    if(cores.empty()) {
+        return 0;
+    }
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for(const int cpu : cores) {
+        CPU_SET(cpu, &mask);
+    }
+    const int ret = pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+    if(ret != 0) {
+        std::cerr << "Failed to pin thread to CPUs " << format_cpu_list(cores) << " with error:"
+                  << strerror(ret) << "." << std::endl;
+    }
+    return ret;
+}
+
+void apply_cpu_plan() {
+    const CpuPlan& plan = get_cpu_plan();
+    if(!plan.enabled) {
+        return;
+    }
+    // MXNet reads them when its engine is created. OMP_NUM_THREADS is not set
+    // here: the OpenMP runtime has read it already, see enter_inference_cores().
+    setenv("MXNET_OMP_MAX_THREADS", std::to_string(plan.intra_op_threads).c_str(), 1);
+    setenv("MXNET_CPU_WORKER_NTHREADS", std::to_string(plan.concurrent_engines).c_str(), 1);
+    pin_current_thread(plan.service_cores);
+    std::cout << "CPU plan " << plan.name << ": service cores = " << format_cpu_list(plan.service_cores)
+              << ", inference cores = " << format_cpu_list(plan.inference_cores)
+              << ", intra-op threads = " << plan.intra_op_threads
+              << ", concurrent engines = " << plan.concurrent_engines << "." << std::endl;
+}
+
+void enter_inference_cores() {
+    const CpuPlan& plan = get_cpu_plan();
+    if(!plan.enabled) {
+        return;
+    }
+    pin_current_thread(plan.inference_cores);
+    // the thread count of OpenMP regions is per thread, and a new thread
+    // starts from the process default.
+    omp_set_num_threads(static_cast<int>(plan.intra_op_threads));
+}
+
+}  // namespace sospdemo
@@ -1,8 +1,19 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <deque>
 #include <derecho-component/blob.hpp>
 #include <derecho-component/categorizer_tier.hpp>
+#include <derecho-component/config.hpp>
 #include <derecho-component/function_tier.hpp>
 #include <grpc-component/function_tier-grpc.hpp>
+#include <mxnet-component/params_format.hpp>
+#include <iterator>
 #include <mxnet-component/utils.hpp>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
 
 namespace sospdemo {
 
@@ -11,6 +22,8 @@ using grpc::ServerBuilder;
 using grpc::ServerContext;
 using grpc::Status;
 
+std::atomic<uint64_t> FunctionTier::view_epoch(0);
+
 static void debug_target_valid(
         derecho::ExternalCaller<CategorizerTier>& categorizer_tier_handler,
         node_id_t target) {
@@ -22,75 +35,13 @@ static void debug_target_valid(
 #endif
 }
 
-Status FunctionTier::Whatsthis(ServerContext* context,
-                               grpc::ServerReader<PhotoRequest>* reader,
-                               PhotoReply* reply) {
-    ParsedWhatsThisArguments parsed_args;
-    try {
-        parsed_args = parse_grpc_whatsthis_args(context, reader, reply);
-    } catch(const RequestCancel&) {
-        return Status::CANCELLED;
-    } catch(const StatusOK&) {
-        return Status::OK;
-    }
-    //retrieve subgroup handler for this call
-    derecho::ExternalCaller<CategorizerTier>& categorizer_tier_handler
-            = group->get_nonmember_subgroup<CategorizerTier>();
-
-    //get list of shards for this subgroup
-    auto shards = group->get_subgroup_members<CategorizerTier>();
-
-    //We might want to ask more than one shard to identify our image.
-    //We'll store all their responses in this vector
-    using response_pair = std::pair<derecho::rpc::QueryResults<Guess>, node_id_t>;
-    std::vector<response_pair> responses;
-    if(parsed_args.tags.size() > 1) {
-        /**
-         * TODO: implement support for multiple tags.
-         * hint: the else branch of this conditional looks like it'd make a good body for a for-loop.
-         * Why not loop over the parsed_args.tags array?
-         **/
-        reply->set_desc("Multiple tags support to be implemented.");
-        return Status::OK;
-    } else {
-        std::size_t tag_index = 0;
-        // 2 - pass it to the categorizer tier.
-        node_id_t target = shards[parsed_args.tags[tag_index] % shards.size()][0];
-        // TODO: add randomness for load-balancing.                       ^^^^^^^
-        debug_target_valid(categorizer_tier_handler, target);  //(just for debugging)
-        // 3 - post it to the categorizer tier
-        responses.emplace_back(
-                categorizer_tier_handler.p2p_send<RPC_NAME(inference)>(
-                        target, Photo{parsed_args.tags[tag_index],
-                                      parsed_args.photo_data,
-                                      parsed_args.photo_size}),
-                target);
-#ifndef NDEBUG
-        std::cout << "p2p_send for inference returned." << std::endl;
-        std::cout.flush();
-#endif
-    }
-
-    //Time to wait for (and process) the responses
-    std::vector<Guess> guesses;
-    for(auto& result : responses) {
-        guesses.emplace_back(result.first.get().get(result.second));
-#ifndef NDEBUG
-        std::cout << "Received response from the categorizer tier with ret = "
-                  << guesses.back().guess << "." << std::endl;
-        std::cout.flush();
-#endif
-    }
-
-    // 4 - return Status::OK;
-    std::string reply_string = guesses.at(0).guess;
-    for(uint i = 1; i < guesses.size(); ++i) {
-        reply_string += " or " + guesses.at(i).guess;
-    }
-
-    reply->set_desc(reply_string);
-
-    return Status::OK;
+/**
+ * @return the steady clock time in microseconds
+ */
+static uint64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
 }
 
 Status FunctionTier::InstallModel(grpc::ServerContext* context,
@@ -106,26 +57,75 @@ Status FunctionTier::InstallModel(grpc::ServerContext* context,
     const ssize_t synset_size = parsed_args.synset_size;
     const ssize_t symbol_size = parsed_args.symbol_size;
     const ssize_t params_size = parsed_args.params_size;
-    const ssize_t data_size = parsed_args.data_size;
-    char* model_data = parsed_args.model_data;
-
-    // 2 - find the shard
-    // Currently, we use the one-shard implementation.
-    auto shards = group->get_subgroup_members<CategorizerTier>();
-    node_id_t target = shards[tag % shards.size()][0];
-    // TODO: add randomness for load-balancing.
+    const char* model_data = parsed_args.model_data;
+    const uint32_t backend = parsed_args.backend;
 
-    // 3 - post it to the categorizer tier
-    derecho::ExternalCaller<CategorizerTier>& categorizer_tier_handler
-            = group->get_nonmember_subgroup<CategorizerTier>();
-    BlobWrapper model_data_wrapper(model_data, data_size);
-    derecho::rpc::QueryResults<int> result = categorizer_tier_handler.p2p_send<RPC_NAME(install_model)>(
-            target, tag, synset_size, symbol_size, params_size, model_data_wrapper);
-#ifndef NDEBUG
-    std::cout << "p2p_send for install_model returned." << std::endl;
-    std::cout.flush();
+    // 1 - split the model into segments: synset, symbol and one segment per
+    // parameter tensor, converted to FP16 if asked to. Only MXNet has
+    // parameters to split; parameters that cannot be split stay one segment,
+    // and so do all of them in a build without MXNet.
+    uint32_t params_format = kParamsMXNet;
+    std::vector<std::string> tensors;
+#ifdef WITH_MXNET
+    if(backend == kBackendMXNet) {
+        if(split_params(model_data + synset_size + symbol_size, params_size,
+                        parsed_args.fp16_params, tensors)
+           == 0) {
+            params_format = parsed_args.fp16_params ? kParamsFP16 : kParamsFP32;
+        } else if(parsed_args.fp16_params) {
+            reply->set_error_code(-1);
+            reply->set_error_desc("Cannot convert the parameters to FP16.");
+            return Status::OK;
+        }
+    }
+#else
+    if(backend == kBackendMXNet && parsed_args.fp16_params) {
+        reply->set_error_code(-1);
+        reply->set_error_desc("Cannot convert the parameters to FP16 in a build without MXNet.");
+        return Status::OK;
+    }
 #endif
-    int ret = result.get().get(target);
+    std::vector<BlobWrapper> segments;
+    segments.emplace_back(model_data, synset_size);
+    segments.emplace_back(model_data + synset_size, symbol_size);
+    if(params_format == kParamsMXNet) {
+        segments.emplace_back(model_data + synset_size + symbol_size, params_size);
+    } else {
+        for(const auto& tensor : tensors) {
+            segments.emplace_back(tensor.data(), tensor.size());
+        }
+    }
+    std::vector<uint64_t> segment_ids;
+    for(const auto& segment : segments) {
+        segment_ids.push_back(hash_bytes(segment.bytes, segment.size));
+    }
+
+    // 2 - place the model on model_replication shards.
+    std::shared_ptr<const ShardView> view = get_shard_view();
+    const std::vector<uint32_t> placement = place_model(tag, view->shards.size());
+
+    // 3 - install it on each shard. A model is either on all its shards or on
+    // none: a failed install is removed from the shards that took it.
+    int ret = 0;
+    std::vector<uint32_t> installed_shards;
+    for(const uint32_t shard : placement) {
+        ret = install_on_shard(pick_replica(view->shards[shard]), tag, params_format, backend, segments, segment_ids);
+        if(ret != 0) {
+            break;
+        }
+        installed_shards.push_back(shard);
+    }
+    if(ret == 0) {
+        set_placement(tag, placement);
+    } else {
+        derecho::ExternalCaller<CategorizerTier>& categorizer_tier_handler
+                = group->get_nonmember_subgroup<CategorizerTier>();
+        for(const uint32_t shard : installed_shards) {
+            const node_id_t target = pick_replica(view->shards[shard]);
+            derecho::rpc::QueryResults<int> result = categorizer_tier_handler.p2p_send<RPC_NAME(remove_model)>(target, tag);
+            result.get().get(target);
+        }
+    }
 
 #ifndef NDEBUG
     std::cout << "Received response from the categorizer tier with ret = "
@@ -133,6 +133,9 @@ Status FunctionTier::InstallModel(grpc::ServerContext* context,
     std::cout.flush();
 #endif
 
+    // a failed install may have replaced the model on some replicas.
+    invalidate_results(tag);
+
     // 4 - return Status::OK;
     reply->set_error_code(ret);
     if(ret == 0)
@@ -143,30 +146,134 @@ Status FunctionTier::InstallModel(grpc::ServerContext* context,
     return Status::OK;
 }
 
+int FunctionTier::install_on_shard(const node_id_t target, const uint32_t tag,
+                                   const uint32_t params_format, const uint32_t backend,
+                                   const std::vector<BlobWrapper>& segments,
+                                   const std::vector<uint64_t>& segment_ids) {
+    // 1 - ask the shard which segments it does not have yet.
+    derecho::ExternalCaller<CategorizerTier>& categorizer_tier_handler
+            = group->get_nonmember_subgroup<CategorizerTier>();
+    derecho::rpc::QueryResults<std::vector<uint64_t>> missing_result
+            = categorizer_tier_handler.p2p_send<RPC_NAME(missing_segments)>(target, segment_ids);
+    std::vector<uint64_t> missing = missing_result.get().get(target);
+
+    // 2 - post the model with the missing segments to the categorizer tier. A
+    // segment may be removed with the last model using it before the install
+    // arrives; the install is retried with all the segments then.
+    const uint64_t install_chunk_size = std::max(get_conf_uint32(CONF_SOSPDEMO_INSTALL_CHUNK_SIZE, 1048576), 1u);
+    const node_id_t my_id = derecho::getConfUInt32(CONF_DERECHO_LOCAL_ID);
+    int ret;
+    while(true) {
+        // 2.1 - stage the missing segments in the shard chunk by chunk, with up
+        // to INSTALL_CHUNK_WINDOW chunks in flight.
+        const uint64_t upload_id = (static_cast<uint64_t>(my_id) << 32) | next_upload_id++;
+        std::vector<uint64_t> carried_ids;
+        std::vector<uint64_t> carried_sizes;
+        std::deque<derecho::rpc::QueryResults<int>> staging;
+        ret = 0;
+        auto wait_for_chunk = [&]() {
+            if(staging.front().get().get(target) != 0) {
+                ret = -1;
+            }
+            staging.pop_front();
+        };
+        try {
+            for(std::size_t i = 0; i < segments.size(); i++) {
+                if(std::find(missing.begin(), missing.end(), segment_ids[i]) == missing.end()
+                   || std::find(carried_ids.begin(), carried_ids.end(), segment_ids[i]) != carried_ids.end()) {
+                    continue;
+                }
+                carried_ids.push_back(segment_ids[i]);
+                carried_sizes.push_back(segments[i].size);
+                // an empty segment is staged by one empty chunk.
+                uint64_t offset = 0;
+                do {
+                    const uint64_t chunk_size = std::min(install_chunk_size, segments[i].size - offset);
+                    if(staging.size() == INSTALL_CHUNK_WINDOW) {
+                        wait_for_chunk();
+                    }
+                    staging.emplace_back(categorizer_tier_handler.p2p_send<RPC_NAME(stage_chunk)>(
+                            target, upload_id, segment_ids[i], static_cast<uint64_t>(segments[i].size), offset,
+                            BlobWrapper(segments[i].bytes + offset, chunk_size)));
+                    offset += chunk_size;
+                } while(offset < segments[i].size);
+            }
+            while(!staging.empty()) {
+                wait_for_chunk();
+            }
+        } catch(...) {
+            abort_upload(target, upload_id);
+            throw;
+        }
+#ifndef NDEBUG
+        std::cout << "Staged " << carried_ids.size() << " of " << segments.size()
+                  << " segments with upload id " << upload_id << "." << std::endl;
+        std::cout.flush();
+#endif
+        if(ret != 0) {
+            // the install is not committed: free the chunks the shard holds.
+            abort_upload(target, upload_id);
+            break;
+        }
+        // 2.2 - commit the install in all replicas. It drops the staged
+        // segments whatever its outcome.
+        try {
+            derecho::rpc::QueryResults<int> result = categorizer_tier_handler.p2p_send<RPC_NAME(install_model)>(
+                    target, tag, params_format, backend, segment_ids, carried_ids, carried_sizes, upload_id);
+#ifndef NDEBUG
+            std::cout << "p2p_send for install_model returned." << std::endl;
+            std::cout.flush();
+#endif
+            ret = result.get().get(target);
+        } catch(...) {
+            abort_upload(target, upload_id);
+            throw;
+        }
+        if(ret != INSTALL_MISSING_SEGMENTS || missing == segment_ids) {
+            break;
+        }
+        missing = segment_ids;
+    }
+    return ret;
+}
+
+void FunctionTier::abort_upload(const node_id_t target, const uint64_t upload_id) {
+    derecho::ExternalCaller<CategorizerTier>& categorizer_tier_handler
+            = group->get_nonmember_subgroup<CategorizerTier>();
+    try {
+        derecho::rpc::QueryResults<int> result = categorizer_tier_handler.p2p_send<RPC_NAME(abort_upload)>(target, upload_id);
+        result.get().get(target);
+    } catch(...) {
+        // the shard drops it when this node leaves or the upload times out.
+        std::cerr << "Failed to abort upload " << upload_id << " on node " << target << "." << std::endl;
+    }
+}
+
 Status FunctionTier::RemoveModel(grpc::ServerContext* context,
                                  const RemoveModelRequest* request,
                                  ModelReply* reply) {
     // 1 - get the model tag
     uint32_t tag = request->tag();
 
-    // 2 - find the shard
-    // currently, we use the one-shard implementation.
+    // 2 - find the shards
     derecho::ExternalCaller<CategorizerTier>& categorizer_tier_handler
             = group->get_nonmember_subgroup<CategorizerTier>();
-    auto shards = group->get_subgroup_members<CategorizerTier>();
-    node_id_t target = shards[tag % shards.size()][0];
-    // TODO: add randomness for load-balancing.
+    std::shared_ptr<const ShardView> view = get_shard_view();
 
-#ifndef NDEBUG
-    std::cout << "Got the handle of categorizer tier subgroup. external caller is valid:"
-              << categorizer_tier_handler.is_valid() << std::endl;
-    std::cout << "p2p_send using target = " << target << std::endl;
-    std::cout.flush();
-#endif
-
-    // 3 - post it to the categorizer tier
-    derecho::rpc::QueryResults<int> result = categorizer_tier_handler.p2p_send<RPC_NAME(remove_model)>(target, tag);
-    int ret = result.get().get(target);
+    // 3 - post it to each of them
+    int ret = 0;
+    for(const uint32_t shard : get_shards(tag, view->shards.size())) {
+        node_id_t target = pick_replica(view->shards[shard]);
+        debug_target_valid(categorizer_tier_handler, target);
+        derecho::rpc::QueryResults<int> result = categorizer_tier_handler.p2p_send<RPC_NAME(remove_model)>(target, tag);
+        const int one_ret = result.get().get(target);
+        if(one_ret != 0) {
+            ret = one_ret;
+        }
+    }
+    // the tag is free again, even if a shard did not have the model.
+    set_placement(tag, {});
+    invalidate_results(tag);
 
     reply->set_error_code(ret);
     if(ret == 0)
@@ -176,4 +283,536 @@ Status FunctionTier::RemoveModel(grpc::ServerContext* context,
 
     return Status::OK;
 }
+
+Status FunctionTier::GetHedgeStats(grpc::ServerContext* context,
+                                   const HedgeStatsRequest* request,
+                                   HedgeStatsReply* reply) {
+    // sum the counters of this node and of the other function tier nodes.
+    derecho::Replicated<FunctionTier>& function_tier_handler = group->get_subgroup<FunctionTier>();
+    const node_id_t my_id = derecho::getConfUInt32(CONF_DERECHO_LOCAL_ID);
+    HedgeStats total = get_hedge_stats();
+    uint32_t nodes = 1;
+    for(const auto& shard : group->get_subgroup_members<FunctionTier>()) {
+        for(const node_id_t node : shard) {
+            if(node == my_id) {
+                continue;
+            }
+            derecho::rpc::QueryResults<HedgeStats> result = function_tier_handler.p2p_send<RPC_NAME(get_hedge_stats)>(node);
+            const HedgeStats stats = result.get().get(node);
+            total.requests += stats.requests;
+            total.hedged += stats.hedged;
+            total.wins += stats.wins;
+            nodes++;
+        }
+    }
+    reply->set_requests(total.requests);
+    reply->set_hedged(total.hedged);
+    reply->set_wins(total.wins);
+    reply->set_nodes(nodes);
+    return Status::OK;
+}
+
+void FunctionTier::invalidate_results(const uint32_t tag) {
+    derecho::Replicated<FunctionTier>& function_tier_handler = group->get_subgroup<FunctionTier>();
+    derecho::rpc::QueryResults<int> results
+            = function_tier_handler.ordered_send<RPC_NAME(ordered_invalidate_results)>(tag);
+    // wait until every function tier node has dropped them.
+    decltype(results)::ReplyMap& replies = results.get();
+    for(auto& reply_pair : replies) {
+        reply_pair.second.get();
+    }
+}
+
+int FunctionTier::ordered_invalidate_results(const uint32_t& tag) {
+    result_cache.invalidate(tag);
+    return 0;
+}
+
+std::shared_ptr<const FunctionTier::ShardView> FunctionTier::get_shard_view() {
+    const uint64_t epoch = view_epoch;
+    std::lock_guard<std::mutex> lck(shard_view_mutex);
+    if(!shard_view || shard_view->epoch != epoch) {
+        shard_view = std::make_shared<const ShardView>(ShardView{epoch, group->get_subgroup_members<CategorizerTier>()});
+    }
+    return shard_view;
+}
+
+std::vector<uint32_t> FunctionTier::get_shards(const uint32_t tag, const uint32_t num_shards) {
+    std::vector<uint32_t> shards;
+    {
+        std::shared_lock read_lock(tag_to_shard_mutex);
+        auto placement_search = tag_to_shard.find(tag);
+        if(placement_search != tag_to_shard.end()) {
+            for(const uint32_t shard : placement_search->second) {
+                if(shard < num_shards) {
+                    shards.push_back(shard);
+                }
+            }
+        }
+    }
+    if(shards.empty()) {
+        shards.push_back(tag % num_shards);
+    }
+    return shards;
+}
+
+std::vector<uint32_t> FunctionTier::place_model(const uint32_t tag, const uint32_t num_shards) {
+    const uint32_t replication = std::clamp(get_conf_uint32(CONF_SOSPDEMO_MODEL_REPLICATION, 1), 1u, num_shards);
+    std::vector<uint32_t> models_per_shard(num_shards, 0);
+    {
+        std::shared_lock read_lock(tag_to_shard_mutex);
+        if(tag_to_shard.find(tag) != tag_to_shard.end()) {
+            read_lock.unlock();
+            return get_shards(tag, num_shards);
+        }
+        for(const auto& placement : tag_to_shard) {
+            for(const uint32_t shard : placement.second) {
+                if(shard < num_shards) {
+                    models_per_shard[shard]++;
+                }
+            }
+        }
+    }
+    std::vector<uint32_t> shards{tag % num_shards};
+    while(shards.size() < replication) {
+        uint32_t least_loaded = num_shards;
+        for(uint32_t i = 1; i < num_shards; i++) {
+            const uint32_t shard = (tag + i) % num_shards;
+            if(std::find(shards.begin(), shards.end(), shard) == shards.end()
+               && (least_loaded == num_shards || models_per_shard[shard] < models_per_shard[least_loaded])) {
+                least_loaded = shard;
+            }
+        }
+        shards.push_back(least_loaded);
+    }
+    return shards;
+}
+
+void FunctionTier::set_placement(const uint32_t tag, const std::vector<uint32_t>& shards) {
+    derecho::Replicated<FunctionTier>& function_tier_handler = group->get_subgroup<FunctionTier>();
+    derecho::rpc::QueryResults<int> results
+            = function_tier_handler.ordered_send<RPC_NAME(ordered_set_placement)>(tag, shards);
+    // wait until every function tier node routes the tag to its new shards.
+    decltype(results)::ReplyMap& replies = results.get();
+    for(auto& reply_pair : replies) {
+        reply_pair.second.get();
+    }
+}
+
+int FunctionTier::ordered_set_placement(const uint32_t& tag, const std::vector<uint32_t>& shards) {
+    std::unique_lock write_lock(tag_to_shard_mutex);
+    if(shards.empty()) {
+        tag_to_shard.erase(tag);
+    } else {
+        tag_to_shard[tag] = shards;
+    }
+    return 0;
+}
+
+FunctionTier::ReplicaLoad& FunctionTier::get_replica_load(const node_id_t node) {
+    {
+        std::shared_lock read_lock(replica_loads_mutex);
+        auto load_search = replica_loads.find(node);
+        if(load_search != replica_loads.end()) {
+            return *load_search->second;
+        }
+    }
+    std::unique_lock write_lock(replica_loads_mutex);
+    std::unique_ptr<ReplicaLoad>& load = replica_loads[node];
+    if(!load) {
+        load = std::make_unique<ReplicaLoad>();
+    }
+    return *load;
+}
+
+node_id_t FunctionTier::pick_replica(const std::vector<node_id_t>& members) {
+    if(members.empty()) {
+        throw std::runtime_error("The categorizer shard has no members.");
+    }
+    if(members.size() == 1) {
+        return members[0];
+    }
+    thread_local std::minstd_rand random(std::random_device{}());
+    const std::size_t first = random() % members.size();
+    const std::size_t second = (first + 1 + random() % (members.size() - 1)) % members.size();
+    // expected wait: the requests ahead of ours times the time each one takes.
+    auto expected_wait = [this](const node_id_t node) {
+        ReplicaLoad& load = get_replica_load(node);
+        return (1 + load.outstanding) * load.service_time_us;
+    };
+    return expected_wait(members[second]) < expected_wait(members[first]) ? members[second] : members[first];
+}
+
+void FunctionTier::ask_model(const ShardView& view, const Photo& photo,
+                             std::shared_future<Guess>& result, std::shared_ptr<Inquiry>& inquiry) {
+    std::unique_ptr<ResultCache::Flight> flight = result_cache.start(photo, 0, result);
+    if(!flight) {
+        return;
+    }
+    // take turns between the shards hosting the model.
+    const std::vector<uint32_t> hosts = get_shards(photo.tag, view.shards.size());
+    inquiry = std::make_shared<Inquiry>(view.shards[hosts[next_shard++ % hosts.size()]], photo, std::move(flight));
+    inference_requests++;
+
+    // queue it for the member with the lower expected wait, and hedge it once
+    // it is slower than most requests for the tag.
+    std::lock_guard<std::mutex> lck(inquiry->mutex);
+    try {
+        inquiry->target = pick_replica(inquiry->members);
+    } catch(...) {
+        result_cache.fail(std::move(inquiry->flight), std::current_exception());
+        return;
+    }
+    inquiry->start_us = now_us();
+    switch(queue_request(inquiry, inquiry->target, false)) {
+        case QueueResult::QUEUED:
+            break;
+        case QueueResult::FULL: {
+            // shed it rather than letting every request wait longer; the
+            // rejection is not cached.
+            Guess guess;
+            guess.guess = "The categorizer node is overloaded.";
+            guess.retry_after_ms = get_retry_after_ms(inquiry->target);
+            result_cache.finish(std::move(inquiry->flight), guess);
+            return;
+        }
+        case QueueResult::STOPPED:
+            result_cache.fail(std::move(inquiry->flight), std::make_exception_ptr(RequestCancel()));
+            return;
+    }
+    const uint64_t hedge_delay_us = (hedge_requests && inquiry->members.size() > 1) ? get_hedge_delay_us(photo.tag) : 0;
+    if(hedge_delay_us > 0) {
+        inquiry->hedge_at_us = inquiry->start_us + hedge_delay_us;
+    }
+}
+
+FunctionTier::LatencyTracker& FunctionTier::get_latency_tracker(const uint32_t tag) {
+    {
+        std::shared_lock read_lock(latency_trackers_mutex);
+        auto tracker_search = latency_trackers.find(tag);
+        if(tracker_search != latency_trackers.end()) {
+            return *tracker_search->second;
+        }
+    }
+    std::unique_lock write_lock(latency_trackers_mutex);
+    std::unique_ptr<LatencyTracker>& tracker = latency_trackers[tag];
+    if(!tracker) {
+        tracker = std::make_unique<LatencyTracker>();
+    }
+    return *tracker;
+}
+
+uint64_t FunctionTier::get_hedge_delay_us(const uint32_t tag) {
+    LatencyTracker& tracker = get_latency_tracker(tag);
+    std::lock_guard<std::mutex> lck(tracker.mutex);
+    if(tracker.samples < HEDGE_MIN_SAMPLES) {
+        return 0;
+    }
+    uint32_t below = 0;
+    for(uint32_t bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        below += tracker.buckets[bucket];
+        if(below * 100 >= tracker.samples * HEDGE_PERCENTILE) {
+            // the upper bound of the bucket
+            return static_cast<uint64_t>(std::exp2((bucket + 1) / 4.0));
+        }
+    }
+    return 0;
+}
+
+void FunctionTier::record_latency(const uint32_t tag, const uint64_t latency_us) {
+    const uint32_t bucket = (latency_us == 0) ? 0 : std::min<uint32_t>(LATENCY_BUCKETS - 1, 4 * std::log2(static_cast<double>(latency_us)));
+    LatencyTracker& tracker = get_latency_tracker(tag);
+    std::lock_guard<std::mutex> lck(tracker.mutex);
+    tracker.buckets[bucket]++;
+    if(++tracker.samples < HEDGE_WINDOW) {
+        return;
+    }
+    tracker.samples = 0;
+    for(uint32_t& count : tracker.buckets) {
+        count /= 2;
+        tracker.samples += count;
+    }
+}
+
+FunctionTier::ReplicaChannel& FunctionTier::get_replica_channel(const node_id_t node) {
+    std::lock_guard<std::mutex> lck(replica_channels_mutex);
+    std::unique_ptr<ReplicaChannel>& channel = replica_channels[node];
+    if(!channel) {
+        channel = std::make_unique<ReplicaChannel>();
+        channel->stopped = channels_stopped;
+        channel->sender = std::thread(&FunctionTier::send_requests, this, node, channel.get());
+        channel->receiver = std::thread(&FunctionTier::receive_replies, this, node, channel.get());
+    }
+    return *channel;
+}
+
+FunctionTier::QueueResult FunctionTier::queue_request(const std::shared_ptr<Inquiry>& inquiry,
+                                                      const node_id_t node, const bool hedge) {
+    // 1 - take a place in the queue of the node, if there is one left.
+    ReplicaLoad& load = get_replica_load(node);
+    uint32_t outstanding = load.outstanding;
+    do {
+        if(max_queue_depth != 0 && outstanding >= max_queue_depth) {
+            return QueueResult::FULL;
+        }
+    } while(!load.outstanding.compare_exchange_weak(outstanding, outstanding + 1));
+
+    // 2 - hand it to the sender.
+    ReplicaChannel& channel = get_replica_channel(node);
+    {
+        std::lock_guard<std::mutex> lck(channel.mutex);
+        if(channel.stopped) {
+            load.outstanding--;
+            return QueueResult::STOPPED;
+        }
+        channel.queued.push_back(ReplicaChannel::Request{inquiry, hedge});
+    }
+    // the sender takes the inquiry mutex, which the caller holds, before it
+    // looks at the counters.
+    inquiry->pending++;
+    inquiry->unsent++;
+    channel.send_cv.notify_one();
+    return QueueResult::QUEUED;
+}
+
+uint32_t FunctionTier::get_retry_after_ms(const node_id_t node) {
+    ReplicaLoad& load = get_replica_load(node);
+    return static_cast<uint32_t>(load.outstanding * load.service_time_us / 1000 + 1);
+}
+
+void FunctionTier::drop_request(Inquiry& inquiry, const node_id_t node, std::exception_ptr error) {
+    get_replica_load(node).outstanding--;
+    {
+        std::lock_guard<std::mutex> lck(inquiry.mutex);
+        inquiry.pending--;
+        inquiry.unsent--;
+        if(inquiry.flight && inquiry.pending == 0) {
+            result_cache.fail(std::move(inquiry.flight), error);
+        }
+    }
+    wake_poller();
+}
+
+void FunctionTier::send_requests(const node_id_t node, ReplicaChannel* channel) {
+    derecho::ExternalCaller<CategorizerTier>& categorizer_tier_handler
+            = group->get_nonmember_subgroup<CategorizerTier>();
+    const std::size_t batch_max_size = std::max(get_conf_uint32(CONF_SOSPDEMO_BATCH_MAX_SIZE, 1), 1u);
+    const uint64_t batch_max_bytes = derecho::getConfUInt64(CONF_DERECHO_MAX_P2P_REQUEST_PAYLOAD_SIZE) - BATCH_HEADER_BYTES;
+    while(true) {
+        // 1 - take the next request, and the requests for its tag queued
+        // behind it that fit in the same p2p request. A batch is never waited
+        // for: it holds the requests queued while the previous one was sent.
+        // After shutdown(), drop the queued ones.
+        std::vector<ReplicaChannel::Request> requests;
+        bool stopped;
+        {
+            std::unique_lock<std::mutex> lck(channel->mutex);
+            channel->send_cv.wait(lck, [channel]() { return channel->stopped || !channel->queued.empty(); });
+            if(channel->queued.empty()) {
+                return;
+            }
+            stopped = channel->stopped;
+            const uint32_t tag = channel->queued.front().inquiry->tag;
+            uint64_t batch_bytes = 0;
+            for(auto it = channel->queued.begin(); it != channel->queued.end() && requests.size() < batch_max_size;) {
+                if(it->inquiry->tag != tag) {
+                    it++;
+                    continue;
+                }
+                // a photo larger than the limit goes alone, and fails in p2p_send.
+                const uint64_t photo_bytes = mutils::bytes_size(it->inquiry->photo);
+                if(!requests.empty() && batch_bytes + photo_bytes > batch_max_bytes) {
+                    break;
+                }
+                batch_bytes += photo_bytes;
+                requests.emplace_back(std::move(*it));
+                it = channel->queued.erase(it);
+            }
+        }
+        std::vector<ReplicaChannel::Request> live_requests;
+        for(auto& request : requests) {
+            bool ended;
+            {
+                std::lock_guard<std::mutex> lck(request.inquiry->mutex);
+                ended = !request.inquiry->flight;
+            }
+            if(stopped || ended) {
+                drop_request(*request.inquiry, node, std::make_exception_ptr(RequestCancel()));
+            } else {
+                live_requests.emplace_back(std::move(request));
+            }
+        }
+        if(live_requests.empty()) {
+            continue;
+        }
+
+        // 2 - send them. This is the only thread waiting for the p2p window of
+        // the node; the photos carry the time left to their deadlines as of now.
+        std::vector<Photo> photos;
+        photos.reserve(live_requests.size());
+        for(const auto& request : live_requests) {
+            photos.push_back(request.inquiry->photo);
+        }
+        debug_target_valid(categorizer_tier_handler, node);
+        const uint64_t send_us = now_us();
+        std::optional<derecho::rpc::QueryResults<std::vector<Guess>>> result;
+        try {
+            result.emplace(categorizer_tier_handler.p2p_send<RPC_NAME(inference_batch)>(node, photos));
+        } catch(...) {
+            for(auto& request : live_requests) {
+                drop_request(*request.inquiry, node, std::current_exception());
+            }
+            continue;
+        }
+
+        // 3 - hand them to the receiver. A call may drop its photo once no
+        // sender reads it anymore.
+        bool released = false;
+        for(auto& request : live_requests) {
+            std::lock_guard<std::mutex> lck(request.inquiry->mutex);
+            request.inquiry->unsent--;
+            released |= !request.inquiry->flight && request.inquiry->unsent == 0;
+        }
+        {
+            std::lock_guard<std::mutex> lck(channel->mutex);
+            channel->sent.push_back(ReplicaChannel::SentBatch{std::move(live_requests), send_us, std::move(*result)});
+        }
+        channel->reply_cv.notify_one();
+        if(released) {
+            wake_poller();
+        }
+    }
+}
+
+void FunctionTier::receive_replies(const node_id_t node, ReplicaChannel* channel) {
+    while(true) {
+        ReplicaChannel::SentBatch* batch;
+        {
+            std::unique_lock<std::mutex> lck(channel->mutex);
+            channel->reply_cv.wait(lck, [channel]() { return channel->stopped || !channel->sent.empty(); });
+            if(channel->stopped) {
+                return;
+            }
+            batch = &channel->sent.front();
+        }
+        // the node answers its requests in order, so the front is the next
+        // reply to arrive.
+        std::future<std::vector<Guess>>& reply = batch->result.get().begin()->second;
+        while(reply.wait_for(std::chrono::milliseconds(REPLY_WAIT_SLICE_MS)) != std::future_status::ready) {
+            std::lock_guard<std::mutex> lck(channel->mutex);
+            if(channel->stopped) {
+                return;
+            }
+        }
+        deliver_reply(*batch, node);
+        std::lock_guard<std::mutex> lck(channel->mutex);
+        channel->sent.pop_front();
+    }
+}
+
+void FunctionTier::deliver_reply(ReplicaChannel::SentBatch& batch, const node_id_t node) {
+    std::vector<Guess> guesses;
+    std::exception_ptr error;
+    try {
+        guesses = batch.result.get().begin()->second.get();
+        if(guesses.size() != batch.requests.size()) {
+            throw std::runtime_error("The categorizer node answered " + std::to_string(guesses.size())
+                                     + " guesses for " + std::to_string(batch.requests.size()) + " photos.");
+        }
+    } catch(...) {
+        error = std::current_exception();
+    }
+    // 1 - update the load of the node. The average of the time per photo
+    // moves an eighth of the way to each sample.
+    const uint64_t end_us = now_us();
+    ReplicaLoad& load = get_replica_load(node);
+    load.outstanding -= batch.requests.size();
+    if(!error) {
+        const uint64_t service_time_us = load.service_time_us;
+        const uint64_t sample_us = (end_us - batch.send_us) / guesses.size();
+        load.service_time_us = (service_time_us == 0) ? sample_us : service_time_us - service_time_us / 8 + sample_us / 8;
+    }
+
+    // 2 - the first reply ends an inquiry; the other one is ignored.
+    bool ended = false;
+    for(std::size_t i = 0; i < batch.requests.size(); i++) {
+        Inquiry& inquiry = *batch.requests[i].inquiry;
+        std::lock_guard<std::mutex> lck(inquiry.mutex);
+        inquiry.pending--;
+        if(!inquiry.flight || (error && inquiry.pending > 0)) {
+            continue;
+        }
+        ended = true;
+        if(error) {
+            result_cache.fail(std::move(inquiry.flight), error);
+        } else if(guesses[i].candidates.empty() && inquiry.photo.expired()) {
+            // the node has skipped it for the deadline of the call that asked
+            // it; the calls that joined it ask again, see PhotoCall::poll().
+            result_cache.fail(std::move(inquiry.flight), std::make_exception_ptr(RequestCancel()));
+        } else {
+            if(batch.requests[i].hedge) {
+                hedge_wins++;
+#ifndef NDEBUG
+                std::cout << "Hedged request for tag " << inquiry.tag << " answered by node " << node
+                          << ". requests = " << inference_requests << ", hedged = " << hedged_requests
+                          << ", wins = " << hedge_wins << "." << std::endl;
+                std::cout.flush();
+#endif
+            }
+            // the latency of the tag as the client sees it, hedged or not
+            record_latency(inquiry.tag, end_us - inquiry.start_us);
+            result_cache.finish(std::move(inquiry.flight), guesses[i]);
+        }
+    }
+    if(ended) {
+        wake_poller();
+    }
+}
+
+bool FunctionTier::poll_inquiry(const std::shared_ptr<Inquiry>& inquiry, const bool cancelled,
+                                std::chrono::steady_clock::time_point& wake_at) {
+    std::lock_guard<std::mutex> lck(inquiry->mutex);
+    if(inquiry->flight) {
+        // 1 - stop waiting once the client has given up. The categorizer node
+        // drops the work itself when the deadline passes.
+        if(inquiry->photo.expired() || cancelled) {
+            result_cache.fail(std::move(inquiry->flight), std::make_exception_ptr(RequestCancel()));
+            return inquiry->unsent == 0;
+        }
+        // 2 - hedge it to another member, within the hedge budget.
+        if(!inquiry->hedged && now_us() >= inquiry->hedge_at_us) {
+            inquiry->hedge_at_us = UINT64_MAX;
+            if((hedged_requests + 1) * 100 <= hedge_max_percent * inference_requests) {
+                std::vector<node_id_t> others;
+                std::copy_if(inquiry->members.begin(), inquiry->members.end(), std::back_inserter(others),
+                             [&inquiry](const node_id_t node) { return node != inquiry->target; });
+                inquiry->hedge_target = pick_replica(others);
+                // a member without room is not hedged to.
+                inquiry->hedged = queue_request(inquiry, inquiry->hedge_target, true) == QueueResult::QUEUED;
+                if(inquiry->hedged) {
+                    hedged_requests++;
+                }
+            }
+        }
+        wake_at = std::min(wake_at, inquiry->photo.deadline);
+        if(inquiry->hedge_at_us != UINT64_MAX) {
+            wake_at = std::min(wake_at, std::chrono::steady_clock::time_point(std::chrono::microseconds(inquiry->hedge_at_us)));
+        }
+        return false;
+    }
+    // 3 - the photo is needed until the senders have sent it.
+    return inquiry->unsent == 0;
+}
+
+HedgeStats FunctionTier::get_hedge_stats() {
+    HedgeStats stats;
+    stats.requests = inference_requests;
+    stats.hedged = hedged_requests;
+    stats.wins = hedge_wins;
+    return stats;
+}
+
+void FunctionTier::on_new_view() {
+    view_epoch++;
+}
 }  // namespace sospdemo
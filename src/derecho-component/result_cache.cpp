@@ -0,0 +1,106 @@
+#include <derecho-component/config.hpp>
+#include <derecho-component/result_cache.hpp>
+#include <iostream>
+#include <random>
+
+namespace sospdemo {
+
+ResultCache::ResultCache(const std::size_t capacity)
+        : capacity(capacity), hits(0), misses(0),
+          hash_seed((static_cast<uint64_t>(std::random_device{}()) << 32) | std::random_device{}()) {}
+
+ResultCache::ResultCache() : ResultCache(get_conf_uint32(CONF_SOSPDEMO_RESULT_CACHE_SIZE, 0)) {}
+
+ResultCache::Key ResultCache::make_key(const Photo& photo, const uint64_t model_version) const {
+    return Key{photo.tag, model_version, hash_bytes(photo.photo_data.bytes, photo.photo_data.size, hash_seed),
+               photo.photo_data.size, photo.num_candidates};
+}
+
+std::unique_ptr<ResultCache::Flight> ResultCache::start(const Photo& photo, const uint64_t model_version,
+                                                        std::shared_future<Guess>& result) {
+    std::unique_ptr<Flight> flight = std::make_unique<Flight>();
+    flight->generation = 0;
+    // a disabled cache does not hash the photo.
+    if(capacity == 0) {
+        result = flight->promise.get_future().share();
+        return flight;
+    }
+    const Key key = make_key(photo, model_version);
+    flight->key = key;
+    // 1 - look up the cached guesses and the inferences in flight.
+    std::unique_lock<std::mutex> lck(cache_mutex);
+    auto entry_search = entries.find(key);
+    if(entry_search != entries.end()) {
+        hits++;
+        lru.splice(lru.begin(), lru, entry_search->second);
+        flight->promise.set_value(entry_search->second->second);
+        result = flight->promise.get_future().share();
+        return nullptr;
+    }
+    auto flight_search = in_flight.find(key);
+    if(flight_search != in_flight.end()) {
+        hits++;
+        result = flight_search->second;
+        return nullptr;
+    }
+    // 2 - the caller runs the inference.
+    misses++;
+    result = flight->promise.get_future().share();
+    in_flight.emplace(key, result);
+    flight->generation = generations[key.tag];
+    return flight;
+}
+
+void ResultCache::finish(std::unique_ptr<Flight> flight, const Guess& guess) {
+    if(capacity != 0) {
+        // cache it, unless the model has changed meanwhile. In that case
+        // invalidate() has dropped our in-flight entry already.
+        const Key& key = flight->key;
+        std::lock_guard<std::mutex> lck(cache_mutex);
+        if(generations[key.tag] == flight->generation) {
+            in_flight.erase(key);
+        }
+        if(!guess.candidates.empty() && generations[key.tag] == flight->generation
+           && entries.find(key) == entries.end()) {
+            lru.emplace_front(key, guess);
+            entries.emplace(key, lru.begin());
+            while(entries.size() > capacity) {
+                entries.erase(lru.back().first);
+                lru.pop_back();
+            }
+        }
+#ifndef NDEBUG
+        std::cout << "ResultCache: hits = " << hits << ", misses = " << misses
+                  << ", entries = " << entries.size() << "." << std::endl;
+        std::cout.flush();
+#endif
+    }
+    flight->promise.set_value(guess);
+}
+
+void ResultCache::fail(std::unique_ptr<Flight> flight, std::exception_ptr error) {
+    if(capacity != 0) {
+        std::lock_guard<std::mutex> lck(cache_mutex);
+        if(generations[flight->key.tag] == flight->generation) {
+            in_flight.erase(flight->key);
+        }
+    }
+    flight->promise.set_exception(error);
+}
+
+void ResultCache::invalidate(const uint32_t tag) {
+    std::lock_guard<std::mutex> lck(cache_mutex);
+    generations[tag]++;
+    auto it = entries.lower_bound(Key{tag, 0, 0, 0, 0});
+    while(it != entries.end() && it->first.tag == tag) {
+        lru.erase(it->second);
+        it = entries.erase(it);
+    }
+    // requests from now on do not join the inferences on the old model.
+    auto flight = in_flight.lower_bound(Key{tag, 0, 0, 0, 0});
+    while(flight != in_flight.end() && flight->first.tag == tag) {
+        flight = in_flight.erase(flight);
+    }
+}
+
+}  // namespace sospdemo
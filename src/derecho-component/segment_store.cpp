@@ -0,0 +1,57 @@
+#include <derecho-component/segment_store.hpp>
+
+namespace sospdemo {
+
+std::map<uint64_t, uint64_t> SegmentStore::get_index() const {
+    std::map<uint64_t, uint64_t> index(references);
+    for(const auto& blob : blobs) {
+        index[blob.first] = blob.second.size;
+    }
+    return index;
+}
+
+std::size_t SegmentStore::to_bytes(char* buffer) const {
+    std::size_t offset = mutils::to_bytes(by_reference, buffer);
+    if(by_reference) {
+        offset += mutils::to_bytes(get_index(), buffer + offset);
+    } else {
+        offset += mutils::to_bytes(blobs, buffer + offset);
+    }
+    return offset;
+}
+
+std::size_t SegmentStore::bytes_size() const {
+    return mutils::bytes_size(by_reference)
+           + (by_reference ? mutils::bytes_size(get_index()) : mutils::bytes_size(blobs));
+}
+
+void SegmentStore::post_object(const std::function<void(char const* const, std::size_t)>& f) const {
+    mutils::post_object(f, by_reference);
+    if(by_reference) {
+        mutils::post_object(f, get_index());
+    } else {
+        mutils::post_object(f, blobs);
+    }
+}
+
+// from_bytes_noalloc() implementation borrowed from mutils-serialization.
+mutils::context_ptr<SegmentStore> SegmentStore::from_bytes_noalloc(mutils::DeserializationManager* ctx,
+                                                                   const char* const buffer,
+                                                                   mutils::context_ptr<SegmentStore>) {
+    return mutils::context_ptr<SegmentStore>{from_bytes(ctx, buffer).release()};
+}
+
+std::unique_ptr<SegmentStore> SegmentStore::from_bytes(mutils::DeserializationManager* dsm,
+                                                       const char* const buffer) {
+    auto store = std::make_unique<SegmentStore>();
+    store->by_reference = *mutils::from_bytes<bool>(dsm, buffer);
+    const char* const rest = buffer + mutils::bytes_size(store->by_reference);
+    if(store->by_reference) {
+        store->references = std::move(*mutils::from_bytes<std::map<uint64_t, uint64_t>>(dsm, rest));
+    } else {
+        store->blobs = std::move(*mutils::from_bytes<std::map<uint64_t, Blob>>(dsm, rest));
+    }
+    return store;
+}
+
+}  // namespace sospdemo
@@ -1,8 +1,10 @@
 #include <derecho-component/categorizer_tier.hpp>
+#include <derecho-component/cpu_plan.hpp>
 #include <derecho-component/function_tier.hpp>
 #include <derecho-component/server_logic.hpp>
 #include <derecho/core/derecho.hpp>
 #include <iostream>
+#include <vector>
 
 /**
  * Start a server node
@@ -10,6 +12,8 @@
 void do_server(int argc, char** argv) {
     // load configuration
     derecho::Conf::initialize(argc, argv);
+    // keep the Derecho threads created from here on off the inference cores.
+    sospdemo::apply_cpu_plan();
 
     // 1 - create subgroup info using the default subgroup allocator function
     // Both the function tier and the categorizer tier subgroups have configuration
@@ -30,9 +34,12 @@ void do_server(int argc, char** argv) {
         return std::make_unique<sospdemo::CategorizerTier>();
     };
 
-    // 3 - create the group
+    // 3 - create the group. The function tier reads the categorizer tier
+    // members again after each view change.
+    std::vector<derecho::view_upcall_t> view_upcalls{
+            [](const derecho::View&) { sospdemo::FunctionTier::on_new_view(); }};
     derecho::Group<sospdemo::FunctionTier, sospdemo::CategorizerTier> group(
-            si, function_tier_factory, categorizer_tier_factory);
+            derecho::CallbackSet{}, si, nullptr, view_upcalls, function_tier_factory, categorizer_tier_factory);
     std::cout << "Finished constructing Derecho group." << std::endl;
 
     // 4 - block the main thread and wait for keyboard input to shut down
@@ -0,0 +1,355 @@
+#include <algorithm>
+#include <cstring>
+#include <grpc-component/async_call.hpp>
+#include <iostream>
+#include <string>
+#include <tuple>
+
+namespace sospdemo {
+
+using grpc::Status;
+
+PhotoCall::PhotoCall(FunctionTier* function_tier, grpc::ServerCompletionQueue* completion_queue)
+        : function_tier(function_tier),
+          completion_queue(completion_queue),
+          state(State::REQUEST),
+          deadline(std::chrono::steady_clock::time_point::max()),
+          cancelled(false),
+          references(2),
+          done_handler(this) {
+    context.AsyncNotifyWhenDone(&done_handler);
+}
+
+void PhotoCall::DoneHandler::proceed(const bool ok) {
+    call->cancelled = call->context.IsCancelled();
+    if(call->cancelled) {
+        call->function_tier->wake_poller();
+    }
+    call->release();
+}
+
+void PhotoCall::release() {
+    if(--references == 0) {
+        delete this;
+    }
+}
+
+WhatsthisCall::WhatsthisCall(FunctionTier* function_tier, grpc::ServerCompletionQueue* completion_queue)
+        : PhotoCall(function_tier, completion_queue),
+          reader(&context),
+          received(0) {
+    function_tier->RequestWhatsthis(&context, &reader, completion_queue, completion_queue, this);
+}
+
+void WhatsthisCall::proceed(const bool ok) {
+    switch(state) {
+        case State::REQUEST:
+            if(!ok) {
+                // the server is shutting down. The call was never started, so
+                // gRPC does not notify the done handler.
+                delete this;
+                return;
+            }
+            // 1 - wait for the next client, and read the metadata of this one.
+            new WhatsthisCall(function_tier, completion_queue);
+            state = State::READ_METADATA;
+            reader.Read(&request, this);
+            return;
+
+        case State::READ_METADATA:
+            if(!ok || !request.has_metadata()) {
+                std::cerr << "Failed to read metadata." << std::endl;
+                finish(Status::CANCELLED);
+                return;
+            }
+            for(auto tag : request.metadata().tags()) {
+                args.tags.push_back(tag);
+            }
+            args.num_candidates = std::clamp(request.metadata().num_candidates(), 1u, static_cast<uint32_t>(MAX_NUM_CANDIDATES));
+            args.min_confidence = request.metadata().min_confidence();
+            args.photo_size = request.metadata().photo_size();
+            // 2 - admit it before allocating the photo the client claims.
+            if(!admit(args.photo_size)) {
+                return;
+            }
+            args.photo_data = (char*)malloc(args.photo_size);
+            request.clear_metadata();
+            state = State::READ_DATA;
+            reader.Read(&request, this);
+            return;
+
+        case State::READ_DATA:
+            if(ok) {
+                if(!read_chunk()) {
+                    finish(Status::CANCELLED);
+                    return;
+                }
+                reader.Read(&request, this);
+                return;
+            }
+            // 3 - the client has sent the whole photo.
+            if(received != args.photo_size) {
+                std::cerr << "The size of received data (" << received << " bytes) "
+                          << "does not match claimed (" << args.photo_size << " bytes)."
+                          << std::endl;
+                finish(Status::CANCELLED);
+                return;
+            }
+            start_inference(args.photo_data, args.photo_size);
+            return;
+
+        case State::INFERENCE:
+        case State::FINISH:
+            // the reply is sent.
+            release();
+            return;
+    }
+}
+
+bool WhatsthisCall::read_chunk() {
+    if(request.photo_chunk_case() != PhotoRequest::kFileData) {
+        std::cerr << "Failed to read data 1." << std::endl;
+        return false;
+    }
+    if(received + request.file_data().size() > args.photo_size) {
+        std::cerr << "Received more data than claimed "
+                  << args.photo_size << "." << std::endl;
+        return false;
+    }
+    std::memcpy(args.photo_data + received, request.file_data().c_str(),
+                request.file_data().size());
+    received += request.file_data().size();
+    return true;
+}
+
+void WhatsthisCall::send_reply(const Status& status) {
+    if(status.ok()) {
+        reader.Finish(reply, status, this);
+    } else {
+        reader.FinishWithError(status, this);
+    }
+}
+
+WhatsthisUnaryCall::WhatsthisUnaryCall(FunctionTier* function_tier, grpc::ServerCompletionQueue* completion_queue)
+        : PhotoCall(function_tier, completion_queue),
+          responder(&context) {
+    function_tier->RequestWhatsthisUnary(&context, &request, &responder, completion_queue, completion_queue, this);
+}
+
+void WhatsthisUnaryCall::proceed(const bool ok) {
+    switch(state) {
+        case State::REQUEST:
+            if(!ok) {
+                delete this;
+                return;
+            }
+            // 1 - wait for the next client; this one has sent everything already.
+            new WhatsthisUnaryCall(function_tier, completion_queue);
+            for(auto tag : request.tags()) {
+                args.tags.push_back(tag);
+            }
+            args.num_candidates = std::clamp(request.num_candidates(), 1u, static_cast<uint32_t>(MAX_NUM_CANDIDATES));
+            args.min_confidence = request.min_confidence();
+            args.photo_size = request.photo().size();
+            // 2 - the photos point into the request.
+            if(!admit(args.photo_size)) {
+                return;
+            }
+            start_inference(request.photo().data(), request.photo().size());
+            return;
+
+        default:
+            // the reply is sent.
+            release();
+            return;
+    }
+}
+
+void WhatsthisUnaryCall::send_reply(const Status& status) {
+    if(status.ok()) {
+        responder.Finish(reply, status, this);
+    } else {
+        responder.FinishWithError(status, this);
+    }
+}
+
+bool PhotoCall::admit(const uint32_t photo_size) {
+    if(!function_tier->admission.admit(photo_size, args.ticket)) {
+        finish_exhausted(function_tier->admission.get_retry_after_ms());
+        return false;
+    }
+    return true;
+}
+
+void PhotoCall::start_inference(const char* photo_data, const std::size_t photo_size) {
+    if(args.tags.empty()) {
+        reply.set_desc("No model tag is given.");
+        finish(Status::OK);
+        return;
+    }
+    // 1 - the categorizer tier skips the work once the client stops waiting for it.
+    const std::chrono::system_clock::time_point client_deadline = context.deadline();
+    if(client_deadline != std::chrono::system_clock::time_point::max()) {
+        deadline = std::chrono::steady_clock::now()
+                   + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                           client_deadline - std::chrono::system_clock::now());
+    }
+    if(std::chrono::steady_clock::now() >= deadline) {
+        finish(given_up());
+        return;
+    }
+
+    // 2 - ask all the models at once, unless the same photo has been answered
+    // recently or is on its way already. The photos must not move while the
+    // inquiries point to them.
+    std::shared_ptr<const FunctionTier::ShardView> view = function_tier->get_shard_view();
+    const std::size_t num_tags = args.tags.size();
+    photos.reserve(num_tags);
+    results.resize(num_tags);
+    inquiries.resize(num_tags);
+    for(std::size_t i = 0; i < num_tags; i++) {
+        photos.emplace_back(args.tags[i], photo_data, photo_size, args.num_candidates);
+        photos.back().deadline = deadline;
+        function_tier->ask_model(*view, photos.back(), results[i], inquiries[i]);
+    }
+
+    // 3 - the reply poller takes over. The completion queue has nothing to do
+    // for the call until it replies.
+    state = State::INFERENCE;
+    references++;
+    function_tier->add_polled_call(this);
+    release();
+}
+
+bool PhotoCall::poll(const bool stopping, std::chrono::steady_clock::time_point& wake_at) {
+    // 1 - move the inquiries of this call forward. Other calls asking for the
+    // same photos wait for them too, so they go on after this call replies.
+    bool inquiring = false;
+    for(auto& inquiry : inquiries) {
+        if(inquiry && function_tier->poll_inquiry(inquiry, cancelled || stopping, wake_at)) {
+            inquiry.reset();
+        }
+        inquiring = inquiring || inquiry;
+    }
+    if(state != State::INFERENCE) {
+        return !inquiring;
+    }
+
+    // 2 - reply once all the models have answered, or the first confident guess.
+    const bool given_up_now = cancelled || stopping || std::chrono::steady_clock::now() >= deadline;
+    std::shared_ptr<const FunctionTier::ShardView> view;
+    std::vector<std::pair<uint32_t, Guess>> guesses;
+    bool confident = false;
+    bool expired = true;
+    for(std::size_t i = 0; i < results.size(); i++) {
+        if(results[i].wait_for(std::chrono::microseconds(0)) != std::future_status::ready) {
+            continue;
+        }
+        Guess guess;
+        try {
+            guess = results[i].get();
+            expired = false;
+        } catch(const RequestCancel&) {
+            // this call joined the inquiry of another call, which has given
+            // up before this one: ask again, under this call's deadline.
+            if(!given_up_now && !inquiries[i]) {
+                if(!view) {
+                    view = function_tier->get_shard_view();
+                }
+                function_tier->ask_model(*view, photos[i], results[i], inquiries[i]);
+                if(inquiries[i] && function_tier->poll_inquiry(inquiries[i], false, wake_at)) {
+                    inquiries[i].reset();
+                }
+                inquiring = inquiring || inquiries[i];
+                continue;
+            }
+            guess.guess = "The deadline has passed.";
+        } catch(...) {
+            guess.guess = "Failed to reach the categorizer tier.";
+            expired = false;
+        }
+        const float min_confidence = args.min_confidence;
+        confident = confident
+                    || (min_confidence > 0 && !guess.candidates.empty() && guess.p >= min_confidence);
+        guesses.emplace_back(photos[i].tag, std::move(guess));
+    }
+    if(given_up_now || (guesses.size() == results.size() && expired)) {
+        references++;
+        finish(given_up());
+    } else if(confident || guesses.size() == results.size()) {
+        references++;
+        merge_guesses(guesses);
+    } else {
+        wake_at = std::min(wake_at, deadline);
+        return false;
+    }
+    return !inquiring;
+}
+
+void PhotoCall::merge_guesses(std::vector<std::pair<uint32_t, Guess>>& guesses) {
+    // 1 - shed the request if no categorizer node could take it.
+    uint32_t retry_after_ms = 0;
+    for(const auto& guess : guesses) {
+        if(guess.second.retry_after_ms == 0) {
+            retry_after_ms = 0;
+            break;
+        }
+        retry_after_ms = std::max(retry_after_ms, guess.second.retry_after_ms);
+    }
+    if(retry_after_ms > 0) {
+        finish_exhausted(retry_after_ms);
+        return;
+    }
+
+    // 2 - merge the guesses, the most confident first, and return Status::OK;
+    std::stable_sort(guesses.begin(), guesses.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.second.p > rhs.second.p;
+    });
+    std::string reply_string = guesses.at(0).second.guess;
+    for(uint i = 1; i < guesses.size(); ++i) {
+        reply_string += " or " + guesses.at(i).second.guess;
+    }
+#ifndef NDEBUG
+    std::cout << "Received response from the categorizer tier with ret = "
+              << reply_string << "." << std::endl;
+    std::cout.flush();
+#endif
+
+    reply.set_desc(reply_string);
+    std::vector<std::tuple<float, uint32_t, uint32_t>> candidates;
+    for(const auto& guess : guesses) {
+        for(uint j = 0; j < guess.second.candidates.size(); ++j) {
+            candidates.emplace_back(guess.second.probabilities.at(j), guess.first, guess.second.candidates.at(j));
+        }
+    }
+    std::stable_sort(candidates.begin(), candidates.end(), [](const auto& lhs, const auto& rhs) {
+        return std::get<0>(lhs) > std::get<0>(rhs);
+    });
+    for(const auto& candidate : candidates) {
+        PhotoReply::Candidate* reply_candidate = reply.add_candidates();
+        reply_candidate->set_tag(std::get<1>(candidate));
+        reply_candidate->set_index(std::get<2>(candidate));
+        reply_candidate->set_probability(std::get<0>(candidate));
+    }
+    finish(Status::OK);
+}
+
+Status PhotoCall::given_up() const {
+    if(cancelled) {
+        return Status::CANCELLED;
+    }
+    return Status(grpc::StatusCode::DEADLINE_EXCEEDED, "The deadline has passed.");
+}
+
+void PhotoCall::finish_exhausted(const uint32_t retry_after_ms) {
+    context.AddTrailingMetadata("retry-after-ms", std::to_string(retry_after_ms));
+    finish(Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                  "Overloaded, retry after " + std::to_string(retry_after_ms) + " ms."));
+}
+
+void PhotoCall::finish(const Status& status) {
+    state = State::FINISH;
+    send_reply(status);
+}
+
+}  // namespace sospdemo
@@ -92,6 +92,39 @@ ssize_t file_uploader(const std::string& file, ssize_t length,
     return offset;
 }
 
+/**
+ * A helper function reading a small file into a string.
+ * @param file filename
+ * @param length length of the file
+ * @param data output: the file content
+ * @return number of bytes. Negative number for failure
+ */
+ssize_t file_reader(const std::string& file, ssize_t length, std::string* data) {
+    int fd;
+    if((fd = open(file.c_str(), O_RDONLY)) < 0) {
+        std::cerr << "Failed to open file(" << file << ") in readonly mode with "
+                  << "error:" << strerror(errno) << "." << std::endl;
+        return -1;
+    }
+    data->resize(length);
+    ssize_t offset = 0;
+    while(offset < length) {
+        ssize_t size = read(fd, &(*data)[offset], length - offset);
+        if(size <= 0) {
+            std::cerr << "failed to read file(" << file << ") at offset " << offset
+                      << "." << std::endl;
+            break;
+        }
+        offset += size;
+    }
+    if(close(fd)) {
+        std::cerr << "failed to close file(" << file << ") with "
+                  << "error:" << strerror(errno) << "." << std::endl;
+        return -4;
+    }
+    return offset;
+}
+
 /**
  * Send an install model request to a function tier node with gRPC.
  * @param stub_ - gRPC session
@@ -99,11 +132,14 @@ ssize_t file_uploader(const std::string& file, ssize_t length,
  * @param synset_file - synset text file name
  * @param symbol_file - symbol json file name
  * @param params_file - parameter file name
+ * @param fp16_params - store the parameters in half precision
+ * @param backend - the inference backend, an InferenceBackend value
  */
 void client_install_model(
         std::unique_ptr<sospdemo::FunctionTierService::Stub>& stub_, uint32_t tag,
         const std::string& synset_file, const std::string& symbol_file,
-        const std::string& params_file) {
+        const std::string& params_file, const bool fp16_params,
+        const uint32_t backend) {
     grpc::ClientContext context;
     sospdemo::ModelReply reply;
 
@@ -129,6 +165,8 @@ void client_install_model(
         return;
     }
     metadata.set_params_size(static_cast<uint32_t>(params_file_size));
+    metadata.set_fp16_params(fp16_params);
+    metadata.set_backend(backend);
     request.set_allocated_metadata(&metadata);
 
     std::unique_ptr<grpc::ClientWriter<sospdemo::InstallModelRequest>> writer = stub_->InstallModel(&context, &reply);
@@ -167,54 +205,85 @@ void client_install_model(
 }
 
 /**
- * Send an inference request to a function tier node with gRPC.
+ * Send an inference request to a function tier node with gRPC. A photo of at
+ * most unary_photo_max_kb goes in one WhatsthisUnary message, a larger one is
+ * streamed in chunks with Whatsthis.
  * @param stub_ - gRPC session
  * @param tag - model tag
  * @param photo_file - photo file name
+ * @param num_candidates - number of candidates wanted from each model
+ * @param min_confidence - reply with the first guess this probable, 0 to wait for all the models
  */
 void client_inference(std::unique_ptr<sospdemo::FunctionTierService::Stub>& stub_,
-                      const std::string& tags, const std::string& photo_file) {
-    sospdemo::PhotoRequest request;
-    sospdemo::PhotoRequest::PhotoMetadata metadata;
+                      const std::string& tags, const std::string& photo_file,
+                      const uint32_t num_candidates, const float min_confidence) {
     sospdemo::PhotoReply reply;
     grpc::ClientContext context;
+    grpc::Status status;
 
     ssize_t photo_file_size = validate_readable_file(photo_file.c_str());
     if(photo_file_size < 0) {
         std::cerr << "Invalid photo file: " << photo_file << std::endl;
         return;
     }
-
-    // 1 - send metadata
+    std::vector<uint32_t> tag_list;
     std::string tags_string(tags);
     do {
-        metadata.add_tags(static_cast<uint32_t>(std::atoi(tags_string.c_str())));
+        tag_list.push_back(static_cast<uint32_t>(std::atoi(tags_string.c_str())));
         size_t pos = tags_string.find(',');
         if(pos == std::string::npos)
             break;
         tags_string.erase(0, pos + 1);
     } while(!tags_string.empty());
 
-    metadata.set_photo_size(photo_file_size);
-    request.set_allocated_metadata(&metadata);
-    std::unique_ptr<grpc::ClientWriter<sospdemo::PhotoRequest>> writer = stub_->Whatsthis(&context, &reply);
-    if(!writer->Write(request)) {
+    const ssize_t unary_photo_max_size
+            = static_cast<ssize_t>(sospdemo::get_conf_uint32(CONF_SOSPDEMO_UNARY_PHOTO_MAX_KB, 64)) << 10;
+    if(unary_photo_max_size > 0 && photo_file_size <= unary_photo_max_size) {
+        // 1 - send the photo with its metadata in one message.
+        sospdemo::PhotoBlob blob;
+        for(const uint32_t tag : tag_list) {
+            blob.add_tags(tag);
+        }
+        blob.set_num_candidates(num_candidates);
+        blob.set_min_confidence(min_confidence);
+        if(file_reader(photo_file, photo_file_size, blob.mutable_photo()) != photo_file_size)
+            return;
+        status = stub_->WhatsthisUnary(&context, blob, &reply);
+    } else {
+        sospdemo::PhotoRequest request;
+        sospdemo::PhotoRequest::PhotoMetadata metadata;
+        // 1 - send metadata
+        for(const uint32_t tag : tag_list) {
+            metadata.add_tags(tag);
+        }
+        metadata.set_photo_size(photo_file_size);
+        metadata.set_num_candidates(num_candidates);
+        metadata.set_min_confidence(min_confidence);
+        request.set_allocated_metadata(&metadata);
+        std::unique_ptr<grpc::ClientWriter<sospdemo::PhotoRequest>> writer = stub_->Whatsthis(&context, &reply);
+        if(!writer->Write(request)) {
+            request.release_metadata();
+            std::cerr << "Failed to send inference metadata. The stream has been closed." << std::endl;
+            return;
+        }
         request.release_metadata();
-        std::cerr << "Failed to send inference metadata. The stream has been closed." << std::endl;
-        return;
-    }
-    request.release_metadata();
 
-    // 2 - send photo
-    if(file_uploader(photo_file, photo_file_size, writer) != photo_file_size)
-        return;
+        // 2 - send photo
+        if(file_uploader(photo_file, photo_file_size, writer) != photo_file_size)
+            return;
 
-    // 3 - Finish up.
-    writer->WritesDone();
-    grpc::Status status = writer->Finish();
+        // 3 - Finish up.
+        writer->WritesDone();
+        status = writer->Finish();
+    }
 
     if(status.ok()) {
         std::cerr << "Photo description: " << reply.desc() << std::endl;
+        for(const auto& candidate : reply.candidates()) {
+            std::cerr << "Candidate: tag = " << candidate.tag()
+                      << ", synset index = " << candidate.index()
+                      << ", probability = " << candidate.probability() << std::endl;
+        }
     } else {
         std::cerr << "grpc::Status::error_code: " << status.error_code()
                   << std::endl;
@@ -222,6 +291,12 @@ void client_inference(std::unique_ptr<sospdemo::FunctionTierService::Stub>& stub
                   << std::endl;
         std::cerr << "grpc::Status::error_message: " << status.error_message()
                   << std::endl;
+        // an overloaded service tells when to retry.
+        auto retry_after = context.GetServerTrailingMetadata().find("retry-after-ms");
+        if(retry_after != context.GetServerTrailingMetadata().end()) {
+            std::cerr << "Retry after " << std::string(retry_after->second.data(), retry_after->second.size())
+                      << " ms." << std::endl;
+        }
     }
 
     return;
@@ -258,6 +333,34 @@ void client_remove_model(
     return;
 }
 
+/**
+ * Print the counters of the hedged requests of the function tier.
+ * @param stub_ - gRPC session
+ */
+void client_hedge_stats(
+        std::unique_ptr<sospdemo::FunctionTierService::Stub>& stub_) {
+    grpc::ClientContext context;
+    sospdemo::HedgeStatsReply reply;
+
+    grpc::Status status = stub_->GetHedgeStats(&context, sospdemo::HedgeStatsRequest(), &reply);
+
+    if(status.ok()) {
+        std::cout << "Function tier nodes: " << reply.nodes() << std::endl;
+        std::cout << "Requests: " << reply.requests() << std::endl;
+        std::cout << "Hedged: " << reply.hedged() << std::endl;
+        std::cout << "Won by the hedge: " << reply.wins() << std::endl;
+    } else {
+        std::cerr << "grpc::Status::error_code: " << status.error_code()
+                  << std::endl;
+        std::cerr << "grpc::Status::error_details: " << status.error_details()
+                  << std::endl;
+        std::cerr << "grpc::Status::error_message: " << status.error_message()
+                  << std::endl;
+    }
+
+    return;
+}
+
 /**
  * The "main" method for client programs
  */
@@ -286,7 +389,15 @@ void do_client(int argc, char** argv) {
             print_help(argv[0]);
         } else {
             std::string photo_file(argv[5]);
-            client_inference(stub_, std::string(argv[4]), photo_file);
+            uint32_t num_candidates = 1;
+            float min_confidence = 0.0f;
+            if(argc >= 7) {
+                num_candidates = static_cast<uint32_t>(std::atoi(argv[6]));
+            }
+            if(argc >= 8) {
+                min_confidence = static_cast<float>(std::atof(argv[7]));
+            }
+            client_inference(stub_, std::string(argv[4]), photo_file, num_candidates, min_confidence);
         }
     } else if(std::string("installmodel").compare(argv[3]) == 0) {
         if(argc < 8) {
@@ -297,7 +408,18 @@ void do_client(int argc, char** argv) {
             std::string synset_file(argv[5]);
             std::string symbol_file(argv[6]);
             std::string params_file(argv[7]);
-            client_install_model(stub_, tag, synset_file, symbol_file, params_file);
+            bool fp16_params = false;
+            uint32_t backend = sospdemo::kBackendMXNet;
+            for(int i = 8; i < argc; i++) {
+                if(std::string("fp16").compare(argv[i]) == 0) {
+                    fp16_params = true;
+                } else if(std::string("synthetic").compare(argv[i]) == 0) {
+                    backend = sospdemo::kBackendSynthetic;
+                } else {
+                    std::cerr << "Ignoring unknown install option:" << argv[i] << std::endl;
+                }
+            }
+            client_install_model(stub_, tag, synset_file, symbol_file, params_file, fp16_params, backend);
         }
     } else if(std::string("removemodel").compare(argv[3]) == 0) {
         if(argc < 5) {
@@ -307,6 +429,8 @@ void do_client(int argc, char** argv) {
             uint32_t tag = static_cast<uint32_t>(std::atoi(argv[4]));
             client_remove_model(stub_, tag);
         }
+    } else if(std::string("hedgestats").compare(argv[3]) == 0) {
+        client_hedge_stats(stub_);
     } else {
         std::cerr << "Invalid client command:" << argv[3] << std::endl;
         print_help(argv[0]);
@@ -1,5 +1,9 @@
+#include <algorithm>
+#include <derecho-component/cpu_plan.hpp>
 #include <derecho-component/function_tier.hpp>
+#include <grpc-component/async_call.hpp>
 #include <grpc-component/function_tier-grpc.hpp>
+#include <list>
 
 namespace sospdemo {
 
@@ -24,12 +28,35 @@ void FunctionTier::start() {
     const uint32_t port = FUNCTION_TIER_GRPC_PORT_BASE + my_id;
     std::string grpc_service_address = derecho::getConfString(CONF_DERECHO_LOCAL_IP) + ":" + std::to_string(port);
 
-    // now, start the server
+    // now, start the server. Inference calls are served by one thread per
+    // completion queue, the model operations by the synchronous threads of gRPC.
     ServerBuilder builder;
     builder.AddListeningPort(grpc_service_address,
                              grpc::InsecureServerCredentials());
     builder.RegisterService(this);
+    const uint32_t num_queues = std::max(get_conf_uint32(CONF_SOSPDEMO_GRPC_THREADS, 2), 1u);
+    for(uint32_t i = 0; i < num_queues; i++) {
+        completion_queues.emplace_back(builder.AddCompletionQueue());
+    }
     this->server = std::unique_ptr(builder.BuildAndStart());
+    // the completion queue threads are pinned one per core, on the service
+    // cores unless grpc_cores says otherwise.
+    std::vector<int> cores;
+    if(parse_cpu_list(get_conf_string(CONF_SOSPDEMO_GRPC_CORES, ""), cores) != 0) {
+        std::cerr << "Cannot parse " << CONF_SOSPDEMO_GRPC_CORES << ", using the service cores." << std::endl;
+        cores.clear();
+    }
+    if(cores.empty() && get_cpu_plan().enabled) {
+        cores = get_cpu_plan().service_cores;
+    }
+    poller_thread = std::thread(&FunctionTier::poll_calls, this);
+    for(uint32_t i = 0; i < num_queues; i++) {
+        new WhatsthisCall(this, completion_queues[i].get());
+        new WhatsthisUnaryCall(this, completion_queues[i].get());
+        completion_threads.emplace_back(&FunctionTier::serve_completion_queue, this, completion_queues[i].get(),
+                                        cores.empty() ? -1 : cores[i % cores.size()]);
+    }
+    started = true;
     // print messages
     std::cout << "//////////////////////////////////////////" << std::endl;
     std::cout << "FunctionTier listening on " << grpc_service_address
@@ -94,6 +121,8 @@ ParsedInstallArguments parse_grpc_install_args(grpc::ServerContext* context,
     uint32_t synset_size = request.metadata().synset_size();
     uint32_t symbol_size = request.metadata().symbol_size();
     uint32_t params_size = request.metadata().params_size();
+    bool fp16_params = request.metadata().fp16_params();
+    uint32_t backend = request.metadata().backend();
     // 1.2 - read the model files.
     ssize_t data_size = synset_size + symbol_size + params_size;
     char* model_data = new char[data_size];
@@ -103,7 +132,7 @@ ParsedInstallArguments parse_grpc_install_args(grpc::ServerContext* context,
 
     read_data_arg(request, chunk_case, reader, model_data, data_size);
     return ParsedInstallArguments{tag, synset_size, symbol_size, params_size,
-                                  data_size, model_data};
+                                  data_size, model_data, fp16_params, backend};
 }
 
 ParsedInstallArguments::ParsedInstallArguments()
@@ -112,7 +141,9 @@ ParsedInstallArguments::ParsedInstallArguments()
           symbol_size(0),
           params_size(0),
           data_size(0),
-          model_data(nullptr) {}
+          model_data(nullptr),
+          fp16_params(false),
+          backend(0) {}
 
 ParsedInstallArguments::ParsedInstallArguments(ParsedInstallArguments&& o)
         : tag(o.tag),
@@ -120,7 +151,9 @@ ParsedInstallArguments::ParsedInstallArguments(ParsedInstallArguments&& o)
           symbol_size(o.symbol_size),
           params_size(o.params_size),
           data_size(o.data_size),
-          model_data(o.model_data) {
+          model_data(o.model_data),
+          fp16_params(o.fp16_params),
+          backend(o.backend) {
     o.model_data = nullptr;
 }
 
@@ -131,6 +164,8 @@ ParsedInstallArguments& ParsedInstallArguments::operator=(ParsedInstallArguments
     params_size = o.params_size;
     data_size = o.data_size;
     model_data = o.model_data;
+    fp16_params = o.fp16_params;
+    backend = o.backend;
 
     o.model_data = nullptr;
 
@@ -144,50 +179,40 @@ ParsedInstallArguments::~ParsedInstallArguments() {
     std::cout << "symbol_size = " << symbol_size << std::endl;
     std::cout << "params_size = " << params_size << std::endl;
     std::cout << "total = " << data_size << " bytes" << std::endl;
+    std::cout << "fp16_params = " << fp16_params << std::endl;
+    std::cout << "backend = " << backend << std::endl;
     std::cout.flush();
 #endif
     if(model_data) delete model_data;
 }
 
-ParsedWhatsThisArguments parse_grpc_whatsthis_args(grpc::ServerContext* context,
-                                                   grpc::ServerReader<PhotoRequest>* reader,
-                                                   PhotoReply* reply) {
-    // 1 - read the inference request
-    // 1.1 - read metadata
-    PhotoRequest request;
-    check_request(request, reader);
-    std::vector<uint32_t> tags;
-    for(auto tag : request.metadata().tags()) {
-        tags.push_back(tag);
-    }
-    uint32_t photo_size = request.metadata().photo_size();
-    char* photo_data = (char*)malloc(photo_size);
-    // 1.2 - read the photo file.
-    request.clear_metadata();
-    PhotoRequest::PhotoChunkCase (*chunk_case)(PhotoRequest&) =
-            [](PhotoRequest& r) { return r.photo_chunk_case(); };
-    read_data_arg(request, chunk_case, reader, photo_data, photo_size);
-    return ParsedWhatsThisArguments{tags, photo_size, photo_data};
-}
-
-ParsedWhatsThisArguments::ParsedWhatsThisArguments() : tags({}), photo_size(0), photo_data(0) {}
+ParsedWhatsThisArguments::ParsedWhatsThisArguments() : tags({}), num_candidates(1), min_confidence(0.0f), photo_size(0), photo_data(0) {}
 
 ParsedWhatsThisArguments::ParsedWhatsThisArguments(
         std::vector<uint32_t> tags,
+        const uint32_t num_candidates,
+        const float min_confidence,
         const uint32_t photo_size,
-        char* photo_data) : tags(tags), photo_size(photo_size), photo_data(photo_data) {}
+        char* photo_data,
+        AdmissionControl::Ticket&& ticket) : tags(tags), num_candidates(num_candidates), min_confidence(min_confidence), photo_size(photo_size), photo_data(photo_data), ticket(std::move(ticket)) {}
 
 ParsedWhatsThisArguments::ParsedWhatsThisArguments(ParsedWhatsThisArguments&& o)
         : tags(o.tags),
+          num_candidates(o.num_candidates),
+          min_confidence(o.min_confidence),
           photo_size(o.photo_size),
-          photo_data(o.photo_data) {
+          photo_data(o.photo_data),
+          ticket(std::move(o.ticket)) {
     o.photo_data = nullptr;
 }
 
 ParsedWhatsThisArguments& ParsedWhatsThisArguments::operator=(ParsedWhatsThisArguments&& o) {
     tags = std::move(o.tags);
+    num_candidates = o.num_candidates;
+    min_confidence = o.min_confidence;
     photo_size = o.photo_size;
     photo_data = o.photo_data;
+    ticket = std::move(o.ticket);
     o.photo_data = nullptr;
     return *this;
 }
@@ -212,10 +237,104 @@ void FunctionTier::shutdown() {
     if(!started) {
         return;
     }
-    // now shutdown the server.
-    server->Shutdown();
+    // now shutdown the server. The calls in progress are cancelled; the
+    // reply poller gives up on them, the senders drop the requests they have
+    // not sent and the completion queues are drained.
+    server->Shutdown(std::chrono::system_clock::now());
+    {
+        std::lock_guard<std::mutex> poller_lck(poller_mutex);
+        stop_poller = true;
+    }
+    poller_cv.notify_all();
+    {
+        std::lock_guard<std::mutex> channels_lck(replica_channels_mutex);
+        channels_stopped = true;
+        for(auto& channel : replica_channels) {
+            std::lock_guard<std::mutex> channel_lck(channel.second->mutex);
+            channel.second->stopped = true;
+            channel.second->send_cv.notify_all();
+            channel.second->reply_cv.notify_all();
+        }
+    }
+    poller_thread.join();
+    for(auto& channel : replica_channels) {
+        channel.second->sender.join();
+        channel.second->receiver.join();
+    }
+    for(auto& completion_queue : completion_queues) {
+        completion_queue->Shutdown();
+    }
+    for(auto& completion_thread : completion_threads) {
+        completion_thread.join();
+    }
     server->Wait();
+    started = false;
+}
+
+void FunctionTier::serve_completion_queue(grpc::ServerCompletionQueue* completion_queue, const int core) {
+    if(core >= 0) {
+        pin_current_thread({core});
+    }
+    void* tag;
+    bool ok;
+    while(completion_queue->Next(&tag, &ok)) {
+        static_cast<CompletionHandler*>(tag)->proceed(ok);
+    }
+}
+
+void FunctionTier::add_polled_call(PhotoCall* call) {
+    {
+        std::lock_guard<std::mutex> lck(poller_mutex);
+        new_calls.push_back(call);
+    }
+    poller_cv.notify_one();
 }
 
-FunctionTier::~FunctionTier() { shutdown(); }
+void FunctionTier::wake_poller() {
+    {
+        std::lock_guard<std::mutex> lck(poller_mutex);
+        poll_requested = true;
+    }
+    poller_cv.notify_one();
+}
+
+void FunctionTier::poll_calls() {
+    std::list<PhotoCall*> calls;
+    bool stopping = false;
+    std::chrono::steady_clock::time_point wake_at = std::chrono::steady_clock::time_point::max();
+    while(true) {
+        // 1 - sleep until a call may move forward, and take the new calls.
+        {
+            std::unique_lock<std::mutex> lck(poller_mutex);
+            auto woken = [this]() { return poll_requested || !new_calls.empty() || stop_poller; };
+            if(wake_at == std::chrono::steady_clock::time_point::max()) {
+                poller_cv.wait(lck, woken);
+            } else {
+                poller_cv.wait_until(lck, wake_at, woken);
+            }
+            poll_requested = false;
+            calls.insert(calls.end(), new_calls.begin(), new_calls.end());
+            new_calls.clear();
+            stopping = stop_poller;
+        }
+        if(stopping && calls.empty()) {
+            return;
+        }
+        // 2 - move each call forward, drop the finished ones, and find the
+        // next deadline or hedge due.
+        wake_at = std::chrono::steady_clock::time_point::max();
+        for(auto it = calls.begin(); it != calls.end();) {
+            if((*it)->poll(stopping, wake_at)) {
+                (*it)->release();
+                it = calls.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+FunctionTier::~FunctionTier() {
+    shutdown();
+}
 };  // namespace sospdemo
@@ -20,14 +20,26 @@ void print_help(const char* cmd) {
               << "    " << cmd << " server \n"
               << "2) to perform inference: \n"
               << "    " << cmd
-              << " client <function-tier-node> inference <tags> <photo>\n"
+              << " client <function-tier-node> inference <tags> <photo> [num_candidates] [min_confidence]\n"
               << "    tags could be a single tag or multiple tags like 1,2,3,...\n"
+              << "    num_candidates is the number of best guesses (synset indices) to return\n"
+              << "    from each model, 1 by default and at most 100.\n"
+              << "    min_confidence makes a multi-tag inference return as soon as one model\n"
+              << "    guesses with at least this probability, instead of waiting for all.\n"
+              << "    A photo of at most unary_photo_max_kb KB (64 by default) is sent in one\n"
+              << "    message, a larger one is streamed in chunks.\n"
               << "3) to install a model: \n"
               << "    " << cmd
               << " client <function-tier-node> installmodel <tag> <synset> <symbol> "
-                 "<params>\n"
+                 "<params> [fp16] [synthetic]\n"
+              << "    fp16 stores the parameters in half precision to save memory and\n"
+              << "    replication traffic.\n"
+              << "    synthetic installs a benchmark model that does a fixed amount of work\n"
+              << "    described by the symbol file, instead of running MXNet.\n"
               << "4) to remove a model: \n"
-              << "    " << cmd << " client <function-tier-node> removemodel <tag>"
+              << "    " << cmd << " client <function-tier-node> removemodel <tag>\n"
+              << "5) to print the hedged request counters of the function tier: \n"
+              << "    " << cmd << " client <function-tier-node> hedgestats"
               << std::endl;
 }
 
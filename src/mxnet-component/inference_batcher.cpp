@@ -0,0 +1,92 @@
+#include <algorithm>
+#include <derecho-component/config.hpp>
+#include <derecho-component/cpu_plan.hpp>
+#include <iterator>
+#include <mxnet-component/inference_batcher.hpp>
+
+namespace sospdemo {
+
+InferenceBatcher::InferenceBatcher(const uint32_t max_batch_size, const uint32_t num_workers)
+        : max_batch_size(max_batch_size > 0 ? max_batch_size : 1),
+          stopped(false) {
+    for(uint32_t i = 0; i < std::max(num_workers, 1u); i++) {
+        workers.emplace_back(&InferenceBatcher::work, this);
+    }
+}
+
+InferenceBatcher::InferenceBatcher()
+        : InferenceBatcher(get_conf_uint32(CONF_SOSPDEMO_BATCH_MAX_SIZE, 1),
+                           get_conf_uint32(CONF_SOSPDEMO_EXECUTOR_POOL_SIZE, get_cpu_plan().concurrent_engines)) {}
+
+InferenceBatcher::~InferenceBatcher() {
+    {
+        std::lock_guard<std::mutex> lck(chunks_mutex);
+        stopped = true;
+    }
+    chunks_cv.notify_all();
+    for(auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void InferenceBatcher::work() {
+    enter_inference_cores();
+    while(true) {
+        std::packaged_task<std::vector<Guess>()> chunk;
+        {
+            std::unique_lock<std::mutex> lck(chunks_mutex);
+            chunks_cv.wait(lck, [this]() { return stopped || !chunks.empty(); });
+            if(chunks.empty()) {
+                return;
+            }
+            chunk = std::move(chunks.front());
+            chunks.pop_front();
+        }
+        // an exception is passed to the caller through the future.
+        chunk();
+    }
+}
+
+std::vector<Guess> InferenceBatcher::inference(InferenceEngine& engine, const std::vector<const Photo*>& photos) {
+    if(photos.empty()) {
+        return {};
+    }
+    // 1 - split the photos evenly, in no fewer chunks than the engine runs at
+    // the same time, unless there are fewer photos than that.
+    const std::size_t num_chunks = std::max<std::size_t>(
+            (photos.size() + max_batch_size - 1) / max_batch_size,
+            std::min<std::size_t>(photos.size(), engine.get_pool_size()));
+    const std::size_t chunk_size = (photos.size() + num_chunks - 1) / num_chunks;
+    std::vector<std::future<std::vector<Guess>>> chunk_guesses;
+    {
+        std::lock_guard<std::mutex> lck(chunks_mutex);
+        for(std::size_t begin = 0; begin < photos.size(); begin += chunk_size) {
+            const std::size_t end = std::min(photos.size(), begin + chunk_size);
+            chunks.emplace_back([&engine, chunk = std::vector<const Photo*>(photos.begin() + begin, photos.begin() + end)]() {
+                return engine.inference(chunk);
+            });
+            chunk_guesses.emplace_back(chunks.back().get_future());
+        }
+    }
+    chunks_cv.notify_all();
+
+    // 2 - collect the guesses in order. The engine outlives the chunks, as
+    // the caller waits for all of them.
+    std::vector<Guess> guesses;
+    guesses.reserve(photos.size());
+    std::exception_ptr error;
+    for(auto& future : chunk_guesses) {
+        try {
+            std::vector<Guess> batch_guesses = future.get();
+            std::move(batch_guesses.begin(), batch_guesses.end(), std::back_inserter(guesses));
+        } catch(...) {
+            error = std::current_exception();
+        }
+    }
+    if(error) {
+        std::rethrow_exception(error);
+    }
+    return guesses;
+}
+
+}  // namespace sospdemo
@@ -1,39 +1,122 @@
+#include <algorithm>
+#include <cstring>
 #include <derecho-component/categorizer_tier.hpp>
+#include <derecho-component/config.hpp>
+#include <derecho-component/cpu_plan.hpp>
 #include <mxnet-component/inference_engine.hpp>
+#include <mxnet-component/synthetic_engine.hpp>
 #include <mxnet-component/utils.hpp>
+#include <vector>
+#ifdef WITH_MXNET
+#include <mxnet-component/postprocess.hpp>
+#include <mxnet-component/preprocess.hpp>
 #include <mxnet-cpp/MxNetCpp.h>
 #include <opencv2/opencv.hpp>
-#include <vector>
+#endif
 
 #ifndef NDEBUG
 #include <fstream>
 #endif
 
 namespace sospdemo {
+// Photo implementation
+uint64_t Photo::get_remaining_us() const {
+    if(deadline == std::chrono::steady_clock::time_point::max()) {
+        return 0;
+    }
+    const auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(
+            deadline - std::chrono::steady_clock::now());
+    // an expired photo still carries a deadline, so that the receiver drops it.
+    return static_cast<uint64_t>(std::max(remaining.count(), static_cast<decltype(remaining.count())>(1)));
+}
+
+std::size_t Photo::to_bytes(char* buffer) const {
+    std::size_t offset = 0;
+    std::memcpy(buffer + offset, &tag, sizeof(tag));
+    offset += sizeof(tag);
+    offset += photo_data.to_bytes(buffer + offset);
+    std::memcpy(buffer + offset, &num_candidates, sizeof(num_candidates));
+    offset += sizeof(num_candidates);
+    const uint64_t remaining_us = get_remaining_us();
+    std::memcpy(buffer + offset, &remaining_us, sizeof(remaining_us));
+    return offset + sizeof(remaining_us);
+}
+
+std::size_t Photo::bytes_size() const {
+    return sizeof(tag) + photo_data.bytes_size() + sizeof(num_candidates) + sizeof(uint64_t);
+}
+
+void Photo::post_object(const std::function<void(char const* const, std::size_t)>& f) const {
+    f((char*)&tag, sizeof(tag));
+    photo_data.post_object(f);
+    f((char*)&num_candidates, sizeof(num_candidates));
+    const uint64_t remaining_us = get_remaining_us();
+    f((char*)&remaining_us, sizeof(remaining_us));
+}
+
+/**
+ * Build a photo from a buffer written by Photo::to_bytes(), pointing into it.
+ * The deadline restarts from the time left when the photo was sent.
+ */
+static Photo* read_photo(const char* const buffer) {
+    uint32_t tag;
+    std::size_t photo_size;
+    uint32_t num_candidates;
+    uint64_t remaining_us;
+    std::memcpy(&tag, buffer, sizeof(tag));
+    std::memcpy(&photo_size, buffer + sizeof(tag), sizeof(photo_size));
+    const char* const photo_bytes = buffer + sizeof(tag) + sizeof(photo_size);
+    std::memcpy(&num_candidates, photo_bytes + photo_size, sizeof(num_candidates));
+    std::memcpy(&remaining_us, photo_bytes + photo_size + sizeof(num_candidates), sizeof(remaining_us));
+    Photo* photo = new Photo(tag, photo_bytes, photo_size, num_candidates);
+    if(remaining_us != 0) {
+        photo->deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(remaining_us);
+    }
+    return photo;
+}
+
+std::unique_ptr<Photo> Photo::from_bytes(mutils::DeserializationManager*, const char* const buffer) {
+    return std::unique_ptr<Photo>{read_photo(buffer)};
+}
+
+mutils::context_ptr<Photo> Photo::from_bytes_noalloc(mutils::DeserializationManager*,
+                                                     const char* const buffer,
+                                                     mutils::context_ptr<Photo>) {
+    return mutils::context_ptr<Photo>{read_photo(buffer)};
+}
+
+mutils::context_ptr<const Photo> Photo::from_bytes_noalloc_const(mutils::DeserializationManager*,
+                                                                 const char* const buffer,
+                                                                 mutils::context_ptr<const Photo>) {
+    return mutils::context_ptr<const Photo>{read_photo(buffer)};
+}
+
 #ifndef NDEBUG
 void Model::dump_to_file() const {
     // synset file
     std::fstream synset_fs("synset.dump",
                            synset_fs.binary | synset_fs.trunc | synset_fs.out);
-    synset_fs.write(reinterpret_cast<char*>(model_data.bytes), synset_size);
+    synset_fs.write(segment_data.at(MODEL_SEGMENT_SYNSET)->bytes, segment_data.at(MODEL_SEGMENT_SYNSET)->size);
     synset_fs.close();
 
     // symbole file
     std::fstream symbol_fs("symbol.dump",
                            symbol_fs.binary | symbol_fs.trunc | symbol_fs.out);
-    symbol_fs.write(reinterpret_cast<char*>(model_data.bytes) + synset_size,
-                    symbol_size);
+    symbol_fs.write(segment_data.at(MODEL_SEGMENT_SYMBOL)->bytes, segment_data.at(MODEL_SEGMENT_SYMBOL)->size);
     symbol_fs.close();
 
-    // params file
+    // params file, in the params_format: one or more segments back to back
     std::fstream params_fs("params.dump",
                            params_fs.binary | params_fs.trunc | params_fs.out);
-    params_fs.write(reinterpret_cast<char*>(model_data.bytes) + synset_size + symbol_size,
-                    params_size);
+    for(std::size_t i = MODEL_SEGMENT_PARAMS; i < segment_data.size(); i++) {
+        params_fs.write(segment_data[i]->bytes, segment_data[i]->size);
+    }
     params_fs.close();
 }
 #endif
-int InferenceEngine::load_model(const Model& model) {
+
+#ifdef WITH_MXNET
+int MXNetInferenceEngine::load_model(const Model& model) {
     try {
         // 1 - load synset
         model.get_synset_vector(synset_vector);
@@ -42,33 +125,25 @@ int InferenceEngine::load_model(const Model& model) {
         {
             // load symbol
             this->net = mxnet::cpp::Symbol::LoadJSON(model.get_symbol_json());
-            // load parameters
+            // load parameters. They are loaded into CPU memory, which is where global_ctx
+            // runs, so the executors use the loaded arrays without another copy.
             std::map<std::string, mxnet::cpp::NDArray> parameters;
             model.get_parameters_map(&parameters);
-            for(const auto& k : parameters) {
-                if(k.first.substr(0, 4) == "aux:") {
-                    auto name = k.first.substr(4, k.first.size() - 4);
-                    this->aux_map[name] = k.second.Copy(global_ctx);
-                } else if(k.first.substr(0, 4) == "arg:") {
-                    auto name = k.first.substr(4, k.first.size() - 4);
-                    this->args_map[name] = k.second.Copy(global_ctx);
+            for(auto k = parameters.begin(); k != parameters.end(); k = parameters.erase(k)) {
+                if(k->first.substr(0, 4) == "aux:") {
+                    auto name = k->first.substr(4, k->first.size() - 4);
+                    this->parameters_size += k->second.Size() * type_flag_size(k->second.GetDType());
+                    this->aux_map[name] = std::move(k->second);
+                } else if(k->first.substr(0, 4) == "arg:") {
+                    auto name = k->first.substr(4, k->first.size() - 4);
+                    this->parameters_size += k->second.Size() * type_flag_size(k->second.GetDType());
+                    this->args_map[name] = std::move(k->second);
                 }
             }
             mxnet::cpp::NDArray::WaitAll();
-            this->args_map["data"] = mxnet::cpp::NDArray(input_shape, global_ctx, false, kFloat32);
-            mxnet::cpp::Shape label_shape(input_shape[0]);
-            this->args_map["softmax_label"] = mxnet::cpp::NDArray(label_shape, global_ctx, false);
-
-            this->client_data = mxnet::cpp::NDArray(input_shape, global_ctx, false, kFloat32);
         }
-        this->net.InferExecutorArrays(
-                global_ctx, &arg_arrays, &grad_arrays, &grad_reqs, &aux_arrays,
-                args_map, std::map<std::string, mxnet::cpp::NDArray>(),
-                std::map<std::string, mxnet::cpp::OpReqType>(), aux_map);
-        for(auto& i : grad_reqs)
-            i = mxnet::cpp::OpReqType::kNullOp;
-        this->executor_pointer.reset(new mxnet::cpp::Executor(
-                net, global_ctx, arg_arrays, grad_arrays, grad_reqs, aux_arrays));
+        // 3 - bind the executor for single photos.
+        idle_executors[1].push_back(bind_executor(1));
     } catch(const std::exception& e) {
         std::cerr << "Load model failed with exception " << e.what() << std::endl;
         return -1;
@@ -79,58 +154,241 @@ int InferenceEngine::load_model(const Model& model) {
 
     return 0;
 }
+#endif  // WITH_MXNET
 
-InferenceEngine::InferenceEngine(Model& model)
+InferenceEngine::InferenceEngine()
+        : pool_size(std::max(get_conf_uint32(CONF_SOSPDEMO_EXECUTOR_POOL_SIZE, get_cpu_plan().concurrent_engines), 1u)) {}
+
+InferenceEngine::~InferenceEngine() {}
+
+std::unique_ptr<InferenceEngine> InferenceEngine::create(Model& model) {
+    switch(model.backend) {
+        case kBackendMXNet:
+#ifdef WITH_MXNET
+            return std::make_unique<MXNetInferenceEngine>(model);
+#else
+            std::cerr << "This build has no MXNet backend; configure it WITH_MXNET to serve MXNet models." << std::endl;
+            throw ModelLoadException{};
+#endif
+        case kBackendSynthetic:
+            return std::make_unique<SyntheticInferenceEngine>(model);
+        default:
+            std::cerr << "Unknown inference backend " << model.backend << "." << std::endl;
+            throw ModelLoadException{};
+    }
+}
+
+Guess InferenceEngine::inference(const Photo& photo) {
+    return inference(std::vector<const Photo*>{&photo}).at(0);
+}
+
+#ifdef WITH_MXNET
+MXNetInferenceEngine::MXNetInferenceEngine(Model& model)
         : global_ctx(mxnet::cpp::Context::cpu()),
-          input_shape(std::vector<mxnet::cpp::index_t>({1, 3, 224, 224})) {
+          input_shape(std::vector<mxnet::cpp::index_t>({1, 3, 224, 224})),
+          parameters_size(0),
+          executors_in_use(0) {
     if(load_model(model) != 0) {
         std::cerr << "Failed to load model." << std::endl;
         throw ModelLoadException{};
     }
 }
 
-InferenceEngine::~InferenceEngine() {
+MXNetInferenceEngine::~MXNetInferenceEngine() {
     // clean up the mxnet engine.
 }
 
-Guess InferenceEngine::inference(const Photo& photo) {
-    Guess guess;
-    std::vector<unsigned char> decode_buf(photo.photo_data.size);
-    std::memcpy(static_cast<void*>(decode_buf.data()),
-                static_cast<const void*>(photo.photo_data.bytes),
-                photo.photo_data.size);
-    cv::Mat mat = cv::imdecode(decode_buf, CV_LOAD_IMAGE_COLOR);
-    std::vector<mx_float> array;
-    // transform to fit 3x224x224 input layer
-    cv::resize(mat, mat, cv::Size(256, 256));
-    for(int c = 0; c < 3; c++) {            // channels GBR->RGB
-        for(int i = 0; i < 224; i++) {      // height
-            for(int j = 0; j < 224; j++) {  // width
-                int _i = i + 16;
-                int _j = j + 16;
-                array.push_back(
-                        static_cast<float>(mat.data[(_i * 256 + _j) * 3 + (2 - c)]) / 256);
+std::unique_ptr<MXNetInferenceEngine::BoundExecutor> MXNetInferenceEngine::bind_executor(const uint32_t batch_size) {
+    // the weights are shared; the input, label and auxiliary arrays belong to this executor.
+    std::map<std::string, mxnet::cpp::NDArray> batch_args_map(args_map);
+    std::map<std::string, mxnet::cpp::NDArray> batch_aux_map;
+    for(const auto& aux : aux_map) {
+        batch_aux_map[aux.first] = aux.second.Copy(global_ctx);
+    }
+    mxnet::cpp::Shape data_shape(std::vector<mxnet::cpp::index_t>(
+            {batch_size, input_shape[1], input_shape[2], input_shape[3]}));
+    std::unique_ptr<BoundExecutor> bound = std::make_unique<BoundExecutor>();
+    bound->data = mxnet::cpp::NDArray(data_shape, global_ctx, false, kFloat32);
+    batch_args_map["data"] = bound->data;
+    mxnet::cpp::Shape label_shape(batch_size);
+    batch_args_map["softmax_label"] = mxnet::cpp::NDArray(label_shape, global_ctx, false);
+    mxnet::cpp::NDArray::WaitAll();
+
+    std::vector<mxnet::cpp::NDArray> arg_arrays;
+    std::vector<mxnet::cpp::NDArray> grad_arrays;
+    std::vector<mxnet::cpp::OpReqType> grad_reqs;
+    std::vector<mxnet::cpp::NDArray> aux_arrays;
+    this->net.InferExecutorArrays(
+            global_ctx, &arg_arrays, &grad_arrays, &grad_reqs, &aux_arrays,
+            batch_args_map, std::map<std::string, mxnet::cpp::NDArray>(),
+            std::map<std::string, mxnet::cpp::OpReqType>(), batch_aux_map);
+    for(auto& i : grad_reqs)
+        i = mxnet::cpp::OpReqType::kNullOp;
+    bound->executor.reset(new mxnet::cpp::Executor(
+            net, global_ctx, arg_arrays, grad_arrays, grad_reqs, aux_arrays));
+
+    // count the arrays of this executor; the weights are counted once, in parameters_size.
+    bound->size = 0;
+    for(const auto& arg : batch_args_map) {
+        if(args_map.find(arg.first) == args_map.end()) {
+            bound->size += arg.second.Size() * type_flag_size(arg.second.GetDType());
+        }
+    }
+    for(const auto& aux : batch_aux_map) {
+        bound->size += aux.second.Size() * type_flag_size(aux.second.GetDType());
+    }
+    for(const auto& output : bound->executor->outputs) {
+        bound->size += output.Size() * type_flag_size(output.GetDType());
+    }
+    {
+        std::lock_guard<std::mutex> lck(executors_mutex);
+        executor_sizes[batch_size] = bound->size;
+    }
+    return bound;
+}
+
+std::unique_ptr<MXNetInferenceEngine::BoundExecutor> MXNetInferenceEngine::check_out_executor(const uint32_t batch_size) {
+    {
+        std::unique_lock<std::mutex> lck(executors_mutex);
+        executors_cv.wait(lck, [this]() { return executors_in_use < pool_size; });
+        executors_in_use++;
+        auto& idle = idle_executors[batch_size];
+        if(!idle.empty()) {
+            std::unique_ptr<BoundExecutor> bound = std::move(idle.back());
+            idle.pop_back();
+            return bound;
+        }
+    }
+    // binding takes a while, do it without holding the lock.
+    try {
+        return bind_executor(batch_size);
+    } catch(...) {
+        check_in_executor(batch_size, nullptr);
+        throw;
+    }
+}
+
+void MXNetInferenceEngine::check_in_executor(const uint32_t batch_size, std::unique_ptr<BoundExecutor> bound) {
+    std::lock_guard<std::mutex> lck(executors_mutex);
+    executors_in_use--;
+    if(bound) {
+        // keep at most pool_size idle executors; drop one bound for another batch size if needed.
+        std::size_t num_idle = 0;
+        for(const auto& idle : idle_executors) {
+            num_idle += idle.second.size();
+        }
+        if(num_idle >= pool_size) {
+            for(auto& idle : idle_executors) {
+                if(idle.first != batch_size && !idle.second.empty()) {
+                    idle.second.pop_back();
+                    num_idle--;
+                    break;
+                }
             }
         }
+        if(num_idle < pool_size) {
+            idle_executors[batch_size].push_back(std::move(bound));
+        }
     }
-    // copy to input layer:
-    args_map["data"].SyncCopyFromCPU(array.data(), input_shape.Size());
+    executors_cv.notify_one();
+}
 
-    this->executor_pointer->Forward(false);
-    mxnet::cpp::NDArray::WaitAll();
-    // extract the result
-    auto output_shape = executor_pointer->outputs[0].GetShape();
-    mx_float max = -1e10;
-    int idx = -1;
-    for(unsigned int jj = 0; jj < output_shape[1]; jj++) {
-        if(max < executor_pointer->outputs[0].At(0, jj)) {
-            max = executor_pointer->outputs[0].At(0, jj);
-            idx = static_cast<int>(jj);
+std::size_t MXNetInferenceEngine::get_footprint() const {
+    std::lock_guard<std::mutex> lck(executors_mutex);
+    std::size_t footprint = parameters_size;
+    for(const auto& executor_size : executor_sizes) {
+        footprint += pool_size * executor_size.second;
+    }
+    return footprint;
+}
+
+void MXNetInferenceEngine::warm_up(const std::vector<uint32_t>& batch_sizes) {
+    for(const uint32_t batch_size : batch_sizes) {
+        std::unique_ptr<BoundExecutor> bound = check_out_executor(batch_size);
+        try {
+            bound->data.WaitToWrite();
+            mx_float* input = const_cast<mx_float*>(bound->data.GetData());
+            std::fill(input, input + batch_size * input_shape.Size(), 0.0f);
+            bound->executor->Forward(false);
+            bound->executor->outputs[0].WaitToRead();
+        } catch(...) {
+            check_in_executor(batch_size, nullptr);
+            throw;
+        }
+        check_in_executor(batch_size, std::move(bound));
+    }
+}
+
+std::vector<Guess> MXNetInferenceEngine::inference(const std::vector<const Photo*>& photos) {
+    const uint32_t batch_size = static_cast<uint32_t>(photos.size());
+    std::vector<Guess> guesses(batch_size);
+    std::vector<bool> decoded(batch_size, true);
+    // take an executor of our own and fill its input layer in place.
+    std::unique_ptr<BoundExecutor> bound = check_out_executor(batch_size);
+    try {
+        const std::size_t photo_input_size = input_shape.Size();
+        bound->data.WaitToWrite();
+        mx_float* input = const_cast<mx_float*>(bound->data.GetData());
+        for(uint32_t b = 0; b < batch_size; b++) {
+            const Photo& photo = *photos[b];
+            // keep the slot of a photo we do not guess in the batch, but do not
+            // report a guess for it.
+            if(photo.expired()) {
+                decoded[b] = false;
+                guesses[b].guess = "The deadline has passed.";
+                std::fill(input + b * photo_input_size, input + (b + 1) * photo_input_size, 0.0f);
+                continue;
+            }
+            const cv::Mat& mat = decode_photo(photo.photo_data.bytes, photo.photo_data.size);
+            if(mat.empty()) {
+                decoded[b] = false;
+                guesses[b].guess = "Cannot decode photo.";
+                guesses[b].p = 0.0f;
+                std::fill(input + b * photo_input_size, input + (b + 1) * photo_input_size, 0.0f);
+                continue;
+            }
+            // transform to fit 3x224x224 input layer
+            preprocess_photo(mat.data, mat.step, input + b * photo_input_size);
+        }
+
+        // the decoding may have taken the rest of the time: skip the forward
+        // pass if nobody is waiting for it any more.
+        bool forward = false;
+        for(uint32_t b = 0; b < batch_size; b++) {
+            if(decoded[b] && photos[b]->expired()) {
+                decoded[b] = false;
+                guesses[b].guess = "The deadline has passed.";
+            }
+            forward = forward || decoded[b];
+        }
+        if(!forward) {
+            check_in_executor(batch_size, std::move(bound));
+            return guesses;
         }
+
+        bound->executor->Forward(false);
+        // only wait for our own executor; the other ones may still be running.
+        bound->executor->outputs[0].WaitToRead();
+        // extract the result straight from the output array.
+        auto output_shape = bound->executor->outputs[0].GetShape();
+        const std::size_t num_classes = output_shape[1];
+        const mx_float* scores = bound->executor->outputs[0].GetData();
+        for(uint32_t b = 0; b < batch_size; b++) {
+            if(!decoded[b]) {
+                continue;
+            }
+            top_k(scores + b * num_classes, num_classes, std::max(photos[b]->num_candidates, 1u),
+                  guesses[b].candidates, guesses[b].probabilities);
+            guesses[b].guess = synset_vector[guesses[b].candidates[0]];
+            guesses[b].p = guesses[b].probabilities[0];
+        }
+    } catch(...) {
+        check_in_executor(batch_size, nullptr);
+        throw;
     }
-    guess.guess = synset_vector[idx];
-    guess.p = max;
+    check_in_executor(batch_size, std::move(bound));
 
-    return std::move(guess);
+    return guesses;
 }
+#endif  // WITH_MXNET
 }  // namespace sospdemo
\ No newline at end of file
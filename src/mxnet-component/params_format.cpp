@@ -0,0 +1,212 @@
+#include <cstring>
+#include <iostream>
+#include <mxnet-component/params_format.hpp>
+#include <mxnet-component/utils.hpp>
+#include <vector>
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+namespace sospdemo {
+
+static inline uint16_t float_to_half_scalar(const float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    const uint32_t sign = (x >> 16) & 0x8000;
+    const uint32_t exponent = (x >> 23) & 0xff;
+    uint32_t mantissa = x & 0x7fffff;
+    // inf and nan
+    if(exponent == 0xff) {
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    }
+    const int32_t half_exponent = static_cast<int32_t>(exponent) - 127 + 15;
+    // overflow
+    if(half_exponent >= 0x1f) {
+        return sign | 0x7c00;
+    }
+    // subnormal or zero
+    if(half_exponent <= 0) {
+        if(half_exponent < -10) {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        const uint32_t shift = 14 - half_exponent;
+        uint32_t half_mantissa = mantissa >> shift;
+        const uint32_t remainder = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if(remainder > halfway || (remainder == halfway && (half_mantissa & 1))) {
+            half_mantissa++;
+        }
+        return sign | half_mantissa;
+    }
+    // a carry out of the mantissa rounds up to the next exponent, or to inf.
+    uint32_t half = sign | (half_exponent << 10) | (mantissa >> 13);
+    const uint32_t remainder = mantissa & 0x1fff;
+    if(remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) {
+        half++;
+    }
+    return half;
+}
+
+static inline float half_to_float_scalar(const uint16_t h) {
+    const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t x;
+    if(exponent == 0) {
+        if(mantissa == 0) {
+            x = sign;
+        } else {
+            // normalize the subnormal
+            exponent = 127 - 15 + 1;
+            while(!(mantissa & 0x400)) {
+                mantissa <<= 1;
+                exponent--;
+            }
+            x = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+        }
+    } else if(exponent == 0x1f) {
+        x = sign | 0x7f800000 | (mantissa << 13);
+    } else {
+        x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+void float_to_half(const float* src, uint16_t* dst, const std::size_t count) {
+    std::size_t i = 0;
+#if defined(__F16C__)
+    for(; i + 8 <= count; i += 8) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                         _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+#endif
+    for(; i < count; i++) {
+        dst[i] = float_to_half_scalar(src[i]);
+    }
+}
+
+void half_to_float(const uint16_t* src, float* dst, const std::size_t count) {
+    std::size_t i = 0;
+#if defined(__F16C__)
+    for(; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i))));
+    }
+#endif
+    for(; i < count; i++) {
+        dst[i] = half_to_float_scalar(src[i]);
+    }
+}
+
+#ifdef WITH_MXNET
+static inline void append_uint32(std::string& buffer, const uint32_t value) {
+    buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+/**
+ * Read a uint32_t at offset and move offset past it.
+ * @return false if it runs over the end of the data
+ */
+static inline bool read_uint32(const char* data, const std::size_t size, std::size_t& offset, uint32_t& value) {
+    if(offset + sizeof(value) > size) {
+        return false;
+    }
+    std::memcpy(&value, data + offset, sizeof(value));
+    offset += sizeof(value);
+    return true;
+}
+
+int split_params(const char* params, const std::size_t params_size, const bool fp16,
+                 std::vector<std::string>& tensors) {
+    std::map<std::string, mxnet::cpp::NDArray> parameters;
+    try {
+        mxnet::cpp::NDArray::LoadFromBuffer(static_cast<const void*>(params), params_size, 0, &parameters);
+    } catch(const std::exception& e) {
+        std::cerr << "Failed to load parameters with exception " << e.what() << std::endl;
+        return -1;
+    }
+    for(const auto& parameter : parameters) {
+        if(parameter.second.GetDType() != kFloat32) {
+            std::cerr << "Cannot split parameter " << parameter.first << " of type "
+                      << parameter.second.GetDType() << "." << std::endl;
+            return -1;
+        }
+    }
+
+    const std::size_t value_size = fp16 ? sizeof(uint16_t) : sizeof(float);
+    tensors.clear();
+    tensors.reserve(parameters.size());
+    for(const auto& parameter : parameters) {
+        const std::vector<mx_uint> shape = parameter.second.GetShape();
+        std::string tensor;
+        tensor.reserve(sizeof(uint32_t) * (2 + shape.size()) + parameter.first.size()
+                       + parameter.second.Size() * value_size);
+        append_uint32(tensor, static_cast<uint32_t>(parameter.first.size()));
+        tensor.append(parameter.first);
+        append_uint32(tensor, static_cast<uint32_t>(shape.size()));
+        for(const mx_uint dim : shape) {
+            append_uint32(tensor, dim);
+        }
+        const std::size_t offset = tensor.size();
+        tensor.resize(offset + parameter.second.Size() * value_size);
+        if(fp16) {
+            float_to_half(parameter.second.GetData(), reinterpret_cast<uint16_t*>(&tensor[offset]),
+                          parameter.second.Size());
+        } else {
+            std::memcpy(&tensor[offset], parameter.second.GetData(), parameter.second.Size() * value_size);
+        }
+        tensors.emplace_back(std::move(tensor));
+    }
+    return 0;
+}
+
+int load_params_tensor(const char* tensor, const std::size_t size, const bool fp16,
+                       std::map<std::string, mxnet::cpp::NDArray>* parameters_map) {
+    std::size_t offset = 0;
+    uint32_t name_size, ndim;
+    if(!read_uint32(tensor, size, offset, name_size) || offset + name_size > size) {
+        std::cerr << "Truncated tensor segment." << std::endl;
+        return -1;
+    }
+    std::string name(tensor + offset, name_size);
+    offset += name_size;
+    if(!read_uint32(tensor, size, offset, ndim)) {
+        std::cerr << "Truncated tensor segment." << std::endl;
+        return -1;
+    }
+    std::vector<mxnet::cpp::index_t> dims(ndim);
+    std::size_t count = 1;
+    for(uint32_t d = 0; d < ndim; d++) {
+        uint32_t dim;
+        if(!read_uint32(tensor, size, offset, dim)) {
+            std::cerr << "Truncated tensor segment." << std::endl;
+            return -1;
+        }
+        dims[d] = dim;
+        count *= dim;
+    }
+    const std::size_t value_size = fp16 ? sizeof(uint16_t) : sizeof(float);
+    if(offset + count * value_size != size) {
+        std::cerr << "Tensor segment " << name << " does not match its shape." << std::endl;
+        return -1;
+    }
+
+    mxnet::cpp::NDArray array(mxnet::cpp::Shape(dims), mxnet::cpp::Context::cpu(), false);
+    mx_float* values = const_cast<mx_float*>(array.GetData());
+    if(fp16) {
+        // the values may start at any byte, so the halfs are copied out before widening.
+        std::vector<uint16_t> halfs(count);
+        std::memcpy(halfs.data(), tensor + offset, count * sizeof(uint16_t));
+        half_to_float(halfs.data(), values, count);
+    } else {
+        std::memcpy(values, tensor + offset, count * sizeof(float));
+    }
+    (*parameters_map)[name] = std::move(array);
+    return 0;
+}
+#endif  // WITH_MXNET
+
+}  // namespace sospdemo
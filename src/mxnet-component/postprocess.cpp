@@ -0,0 +1,71 @@
+#include <algorithm>
+#include <functional>
+#include <mxnet-component/postprocess.hpp>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace sospdemo {
+
+/**
+ * Insert a score into the sorted candidates, dropping the last one if they are full.
+ */
+static inline void insert_candidate(const uint32_t index, const float value, const std::size_t k,
+                                    std::vector<uint32_t>& indices, std::vector<float>& values) {
+    if(values.size() == k) {
+        if(!(value > values.back())) {
+            return;
+        }
+        values.pop_back();
+        indices.pop_back();
+    }
+    // after all equal scores, so that earlier outputs win ties.
+    std::size_t pos = std::upper_bound(values.begin(), values.end(), value, std::greater<float>()) - values.begin();
+    values.insert(values.begin() + pos, value);
+    indices.insert(indices.begin() + pos, index);
+}
+
+void top_k(const float* scores, const std::size_t size, const std::size_t k,
+           std::vector<uint32_t>& indices, std::vector<float>& values) {
+    indices.clear();
+    values.clear();
+    // there are no more candidates than scores, whatever the client asks for.
+    const std::size_t wanted = std::min(k, size);
+    if(wanted == 0) {
+        return;
+    }
+    indices.reserve(wanted + 1);
+    values.reserve(wanted + 1);
+
+    std::size_t i = 0;
+    for(; i < size && values.size() < wanted; i++) {
+        insert_candidate(static_cast<uint32_t>(i), scores[i], wanted, indices, values);
+    }
+#if defined(__AVX2__)
+    for(; i + 8 <= size; i += 8) {
+        int mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(scores + i), _mm256_set1_ps(values.back()), _CMP_GT_OQ));
+        while(mask) {
+            const int lane = __builtin_ctz(mask);
+            insert_candidate(static_cast<uint32_t>(i + lane), scores[i + lane], wanted, indices, values);
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__SSE2__)
+    for(; i + 4 <= size; i += 4) {
+        int mask = _mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(scores + i), _mm_set1_ps(values.back())));
+        while(mask) {
+            const int lane = __builtin_ctz(mask);
+            insert_candidate(static_cast<uint32_t>(i + lane), scores[i + lane], wanted, indices, values);
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for(; i < size; i++) {
+        insert_candidate(static_cast<uint32_t>(i), scores[i], wanted, indices, values);
+    }
+}
+
+}  // namespace sospdemo
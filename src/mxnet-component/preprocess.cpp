@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <mxnet-component/preprocess.hpp>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+
+namespace sospdemo {
+
+/**
+ * x / 256 and x * (1 / 256) are exact in float for every 8-bit x, so the
+ * multiplication gives the same bits as the division it replaces.
+ */
+static constexpr float PIXEL_SCALE = 1.0f / 256;
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+/**
+ * Split 16 interleaved BGR pixels (48 bytes) into three planes of 16 bytes.
+ */
+static inline void deinterleave_bgr16(const unsigned char* src, __m128i& b, __m128i& g, __m128i& r) {
+    const __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    const __m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+    const __m128i p2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+
+    b = _mm_or_si128(_mm_or_si128(
+                             _mm_shuffle_epi8(p0, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                             _mm_shuffle_epi8(p1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+                     _mm_shuffle_epi8(p2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+    g = _mm_or_si128(_mm_or_si128(
+                             _mm_shuffle_epi8(p0, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                             _mm_shuffle_epi8(p1, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+                     _mm_shuffle_epi8(p2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+    r = _mm_or_si128(_mm_or_si128(
+                             _mm_shuffle_epi8(p0, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                             _mm_shuffle_epi8(p1, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+                     _mm_shuffle_epi8(p2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+}
+
+/**
+ * Widen 16 bytes to floats, scale them and store them to dst.
+ */
+static inline void store_scaled16(const __m128i v, float* dst) {
+#if defined(__AVX2__)
+    const __m256 scale = _mm256_set1_ps(PIXEL_SCALE);
+    _mm256_storeu_ps(dst, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v)), scale));
+    _mm256_storeu_ps(dst + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(v, 8))), scale));
+#else
+    const __m128 scale = _mm_set1_ps(PIXEL_SCALE);
+    _mm_storeu_ps(dst, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(v)), scale));
+    _mm_storeu_ps(dst + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(v, 4))), scale));
+    _mm_storeu_ps(dst + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(v, 8))), scale));
+    _mm_storeu_ps(dst + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(v, 12))), scale));
+#endif
+}
+#endif
+
+bool get_jpeg_dimensions(const unsigned char* bytes, const std::size_t size, int& width, int& height) {
+    // SOI
+    if(size < 4 || bytes[0] != 0xFF || bytes[1] != 0xD8) {
+        return false;
+    }
+    std::size_t pos = 2;
+    while(pos + 4 <= size) {
+        if(bytes[pos] != 0xFF) {
+            return false;
+        }
+        const unsigned char marker = bytes[pos + 1];
+        // fill bytes and markers without a payload
+        if(marker == 0xFF) {
+            pos++;
+            continue;
+        }
+        if(marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+            pos += 2;
+            continue;
+        }
+        // SOF0 - SOF15, except DHT(C4), JPG(C8) and DAC(CC)
+        if(marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            if(pos + 9 > size) {
+                return false;
+            }
+            height = (bytes[pos + 5] << 8) | bytes[pos + 6];
+            width = (bytes[pos + 7] << 8) | bytes[pos + 8];
+            return width > 0 && height > 0;
+        }
+        // SOS or EOI before any frame header
+        if(marker == 0xDA || marker == 0xD9) {
+            return false;
+        }
+        pos += 2 + ((bytes[pos + 2] << 8) | bytes[pos + 3]);
+    }
+    return false;
+}
+
+const cv::Mat& decode_photo(const char* bytes, const std::size_t size) {
+    thread_local cv::Mat decoded;
+    thread_local cv::Mat resized;
+
+    int flags = cv::IMREAD_COLOR;
+    int width, height;
+    if(get_jpeg_dimensions(reinterpret_cast<const unsigned char*>(bytes), size, width, height)) {
+        const int shorter_side = std::min(width, height);
+        if(shorter_side >= 8 * PREPROCESS_RESIZED_SIZE) {
+            flags = cv::IMREAD_REDUCED_COLOR_8;
+        } else if(shorter_side >= 4 * PREPROCESS_RESIZED_SIZE) {
+            flags = cv::IMREAD_REDUCED_COLOR_4;
+        } else if(shorter_side >= 2 * PREPROCESS_RESIZED_SIZE) {
+            flags = cv::IMREAD_REDUCED_COLOR_2;
+        }
+    }
+    // wrap the photo bytes instead of copying them to a decode buffer.
+    const cv::Mat encoded(1, static_cast<int>(size), CV_8UC1, const_cast<char*>(bytes));
+    cv::imdecode(encoded, flags, &decoded);
+    if(decoded.empty()) {
+        resized.release();
+        return resized;
+    }
+    cv::resize(decoded, resized, cv::Size(PREPROCESS_RESIZED_SIZE, PREPROCESS_RESIZED_SIZE));
+    return resized;
+}
+
+void preprocess_photo(const unsigned char* bgr, const std::size_t row_stride, float* output) {
+    const int offset = (PREPROCESS_RESIZED_SIZE - PREPROCESS_INPUT_SIZE) / 2;
+    const std::size_t plane_size = PREPROCESS_INPUT_SIZE * PREPROCESS_INPUT_SIZE;
+
+    for(int i = 0; i < PREPROCESS_INPUT_SIZE; i++) {  // height
+        const unsigned char* src = bgr + (i + offset) * row_stride + offset * 3;
+        // output planes are in RGB order
+        float* dst_r = output + i * PREPROCESS_INPUT_SIZE;
+        float* dst_g = dst_r + plane_size;
+        float* dst_b = dst_g + plane_size;
+#if defined(__AVX2__) || defined(__SSE4_1__)
+        const int vector_end = PREPROCESS_INPUT_SIZE - PREPROCESS_INPUT_SIZE % 16;
+        for(int j = 0; j < vector_end; j += 16) {
+            __m128i b, g, r;
+            deinterleave_bgr16(src + j * 3, b, g, r);
+            store_scaled16(r, dst_r + j);
+            store_scaled16(g, dst_g + j);
+            store_scaled16(b, dst_b + j);
+        }
+#else
+        const int vector_end = 0;
+#endif
+        for(int j = vector_end; j < PREPROCESS_INPUT_SIZE; j++) {  // width
+            dst_r[j] = static_cast<float>(src[j * 3 + 2]) * PIXEL_SCALE;
+            dst_g[j] = static_cast<float>(src[j * 3 + 1]) * PIXEL_SCALE;
+            dst_b[j] = static_cast<float>(src[j * 3]) * PIXEL_SCALE;
+        }
+    }
+}
+
+}  // namespace sospdemo
@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <iostream>
+#include <mxnet-component/synthetic_engine.hpp>
+#include <sstream>
+#include <thread>
+#ifdef WITH_MXNET
+#include <mxnet-component/preprocess.hpp>
+#endif
+
+namespace sospdemo {
+
+SyntheticInferenceEngine::SyntheticInferenceEngine(Model& model)
+        : batch_work(1000),
+          photo_work(0),
+          spin(true),
+          decode(false),
+          running(0) {
+    model.get_synset_vector(synset_vector);
+    if(synset_vector.empty()) {
+        synset_vector.emplace_back("synthetic");
+    }
+    if(parse_spec(model.get_symbol_json()) != 0) {
+        throw ModelLoadException{};
+    }
+#ifndef NDEBUG
+    std::cout << "Synthetic engine: batch_us = " << batch_work.count() << ", photo_us = "
+              << photo_work.count() << ", mode = " << (spin ? "spin" : "sleep")
+              << ", decode = " << decode << "." << std::endl;
+    std::cout.flush();
+#endif
+}
+
+int SyntheticInferenceEngine::parse_spec(const std::string& spec) {
+    std::istringstream iss(spec);
+    std::string line;
+    while(std::getline(iss, line)) {
+        line.erase(std::remove_if(line.begin(), line.end(), ::isspace), line.end());
+        if(line.empty() || line[0] == '#') {
+            continue;
+        }
+        const std::size_t pos = line.find('=');
+        if(pos == std::string::npos) {
+            std::cerr << "Invalid synthetic workload line: " << line << std::endl;
+            return -1;
+        }
+        const std::string key = line.substr(0, pos);
+        const std::string value = line.substr(pos + 1);
+        try {
+            if(key == "batch_us") {
+                batch_work = std::chrono::microseconds(std::stoul(value));
+            } else if(key == "photo_us") {
+                photo_work = std::chrono::microseconds(std::stoul(value));
+            } else if(key == "mode" && (value == "spin" || value == "sleep")) {
+                spin = (value == "spin");
+            } else if(key == "decode") {
+                decode = (std::stoul(value) != 0);
+#ifndef WITH_MXNET
+                // the preprocessing is part of the MXNet backend.
+                if(decode) {
+                    std::cerr << "Synthetic workload setting " << line << " needs the MXNet build." << std::endl;
+                    return -1;
+                }
+#endif
+            } else {
+                std::cerr << "Unknown synthetic workload setting: " << line << std::endl;
+                return -1;
+            }
+        } catch(const std::exception&) {
+            std::cerr << "Invalid synthetic workload value: " << line << std::endl;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void SyntheticInferenceEngine::work(const std::chrono::microseconds duration) const {
+    if(duration.count() == 0) {
+        return;
+    }
+    if(!spin) {
+        std::this_thread::sleep_for(duration);
+        return;
+    }
+    const auto deadline = std::chrono::steady_clock::now() + duration;
+    // keep the core busy with arithmetic, like a forward pass would.
+    volatile uint64_t x = 0;
+    while(std::chrono::steady_clock::now() < deadline) {
+        for(int i = 0; i < 1000; i++) {
+            x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        }
+    }
+}
+
+std::vector<Guess> SyntheticInferenceEngine::inference(const std::vector<const Photo*>& photos) {
+    const uint32_t batch_size = static_cast<uint32_t>(photos.size());
+    std::vector<Guess> guesses(batch_size);
+    {
+        std::unique_lock<std::mutex> lck(running_mutex);
+        running_cv.wait(lck, [this]() { return running < pool_size; });
+        running++;
+    }
+
+    // 1 - the same preprocessing as the MXNet backend, if asked for.
+    std::vector<bool> decoded(batch_size, true);
+    try {
+#ifdef WITH_MXNET
+        if(decode) {
+            thread_local std::vector<float> input(3 * PREPROCESS_INPUT_SIZE * PREPROCESS_INPUT_SIZE);
+            for(uint32_t b = 0; b < batch_size; b++) {
+                const cv::Mat& mat = decode_photo(photos[b]->photo_data.bytes, photos[b]->photo_data.size);
+                if(mat.empty()) {
+                    decoded[b] = false;
+                    guesses[b].guess = "Cannot decode photo.";
+                    guesses[b].p = 0.0f;
+                    continue;
+                }
+                preprocess_photo(mat.data, mat.step, input.data());
+            }
+        }
+#endif
+        // 2 - the forward pass.
+        work(batch_work + photo_work * batch_size);
+    } catch(...) {
+        {
+            std::lock_guard<std::mutex> lck(running_mutex);
+            running--;
+        }
+        running_cv.notify_one();
+        throw;
+    }
+    // 3 - the fixed guesses.
+    for(uint32_t b = 0; b < batch_size; b++) {
+        if(!decoded[b]) {
+            continue;
+        }
+        const uint32_t k = std::min<uint32_t>(std::max(photos[b]->num_candidates, 1u), synset_vector.size());
+        float p = 0.5f;
+        for(uint32_t j = 0; j < k; j++, p /= 2) {
+            guesses[b].candidates.push_back(j);
+            guesses[b].probabilities.push_back(p);
+        }
+        guesses[b].guess = synset_vector[0];
+        guesses[b].p = guesses[b].probabilities[0];
+    }
+
+    {
+        std::lock_guard<std::mutex> lck(running_mutex);
+        running--;
+    }
+    running_cv.notify_one();
+    return guesses;
+}
+
+std::size_t SyntheticInferenceEngine::get_footprint() const {
+    std::size_t footprint = 0;
+    for(const auto& name : synset_vector) {
+        footprint += name.size();
+    }
+    return footprint;
+}
+
+}  // namespace sospdemo
@@ -0,0 +1,180 @@
+#include <cstdlib>
+#include <cstring>
+#include <derecho-component/blob.hpp>
+#include <derecho-component/segment_store.hpp>
+#include <iostream>
+#include <map>
+#include <mxnet-component/inference_engine.hpp>
+#include <new>
+#include <vector>
+
+/**
+ * Count the heap allocations of the install and inference paths with a
+ * replaced global operator new:
+ * - a model moves from its staged segments into the segment store and
+ *   raw_models, and is copied like the loader and a state transfer copy it,
+ *   without any model-sized allocation;
+ * - Photo::from_bytes_noalloc() makes no allocation once the per-thread pool
+ *   of photos is warm.
+ */
+
+// size of the parameters segment of the test model
+#define TEST_MODEL_SIZE (16ull << 20)
+// size of the test photo
+#define TEST_PHOTO_SIZE (100000)
+// deserializations that warm up the photo pool, then the ones counted
+#define TEST_WARM_UP_PHOTOS (16)
+#define TEST_PHOTOS (10000)
+
+static bool counting = false;
+static std::size_t allocations = 0;
+static std::size_t model_sized_allocations = 0;
+
+static void* counted_new(const std::size_t size) {
+    if(counting) {
+        allocations++;
+        if(size >= TEST_MODEL_SIZE / 2) {
+            model_sized_allocations++;
+        }
+    }
+    void* p = std::malloc(size > 0 ? size : 1);
+    if(p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new(const std::size_t size) {
+    return counted_new(size);
+}
+
+void* operator new[](const std::size_t size) {
+    return counted_new(size);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+using namespace sospdemo;
+
+/**
+ * @return the number of failures
+ */
+static std::size_t check_install_path() {
+    // 1 - the segments as ordered_stage_chunk() assembles them, before counting.
+    const std::string synset = "daisy\ndandelion\nroses\nsunflowers\ntulips\n";
+    const std::string symbol = "{}";
+    Blob staged(nullptr, TEST_MODEL_SIZE);
+    for(uint64_t offset = 0; offset < TEST_MODEL_SIZE; offset += sizeof(offset)) {
+        std::memcpy(staged.bytes + offset, &offset, sizeof(offset));
+    }
+    const uint64_t params_id = hash_bytes(staged.bytes, staged.size);
+    const uint64_t synset_id = hash_bytes(synset.data(), synset.size());
+    const uint64_t symbol_id = hash_bytes(symbol.data(), symbol.size());
+
+    // 2 - what ordered_install_model(), the loader, get_segment() and a
+    // state transfer do with them.
+    counting = true;
+    allocations = 0;
+    model_sized_allocations = 0;
+    SegmentStore segments;
+    segments.blobs.emplace(synset_id, Blob(synset.data(), synset.size()));
+    segments.blobs.emplace(symbol_id, Blob(symbol.data(), symbol.size()));
+    segments.blobs.emplace(params_id, std::move(staged));
+    Model model;
+    model.segments = {synset_id, symbol_id, params_id};
+    model.version = model.get_content_version();
+    model.bind_segments(segments.blobs);
+    std::map<uint32_t, Model> raw_models;
+    raw_models.emplace(1, model);
+    // the copy of the loader
+    Model loader_model = raw_models.at(1);
+    std::map<uint64_t, Blob> loader_segments;
+    for(const uint64_t segment_id : loader_model.segments) {
+        loader_segments.emplace(segment_id, segments.blobs.at(segment_id));
+    }
+    loader_model.bind_segments(loader_segments);
+    // a chunk of get_segment()
+    const Blob chunk = segments.blobs.at(params_id).slice(TEST_MODEL_SIZE / 2, 1 << 20);
+    // the copies of the CategorizerTier constructor, and a durable state transfer
+    const std::map<uint32_t, Model> raw_models_copy = raw_models;
+    const SegmentStore segments_copy = segments;
+    segments.by_reference = true;
+    std::vector<char> state(mutils::bytes_size(raw_models) + mutils::bytes_size(segments));
+    const std::size_t models_size = mutils::to_bytes(raw_models, state.data());
+    mutils::to_bytes(segments, state.data() + models_size);
+    std::unique_ptr<SegmentStore> received = mutils::from_bytes<SegmentStore>(nullptr, state.data() + models_size);
+    counting = false;
+
+    std::size_t failures = 0;
+    if(model_sized_allocations > 0) {
+        std::cerr << "Installing and copying a model made " << model_sized_allocations
+                  << " model-sized allocations." << std::endl;
+        failures++;
+    }
+    if(loader_model.segment_data.size() != 3 || loader_model.segment_data[MODEL_SEGMENT_PARAMS]->bytes != segments.blobs.at(params_id).bytes
+       || chunk.bytes != segments.blobs.at(params_id).bytes + TEST_MODEL_SIZE / 2
+       || segments_copy.blobs.at(params_id).bytes != segments.blobs.at(params_id).bytes
+       || received->references.at(params_id) != TEST_MODEL_SIZE) {
+        std::cerr << "The copies of the model do not share its segments." << std::endl;
+        failures++;
+    }
+    std::cout << "Installing and copying a model made " << allocations << " allocations, "
+              << model_sized_allocations << " of them model-sized." << std::endl;
+    return failures;
+}
+
+/**
+ * @return the number of failures
+ */
+static std::size_t check_photo_deserialization() {
+    std::vector<char> photo_data(TEST_PHOTO_SIZE, 'x');
+    const Photo photo(1, photo_data.data(), photo_data.size(), 5);
+    std::vector<char> buffer(mutils::bytes_size(photo));
+    mutils::to_bytes(photo, buffer.data());
+
+    std::size_t failures = 0;
+    for(int i = 0; i < TEST_WARM_UP_PHOTOS + TEST_PHOTOS; i++) {
+        if(i == TEST_WARM_UP_PHOTOS) {
+            counting = true;
+            allocations = 0;
+        }
+        mutils::context_ptr<Photo> received = Photo::from_bytes_noalloc(nullptr, buffer.data());
+        if(received->tag != 1 || received->num_candidates != 5 || received->photo_data.size != TEST_PHOTO_SIZE
+           || received->photo_data.bytes < buffer.data() || received->photo_data.bytes >= buffer.data() + buffer.size()) {
+            failures++;
+        }
+    }
+    counting = false;
+    if(failures > 0) {
+        std::cerr << "The photos were not deserialized in place." << std::endl;
+    }
+    if(allocations > 0) {
+        std::cerr << "Deserializing " << TEST_PHOTOS << " photos made " << allocations << " allocations." << std::endl;
+        failures++;
+    }
+    return failures;
+}
+
+int main() {
+    const std::size_t failures = check_install_path() + check_photo_deserialization();
+    if(failures > 0) {
+        std::cerr << failures << " checks failed." << std::endl;
+        return 1;
+    }
+    std::cout << "No model-sized copies, and no allocations to deserialize photos." << std::endl;
+    return 0;
+}
@@ -0,0 +1,219 @@
+#include <cmath>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <mxnet-component/inference_engine.hpp>
+#include <mxnet-component/params_format.hpp>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+ * Check the FP16 conversions. With MXNet, and the directory of an unpacked
+ * sample model as the argument, also check that the MXNet engine gives the
+ * same top-1 guesses for the sample photos with the parameters as uploaded,
+ * split in FP32 and split in FP16.
+ */
+
+using namespace sospdemo;
+
+static uint32_t float_bits(const float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    return x;
+}
+
+static bool is_half_nan(const uint16_t h) {
+    return (h & 0x7c00) == 0x7c00 && (h & 0x3ff) != 0;
+}
+
+/**
+ * Convert in blocks of 8, which is the F16C path when the compiler targets
+ * it, and one value at a time, which is always the scalar path; both must
+ * agree, and a half must survive the round trip through a float.
+ * @return the number of failures
+ */
+static std::size_t check_conversions() {
+    std::size_t failures = 0;
+    // 1 - every half
+    std::vector<uint16_t> halfs(65536);
+    for(std::size_t i = 0; i < halfs.size(); i++) {
+        halfs[i] = static_cast<uint16_t>(i);
+    }
+    std::vector<float> widened(halfs.size());
+    half_to_float(halfs.data(), widened.data(), halfs.size());
+    std::vector<uint16_t> narrowed(halfs.size());
+    float_to_half(widened.data(), narrowed.data(), widened.size());
+    for(std::size_t i = 0; i < halfs.size(); i++) {
+        float one;
+        uint16_t one_back;
+        half_to_float(&halfs[i], &one, 1);
+        float_to_half(&one, &one_back, 1);
+        const bool nan = is_half_nan(halfs[i]);
+        if(nan ? !(std::isnan(one) && std::isnan(widened[i])) : float_bits(one) != float_bits(widened[i])) {
+            std::cerr << "Half " << std::hex << halfs[i] << std::dec << " widens to " << widened[i]
+                      << " in blocks but to " << one << " alone." << std::endl;
+            failures++;
+        }
+        if(nan ? !(is_half_nan(narrowed[i]) && is_half_nan(one_back)) : (narrowed[i] != halfs[i] || one_back != halfs[i])) {
+            std::cerr << "Half " << std::hex << halfs[i] << " comes back as " << narrowed[i] << " in blocks and as "
+                      << one_back << std::dec << " alone." << std::endl;
+            failures++;
+        }
+    }
+    // 2 - floats from the subnormal halfs to past the largest half, including
+    // the values halfway between two halfs.
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<uint32_t> mantissa(0, 0x7fffff);
+    std::uniform_int_distribution<uint32_t> exponent(127 - 26, 127 + 17);
+    std::vector<float> floats;
+    for(int i = 0; i < (1 << 16); i++) {
+        uint32_t x = ((i & 1u) << 31) | (exponent(generator) << 23) | mantissa(generator);
+        if(i % 4 == 0) {
+            // exactly halfway between two normal halfs
+            x = (x & ~0x1fffu) | 0x1000;
+        }
+        float f;
+        std::memcpy(&f, &x, sizeof(f));
+        floats.push_back(f);
+    }
+    std::vector<uint16_t> block_halfs(floats.size());
+    float_to_half(floats.data(), block_halfs.data(), floats.size());
+    for(std::size_t i = 0; i < floats.size(); i++) {
+        uint16_t one;
+        float_to_half(&floats[i], &one, 1);
+        if(one != block_halfs[i]) {
+            std::cerr << "Float " << floats[i] << " narrows to " << std::hex << block_halfs[i]
+                      << " in blocks but to " << one << std::dec << " alone." << std::endl;
+            failures++;
+        }
+    }
+    return failures;
+}
+
+#ifdef WITH_MXNET
+/**
+ * @return the content of a file, empty if it cannot be read
+ */
+static std::string read_file(const std::string& file_path) {
+    std::ifstream stream(file_path, std::ios::binary);
+    return std::string{std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>()};
+}
+
+static bool ends_with(const std::string& s, const std::string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/**
+ * Install a model the way the function tier does, in the segment store.
+ * @return the model, bound to its segments in the store
+ */
+static Model make_model(const std::vector<std::string>& model_segments, const uint32_t params_format,
+                        std::map<uint64_t, Blob>& store) {
+    Model model;
+    model.params_format = params_format;
+    model.backend = kBackendMXNet;
+    for(const auto& segment : model_segments) {
+        const uint64_t segment_id = hash_bytes(segment.data(), segment.size());
+        store.emplace(segment_id, Blob(segment.data(), segment.size()));
+        model.segments.push_back(segment_id);
+    }
+    model.version = model.get_content_version();
+    model.bind_segments(store);
+    return model;
+}
+
+/**
+ * Run the sample photos of a model, e.g. the unpacked flower-model, with its
+ * parameters as uploaded, split in FP32 and split in FP16, and compare the
+ * top-1 guesses.
+ * @param model_dir - the directory with synset.txt, the *-symbol.json and
+ *        *.params files and the *.jpg sample photos
+ * @return the number of failures
+ */
+static std::size_t check_model(const std::string& model_dir) {
+    // 1 - the model files and the sample photos
+    std::string synset = read_file(model_dir + "/synset.txt");
+    std::string symbol;
+    std::string params;
+    std::vector<std::string> photo_files;
+    DIR* dir = opendir(model_dir.c_str());
+    if(dir == nullptr) {
+        std::cerr << "Cannot open the model directory " << model_dir << "." << std::endl;
+        return 1;
+    }
+    while(const struct dirent* entry = readdir(dir)) {
+        const std::string name = entry->d_name;
+        if(ends_with(name, "-symbol.json")) {
+            symbol = read_file(model_dir + "/" + name);
+        } else if(ends_with(name, ".params")) {
+            params = read_file(model_dir + "/" + name);
+        } else if(ends_with(name, ".jpg")) {
+            photo_files.push_back(model_dir + "/" + name);
+        }
+    }
+    closedir(dir);
+    if(synset.empty() || symbol.empty() || params.empty() || photo_files.empty()) {
+        std::cerr << "The model directory " << model_dir << " misses the synset, the symbol, the parameters or the photos." << std::endl;
+        return 1;
+    }
+
+    // 2 - the three installs of the model
+    std::vector<std::string> fp32_tensors;
+    std::vector<std::string> fp16_tensors;
+    if(split_params(params.data(), params.size(), false, fp32_tensors) != 0
+       || split_params(params.data(), params.size(), true, fp16_tensors) != 0) {
+        std::cerr << "Cannot split the parameters." << std::endl;
+        return 1;
+    }
+    std::vector<std::string> mxnet_segments = {synset, symbol, params};
+    std::vector<std::string> fp32_segments = {synset, symbol};
+    fp32_segments.insert(fp32_segments.end(), fp32_tensors.begin(), fp32_tensors.end());
+    std::vector<std::string> fp16_segments = {synset, symbol};
+    fp16_segments.insert(fp16_segments.end(), fp16_tensors.begin(), fp16_tensors.end());
+    std::map<uint64_t, Blob> store;
+    Model mxnet_model = make_model(mxnet_segments, kParamsMXNet, store);
+    Model fp32_model = make_model(fp32_segments, kParamsFP32, store);
+    Model fp16_model = make_model(fp16_segments, kParamsFP16, store);
+    std::unique_ptr<InferenceEngine> mxnet_engine = InferenceEngine::create(mxnet_model);
+    std::unique_ptr<InferenceEngine> fp32_engine = InferenceEngine::create(fp32_model);
+    std::unique_ptr<InferenceEngine> fp16_engine = InferenceEngine::create(fp16_model);
+
+    // 3 - the same top-1 guess for every photo
+    std::size_t failures = 0;
+    for(const auto& photo_file : photo_files) {
+        const std::string photo_data = read_file(photo_file);
+        const Photo photo(1, photo_data.data(), photo_data.size(), 1);
+        const Guess expected = mxnet_engine->inference(photo);
+        const Guess fp32 = fp32_engine->inference(photo);
+        const Guess fp16 = fp16_engine->inference(photo);
+        std::cout << photo_file << ": " << expected.guess << " (" << expected.p << "), FP32: " << fp32.guess
+                  << " (" << fp32.p << "), FP16: " << fp16.guess << " (" << fp16.p << ")." << std::endl;
+        if(expected.candidates.empty() || fp32.candidates != expected.candidates || fp16.candidates != expected.candidates) {
+            std::cerr << "The top-1 guess of " << photo_file << " changed." << std::endl;
+            failures++;
+        }
+    }
+    return failures;
+}
+#endif  // WITH_MXNET
+
+int main(int argc, char** argv) {
+    std::size_t failures = check_conversions();
+#ifdef WITH_MXNET
+    if(argc > 1) {
+        failures += check_model(argv[1]);
+    } else {
+        std::cout << "No sample model given, the model check is skipped." << std::endl;
+    }
+#endif
+    if(failures > 0) {
+        std::cerr << failures << " checks failed." << std::endl;
+        return 1;
+    }
+    std::cout << "The parameter formats are consistent." << std::endl;
+    return 0;
+}
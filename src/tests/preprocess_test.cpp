@@ -0,0 +1,103 @@
+#include <cstring>
+#include <iostream>
+#include <mxnet-component/preprocess.hpp>
+#include <random>
+#include <vector>
+
+/**
+ * Compare preprocess_photo() with the plain definition of the preprocessing,
+ * bit for bit. The test is built once per instruction set, see
+ * src/CMakeLists.txt, so each build checks the version of the kernel the
+ * compiler picks for it.
+ */
+
+#if defined(__AVX2__)
+#define PREPROCESS_PATH "AVX2"
+#elif defined(__SSE4_1__)
+#define PREPROCESS_PATH "SSE4.1"
+#else
+#define PREPROCESS_PATH "scalar"
+#endif
+
+// ctest counts this exit code as a skipped test.
+#define TEST_SKIPPED (77)
+
+using namespace sospdemo;
+
+/**
+ * The reference: center-crop, BGR to RGB, HWC to CHW, and x / 256.
+ */
+static void reference_preprocess(const unsigned char* bgr, const std::size_t row_stride, float* output) {
+    const int offset = (PREPROCESS_RESIZED_SIZE - PREPROCESS_INPUT_SIZE) / 2;
+    for(int c = 0; c < 3; c++) {
+        for(int i = 0; i < PREPROCESS_INPUT_SIZE; i++) {
+            for(int j = 0; j < PREPROCESS_INPUT_SIZE; j++) {
+                const unsigned char pixel = bgr[(i + offset) * row_stride + (j + offset) * 3 + (2 - c)];
+                output[(c * PREPROCESS_INPUT_SIZE + i) * PREPROCESS_INPUT_SIZE + j] = static_cast<float>(pixel) / 256;
+            }
+        }
+    }
+}
+
+/**
+ * @return the number of floats that differ from the reference
+ */
+static std::size_t check_photo(const std::vector<unsigned char>& bgr, const std::size_t row_stride) {
+    const std::size_t output_size = 3 * PREPROCESS_INPUT_SIZE * PREPROCESS_INPUT_SIZE;
+    std::vector<float> expected(output_size);
+    std::vector<float> output(output_size);
+    reference_preprocess(bgr.data(), row_stride, expected.data());
+    preprocess_photo(bgr.data(), row_stride, output.data());
+    std::size_t mismatches = 0;
+    for(std::size_t i = 0; i < output_size; i++) {
+        if(std::memcmp(&expected[i], &output[i], sizeof(float)) != 0) {
+            if(mismatches == 0) {
+                std::cerr << "First mismatch at " << i << ": " << output[i] << " instead of " << expected[i] << "." << std::endl;
+            }
+            mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+int main() {
+#if defined(__AVX2__)
+    if(!__builtin_cpu_supports("avx2")) {
+        std::cout << "This CPU does not support AVX2, skipping." << std::endl;
+        return TEST_SKIPPED;
+    }
+#elif defined(__SSE4_1__)
+    if(!__builtin_cpu_supports("sse4.1")) {
+        std::cout << "This CPU does not support SSE4.1, skipping." << std::endl;
+        return TEST_SKIPPED;
+    }
+#endif
+    std::size_t mismatches = 0;
+    // 1 - every byte value in every channel, with packed rows and with the
+    // padded rows of a cv::Mat view.
+    for(const std::size_t row_stride : {std::size_t{PREPROCESS_RESIZED_SIZE * 3}, std::size_t{PREPROCESS_RESIZED_SIZE * 3 + 13}}) {
+        std::vector<unsigned char> bgr(row_stride * PREPROCESS_RESIZED_SIZE);
+        for(std::size_t i = 0; i < bgr.size(); i++) {
+            bgr[i] = static_cast<unsigned char>(i * 7 + i / row_stride);
+        }
+        mismatches += check_photo(bgr, row_stride);
+    }
+    // 2 - random photos.
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<int> byte(0, 255);
+    for(int photo = 0; photo < 16; photo++) {
+        const std::size_t row_stride = PREPROCESS_RESIZED_SIZE * 3 + photo;
+        std::vector<unsigned char> bgr(row_stride * PREPROCESS_RESIZED_SIZE);
+        for(auto& value : bgr) {
+            value = static_cast<unsigned char>(byte(generator));
+        }
+        mismatches += check_photo(bgr, row_stride);
+    }
+    if(mismatches > 0) {
+        std::cerr << "The " << PREPROCESS_PATH << " preprocessing differs from the reference in "
+                  << mismatches << " values." << std::endl;
+        return 1;
+    }
+    std::cout << "The " << PREPROCESS_PATH << " preprocessing matches the reference." << std::endl;
+    return 0;
+}
@@ -9,8 +9,14 @@ if [[ -d ../../test ]]; then
 	    if [[ -d ../../build ]]; then
 		if [[ -d ../../build/CMakeFiles ]]; then
 		    if [[ -f ../../build/src/sospdemo ]]; then
-			echo "executing 'taskset --cpu-list $taskset_num ../../build/src/sospdemo server'"
-			taskset --cpu-list $taskset_num ../../build/src/sospdemo server
+			if grep -Eq '^[[:space:]]*cpu_plan[[:space:]]*=[[:space:]]*(latency|throughput|custom)' derecho.cfg; then
+			    # the cpu_plan in derecho.cfg partitions the cores itself.
+			    echo "executing '../../build/src/sospdemo server'"
+			    ../../build/src/sospdemo server
+			else
+			    echo "executing 'taskset --cpu-list $taskset_num ../../build/src/sospdemo server'"
+			    taskset --cpu-list $taskset_num ../../build/src/sospdemo server
+			fi
 		    else
 			echo "Error: you do not appear to have built the demo yet!"
 		    fi